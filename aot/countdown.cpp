@@ -0,0 +1,87 @@
+// Written by semistack's ahead of time compiler.
+
+#include "aot_runtime.hpp"
+
+#include <limits>
+#include <string>
+#include <utility>
+
+namespace {
+
+const vm::Value k0_1(std::string("done", 4));
+
+bool f0(vm::aot::Runtime& rt, vm::Value* sp);
+bool f1(vm::aot::Runtime& rt, vm::Value* sp);
+bool f2(vm::aot::Runtime& rt, vm::Value* sp);
+
+// main
+bool f0(vm::aot::Runtime& rt, vm::Value* sp)
+{
+    vm::Value* base = sp;
+    if ( ! rt.room(base, 1) ) return false;
+    rt.push(base[0], vm::Value(0x1.e848p+19f));
+    if ( ! f1(rt, base + 1) ) return false;
+    rt.push(base[0], vm::Value(0x1.e848p+19f));
+    rt._globals[0] = std::move(base[0]);
+    if ( ! f2(rt, base + 0) ) return false;
+    rt.push(base[0], k0_1);
+    rt.puts(base[0]);
+    return rt.stop(vm::ExitStatus::exit);
+}
+
+// count
+bool f1(vm::aot::Runtime& rt, vm::Value* sp)
+{
+    vm::Value* locals = sp - 1;
+    vm::Value* base = locals + 1;
+    if ( ! rt.room(base, 2) ) return false;
+    bool taken = false;
+start:
+    rt.push(base[0], locals[0]);
+    rt.push(base[1], vm::Value(0x0p+0f));
+    if ( ! rt.compare(vm::InstType::jeq, base[0], base[1], taken) ) return false;
+    if (taken) goto L7;
+    rt.push(base[0], locals[0]);
+    rt.push(base[1], vm::Value(0x1p+0f));
+    if ( ! rt.arithmetic(vm::InstType::sub, base[0], base[1]) ) return false;
+    rt.restart(locals, base + 1, 1);
+    goto start;
+L7:
+    rt.leave(locals, base, 0);
+    return true;
+}
+
+// spin
+bool f2(vm::aot::Runtime& rt, vm::Value* sp)
+{
+    vm::Value* base = sp;
+    if ( ! rt.room(base, 2) ) return false;
+    vm::Value* locals = rt.enter(1);
+    if ( ! locals ) return false;
+    bool taken = false;
+start:
+    rt.push(base[0], rt._globals[0]);
+    rt.push(base[1], vm::Value(0x0p+0f));
+    if ( ! rt.compare(vm::InstType::jeq, base[0], base[1], taken) ) return false;
+    if (taken) goto L10;
+    rt.push(base[0], rt._globals[0]);
+    rt.push(base[1], vm::Value(0x1p+0f));
+    if ( ! rt.arithmetic(vm::InstType::sub, base[0], base[1]) ) return false;
+    rt.push(base[1], base[0]);
+    rt._globals[0] = std::move(base[1]);
+    locals[0] = std::move(base[0]);
+    rt.restart(locals, locals + 1, 0);
+    goto start;
+L10:
+    rt.push(base[0], locals[0]);
+    rt.puts(base[0]);
+    rt.leave(1);
+    return true;
+}
+
+}
+
+vm::ExitStatus countdown(vm::aot::Runtime& rt)
+{
+    return rt.status(f0(rt, rt.stack()));
+}
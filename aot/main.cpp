@@ -0,0 +1,52 @@
+//
+//  main.cpp
+//  aot
+//
+//  Created by Zeke Medley on 2/21/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+//  Runs programs written by the ahead of time compiler in semistack/aot.hpp
+//  and checks what they print. Exits with 1 if any of them is wrong.
+//
+//  program.cpp and countdown.cpp are the compiler's output, checked in.
+//  semistack's tests write the same programs out again and fail if they don't
+//  match, so regenerate these when the compiler changes. Build this without
+//  optimizations too: countdown.cpp recurses a million calls deep in tail
+//  position and mustn't rely on the C++ compiler to turn those into jumps.
+
+#include "aot_runtime.hpp"
+
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Shout "hey!" three times and print 3 / 2.
+vm::ExitStatus program(vm::aot::Runtime& rt);
+// Count down from a million twice, once with arguments and once with
+// globals, and print "done".
+vm::ExitStatus countdown(vm::aot::Runtime& rt);
+
+namespace {
+
+// Runs entry and reports if it exited after printing expected.
+bool check(const std::string& name, vm::ExitStatus (*entry)(vm::aot::Runtime&),
+           const std::vector<std::string>& expected)
+{
+    std::vector<std::string> output;
+    vm::aot::Runtime rt([&](std::string s){ output.push_back(std::move(s)); });
+    const bool ok = entry(rt) == vm::ExitStatus::exit && output == expected;
+    std::cout << (ok ? "ok    " : "FAIL  ") << name << "\n";
+    return ok;
+}
+
+}
+
+int main()
+{
+    bool ok = check("program", program,
+                    {"hey!\n", "hey!\n", "hey!\n", "1.500000"});
+    ok = check("countdown", countdown, {"0.000000", "done"}) && ok;
+    return ok ? 0 : 1;
+}
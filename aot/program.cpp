@@ -0,0 +1,75 @@
+// Written by semistack's ahead of time compiler.
+
+#include "aot_runtime.hpp"
+
+#include <limits>
+#include <string>
+#include <utility>
+
+namespace {
+
+const vm::Value k0_1(std::string("hey", 3));
+const vm::Value k1_0(std::string("!\012", 2));
+
+bool f0(vm::aot::Runtime& rt, vm::Value* sp);
+bool f1(vm::aot::Runtime& rt, vm::Value* sp);
+bool f2(vm::aot::Runtime& rt, vm::Value* sp);
+
+// main
+bool f0(vm::aot::Runtime& rt, vm::Value* sp)
+{
+    vm::Value* base = sp;
+    if ( ! rt.room(base, 2) ) return false;
+    bool taken = false;
+    rt.push(base[0], vm::Value(0x0p+0f));
+    rt._globals[0] = std::move(base[0]);
+L2:
+    rt.push(base[0], k0_1);
+    if ( ! f1(rt, base + 1) ) return false;
+    rt.push(base[0], rt._globals[0]);
+    rt.push(base[1], vm::Value(0x1p+0f));
+    if ( ! rt.arithmetic(vm::InstType::add, base[0], base[1]) ) return false;
+    rt.push(base[1], base[0]);
+    rt._globals[0] = std::move(base[1]);
+    rt.push(base[1], vm::Value(0x1.8p+1f));
+    if ( ! rt.compare(vm::InstType::jlt, base[0], base[1], taken) ) return false;
+    if (taken) goto L2;
+    rt.push(base[0], rt._globals[0]);
+    if ( ! f2(rt, base + 1) ) return false;
+    rt.puts(base[0]);
+    return rt.stop(vm::ExitStatus::exit);
+}
+
+// shout
+bool f1(vm::aot::Runtime& rt, vm::Value* sp)
+{
+    vm::Value* base = sp;
+    if ( ! rt.room(base, 1) ) return false;
+    vm::Value* locals = rt.enter(1);
+    if ( ! locals ) return false;
+    rt.push(base[0], k1_0);
+    if ( ! rt.arithmetic(vm::InstType::add, base[-1], base[0]) ) return false;
+    rt.puts(base[-1]);
+    rt.leave(1);
+    return true;
+}
+
+// half
+bool f2(vm::aot::Runtime& rt, vm::Value* sp)
+{
+    vm::Value* locals = sp - 1;
+    vm::Value* base = locals + 1;
+    if ( ! rt.room(base, 2) ) return false;
+    rt.push(base[0], locals[0]);
+    rt.push(base[1], vm::Value(0x1p+1f));
+    if ( ! rt.arithmetic(vm::InstType::div, base[0], base[1]) ) return false;
+    rt.leave(locals, base, 1);
+    return true;
+}
+
+}
+
+vm::ExitStatus program(vm::aot::Runtime& rt)
+{
+    return rt.status(f0(rt, rt.stack()));
+}
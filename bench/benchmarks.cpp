@@ -0,0 +1,221 @@
+//
+//  benchmarks.cpp
+//  bench
+//
+//  Created by Zeke Medley on 2/21/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#include "benchmarks.hpp"
+
+#include "semistack/function.hpp"
+#include "semistack/instruction.hpp"
+
+using namespace vm;
+
+namespace {
+
+// fib(27) the slow way with arguments passed in place.
+void fib(VM& v)
+{
+    Function fib;
+    fib._arity = 1;
+    fib.addInstruction(InstType::ll, 0);
+    fib.addInstruction(InstType::pi, 2);
+    fib.addInstruction(InstType::jlt, "small");
+    fib.addInstruction(InstType::ll, 0);
+    fib.addInstruction(InstType::pi, 1);
+    fib.addInstruction(InstType::sub);
+    fib.addInstruction(InstType::call, "fib");
+    fib.addInstruction(InstType::ll, 0);
+    fib.addInstruction(InstType::pi, 2);
+    fib.addInstruction(InstType::sub);
+    fib.addInstruction(InstType::call, "fib");
+    fib.addInstruction(InstType::add);
+    fib.addInstruction(InstType::ret);
+    fib.addInstruction(InstType::label, "small");
+    fib.addInstruction(InstType::ll, 0);
+    fib.addInstruction(InstType::ret);
+    
+    Function main;
+    main.addInstruction(InstType::pi, 27);
+    main.addInstruction(InstType::call, "fib");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+    v.addFunction(std::move(fib), "fib");
+}
+
+// Adds i to a total for i from 0 to a million, all in locals.
+void loop(VM& v)
+{
+    Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::ll, 1);
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 1000000);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::ll, 1);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+}
+
+// Builds a string of 40000 characters one at a time.
+void strings(VM& v)
+{
+    Function main;
+    main.addInstruction(InstType::pi, "");
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::pi, "x");
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::ll, 1);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::pi, 40000);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::ll, 1);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+}
+
+// Recurses 5000 calls deep without tail calls, 200 times.
+void calls(VM& v)
+{
+    Function depth;
+    depth._arity = 1;
+    depth.addInstruction(InstType::ll, 0);
+    depth.addInstruction(InstType::pi, 0);
+    depth.addInstruction(InstType::jgt, "more");
+    depth.addInstruction(InstType::pi, 0);
+    depth.addInstruction(InstType::ret);
+    depth.addInstruction(InstType::label, "more");
+    depth.addInstruction(InstType::ll, 0);
+    depth.addInstruction(InstType::pi, 1);
+    depth.addInstruction(InstType::sub);
+    depth.addInstruction(InstType::call, "depth");
+    depth.addInstruction(InstType::pi, 1);
+    depth.addInstruction(InstType::add);
+    depth.addInstruction(InstType::ret);
+    
+    Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::pi, 5000);
+    main.addInstruction(InstType::call, "depth");
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 200);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::ll, 1);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+    v.addFunction(std::move(depth), "depth");
+}
+
+// The loop benchmark with its counter and total in globals.
+void globals(VM& v)
+{
+    Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sg, 0);
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sg, 1);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::lg, 1);
+    main.addInstruction(InstType::lg, 0);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::sg, 1);
+    main.addInstruction(InstType::lg, 0);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sg, 0);
+    main.addInstruction(InstType::pi, 1000000);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::lg, 1);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+}
+
+// A generated function of 20000 blocks that each store to a local, do some
+// arithmetic on constants, and jump to the next block. The time is spent
+// assembling, optimizing, linking, lowering, and verifying it, not running
+// it.
+void assemble(VM& v)
+{
+    constexpr int kBlocks = 20000;
+    Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 0);
+    for (int i = 0; i < kBlocks; ++i)
+    {
+        const std::string next = "block" + std::to_string(i + 1);
+        main.addInstruction(InstType::pi, i);
+        main.addInstruction(InstType::pi, 2);
+        main.addInstruction(InstType::mul);
+        main.addInstruction(InstType::sl, 1 + i % 200);
+        main.addInstruction(InstType::ll, 0);
+        main.addInstruction(InstType::pi, 1);
+        main.addInstruction(InstType::add);
+        main.addInstruction(InstType::sl, 0);
+        main.addInstruction(InstType::jump, next);
+        main.addInstruction(InstType::label, next);
+    }
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+}
+
+}
+
+std::vector<bench::Benchmark> bench::benchmarks()
+{
+    return {
+        {"fib", "fib(27) with arguments passed in place", fib,
+            {"196418.000000"}},
+        {"loop", "a million trips around a loop on locals", loop,
+            {"499940360192.000000"}},
+        {"strings", "40000 one character string concatenations", strings,
+            {"40000.000000"}},
+        {"calls", "200 call chains 5000 calls deep", calls,
+            {"5000.000000"}},
+        {"globals", "a million trips around a loop on globals", globals,
+            {"499940360192.000000"}},
+        {"assemble", "assembling and verifying a 180000 instruction function",
+            assemble, {"20000.000000"}},
+    };
+}
@@ -0,0 +1,35 @@
+//
+//  benchmarks.hpp
+//  bench
+//
+//  Created by Zeke Medley on 2/21/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "semistack/vm.hpp"
+
+namespace bench {
+
+// A program to time. Each run builds a fresh VM with the given options, adds
+// the program's functions, and runs it.
+struct Benchmark
+{
+    std::string _name;
+    std::string _description;
+    // Adds the program to v.
+    std::function<void(vm::VM& v)> _build;
+    // What the program prints, one entry per puts. A run that prints anything
+    // else has gone wrong and its time doesn't count.
+    std::vector<std::string> _expected;
+};
+
+// Every benchmark, in the order they run.
+std::vector<Benchmark> benchmarks();
+
+}
@@ -0,0 +1,155 @@
+//
+//  counters.cpp
+//  bench
+//
+//  Created by Zeke Medley on 2/22/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#include "counters.hpp"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+#endif
+
+using namespace bench;
+
+const char* Counters::name(Event e)
+{
+    switch (e)
+    {
+        case cycles: return "cycles";
+        case instructions: return "instructions";
+        case branchMisses: return "branch_misses";
+        case l1dMisses: return "l1d_misses";
+    }
+    return "";
+}
+
+bool Counters::available() const
+{
+    for (int fd : _fds)
+    {
+        if (fd >= 0) return true;
+    }
+    return false;
+}
+
+#if defined(__linux__)
+
+namespace {
+
+// The type and config perf_event_open takes for e.
+std::pair<std::uint32_t, std::uint64_t> event(Counters::Event e)
+{
+    switch (e)
+    {
+        case Counters::cycles:
+            return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES};
+        case Counters::instructions:
+            return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS};
+        case Counters::branchMisses:
+            return {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES};
+        case Counters::l1dMisses:
+            return {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+                | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+                | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)};
+    }
+    return {0, 0};
+}
+
+}
+
+Counters::Counters()
+{
+    for (std::size_t i = 0; i < kEventCount; ++i)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        const auto [type, config] = event(static_cast<Event>(i));
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        
+        _fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1,
+                                           -1, 0));
+        if (_fds[i] < 0 && _why.empty())
+        {
+            _why = std::string("perf_event_open: ") + std::strerror(errno);
+        }
+    }
+}
+
+Counters::~Counters()
+{
+    for (int fd : _fds)
+    {
+        if (fd >= 0) close(fd);
+    }
+}
+
+void Counters::start()
+{
+    for (int fd : _fds)
+    {
+        if (fd < 0) continue;
+        ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+Counters::Counts Counters::stop()
+{
+    for (int fd : _fds)
+    {
+        if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+    
+    Counts counts;
+    for (std::size_t i = 0; i < kEventCount; ++i)
+    {
+        // The count, how long it was enabled, and how long it ran for.
+        std::uint64_t values[3];
+        if (_fds[i] < 0
+            || read(_fds[i], values, sizeof(values)) != sizeof(values)
+            || values[2] == 0)
+        {
+            continue;
+        }
+        counts[i] = values[2] == values[1] ? values[0]
+            : static_cast<std::uint64_t>(static_cast<double>(values[0])
+                                         * values[1] / values[2]);
+    }
+    return counts;
+}
+
+#else
+
+Counters::Counters()
+{
+    _fds.fill(-1);
+    _why = "Hardware counters are only read on Linux";
+}
+
+Counters::~Counters() {}
+
+void Counters::start() {}
+
+Counters::Counts Counters::stop()
+{
+    return Counts();
+}
+
+#endif
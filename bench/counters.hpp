@@ -0,0 +1,67 @@
+//
+//  counters.hpp
+//  bench
+//
+//  Created by Zeke Medley on 2/22/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <string>
+
+//  Hardware performance counters for the calling thread, read with
+//  perf_event_open. Wall time says that something got faster or slower and
+//  these say why: fewer instructions, fewer mispredicted branches, or fewer
+//  cache misses. Each event is opened on its own, so a machine that lacks one
+//  (virtual machines often have none) still counts the rest. Only user space
+//  is counted so that it works with the default perf_event_paranoid setting.
+//
+//  Only Linux has perf_event_open. Elsewhere nothing is ever counted.
+
+namespace bench {
+
+class Counters
+{
+public:
+    enum Event
+    {
+        cycles,
+        instructions,
+        branchMisses,
+        l1dMisses, // Reads that missed the L1 data cache.
+    };
+    static constexpr std::size_t kEventCount = 4;
+    using Counts = std::array<std::optional<std::uint64_t>, kEventCount>;
+    
+    // Opens every event that it can.
+    Counters();
+    ~Counters();
+    
+    Counters(const Counters&) = delete;
+    Counters& operator=(const Counters&) = delete;
+    
+    // Could any event be opened? If not, why() says what went wrong.
+    bool available() const;
+    const std::string& why() const { return _why; }
+    
+    // Zeroes the counts and starts counting.
+    void start();
+    // Stops counting and returns what each event counted since start.
+    // Events that couldn't be opened, or that the kernel never got to
+    // schedule, have no count. Counts for events that had to share the
+    // hardware with others are scaled up to the whole time.
+    Counts stop();
+    
+    // The name used for e in reports.
+    static const char* name(Event e);
+    
+private:
+    std::array<int, kEventCount> _fds;
+    std::string _why;
+};
+
+}
@@ -0,0 +1,489 @@
+//
+//  main.cpp
+//  bench
+//
+//  Created by Zeke Medley on 2/21/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+//  Runs the benchmarks in benchmarks.cpp and reports how long they took.
+//
+//      bench [--engine simple|threaded|tailcall|registers|jit] [--runs N]
+//            [--warmup N] [--filter NAME] [--label TEXT] [--json FILE]
+//            [--counters on|off]
+//
+//  Each benchmark is run --warmup times without being timed and then --runs
+//  times with. A table of the times goes to stdout and, with --json, the same
+//  numbers go to FILE so that runs from different versions can be compared.
+//
+//  Timed runs also read the hardware counters in counters.hpp where the
+//  machine has them. On the simple engine their medians are also divided by
+//  how many VM instructions a benchmark runs, which one more run with
+//  Options::_profile counts, so that changes to dispatch can be judged by
+//  what they cost per instruction. The other engines don't count
+//  instructions so they only get the medians.
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "benchmarks.hpp"
+#include "counters.hpp"
+
+#include "semistack/vm.hpp"
+
+namespace {
+
+struct Settings
+{
+    vm::Options _options;
+    std::string _engine = "threaded";
+    std::size_t _runs = 10;
+    std::size_t _warmup = 2;
+    std::string _filter;
+    std::string _label;
+    std::string _json;
+    bool _counters = true;
+};
+
+// How a benchmark did. Times are in seconds.
+struct Result
+{
+    std::string _name;
+    std::string _description;
+    std::vector<double> _times;
+    double _min = 0;
+    double _median = 0;
+    double _p90 = 0;
+    double _p99 = 0;
+    double _max = 0;
+    double _mean = 0;
+    double _stddev = 0;
+    // The median of each hardware counter over the timed runs, if it could
+    // be read.
+    std::array<std::optional<double>, bench::Counters::kEventCount> _counts;
+    // How many VM instructions one run dispatches, if the engine counts
+    // them.
+    std::optional<std::size_t> _vmInstructions;
+    
+    std::optional<double> count(bench::Counters::Event e) const
+    {
+        return _counts[e];
+    }
+    // Instructions per cycle.
+    std::optional<double> ipc() const
+    {
+        auto i = count(bench::Counters::instructions);
+        auto c = count(bench::Counters::cycles);
+        if ( ! i || ! c || c.value() == 0 )
+        {
+            return std::nullopt;
+        }
+        return i.value() / c.value();
+    }
+    // Count of e per VM instruction.
+    std::optional<double> perInstruction(bench::Counters::Event e) const
+    {
+        if ( ! count(e) || ! _vmInstructions || _vmInstructions.value() == 0 )
+        {
+            return std::nullopt;
+        }
+        return count(e).value() / _vmInstructions.value();
+    }
+};
+
+const std::map<std::string, vm::Engine> kEngines = {
+    {"simple", vm::Engine::simple},
+    {"threaded", vm::Engine::threaded},
+    {"tailcall", vm::Engine::tailcall},
+    {"registers", vm::Engine::registers},
+    {"jit", vm::Engine::jit},
+};
+
+std::optional<Settings> parse(int argc, const char* argv[])
+{
+    Settings s;
+    for (int i = 1; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (i + 1 == argc)
+        {
+            std::cerr << "Missing value for " << arg << "\n";
+            return std::nullopt;
+        }
+        const std::string value = argv[++i];
+        if (arg == "--engine")
+        {
+            auto engine = kEngines.find(value);
+            if (engine == kEngines.end())
+            {
+                std::cerr << "Unknown engine: " << value << "\n";
+                return std::nullopt;
+            }
+            s._engine = value;
+            s._options._engine = engine->second;
+        } else if (arg == "--runs")
+        {
+            s._runs = std::max(1ul, std::strtoul(value.c_str(), nullptr, 10));
+        } else if (arg == "--warmup")
+        {
+            s._warmup = std::strtoul(value.c_str(), nullptr, 10);
+        } else if (arg == "--filter")
+        {
+            s._filter = value;
+        } else if (arg == "--label")
+        {
+            s._label = value;
+        } else if (arg == "--json")
+        {
+            s._json = value;
+        } else if (arg == "--counters" && (value == "on" || value == "off"))
+        {
+            s._counters = value == "on";
+        } else
+        {
+            std::cerr << "Unknown option: " << arg << "\n";
+            return std::nullopt;
+        }
+    }
+    return s;
+}
+
+// Checks what a run of b printed and how it stopped.
+bool check(const bench::Benchmark& b, vm::ExitStatus status,
+           const std::vector<std::string>& output)
+{
+    if (status == vm::ExitStatus::exit && output == b._expected)
+    {
+        return true;
+    }
+    std::cerr << b._name << " went wrong. It printed:\n";
+    for (const auto& line : output)
+    {
+        std::cerr << "    " << line << "\n";
+    }
+    return false;
+}
+
+// Runs b once. Returns how long it took, or nothing if it printed the wrong
+// thing or didn't exit. With counters, what they counted over the same time
+// goes in counts.
+std::optional<double> runOnce(const bench::Benchmark& b,
+                              const vm::Options& options,
+                              bench::Counters* counters = nullptr,
+                              bench::Counters::Counts* counts = nullptr)
+{
+    std::vector<std::string> output;
+    if (counters)
+    {
+        counters->start();
+    }
+    const auto start = std::chrono::steady_clock::now();
+    vm::VM v([&](std::string s){ output.push_back(std::move(s)); }, options);
+    b._build(v);
+    const vm::ExitStatus status = v.run("main");
+    const auto end = std::chrono::steady_clock::now();
+    if (counters)
+    {
+        *counts = counters->stop();
+    }
+    
+    if ( ! check(b, status, output) )
+    {
+        return std::nullopt;
+    }
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// How many VM instructions a run of b dispatches, or nothing if it went
+// wrong. Only the simple engine counts them so options has to pick it.
+std::optional<std::size_t> vmInstructions(const bench::Benchmark& b,
+                                          vm::Options options)
+{
+    options._profile = true;
+    std::vector<std::string> output;
+    vm::VM v([&](std::string s){ output.push_back(std::move(s)); }, options);
+    b._build(v);
+    if ( ! check(b, v.run("main"), output) )
+    {
+        return std::nullopt;
+    }
+    std::size_t total = 0;
+    for (const vm::FunctionProfile& p : v.profile())
+    {
+        total += p._instructions;
+    }
+    return total;
+}
+
+// The value that fraction p of sorted is at or below, interpolating between
+// neighbours.
+double percentile(const std::vector<double>& sorted, double p)
+{
+    const double at = p * (sorted.size() - 1);
+    const std::size_t below = static_cast<std::size_t>(at);
+    const std::size_t above = std::min(below + 1, sorted.size() - 1);
+    return sorted[below] + (at - below) * (sorted[above] - sorted[below]);
+}
+
+// The median of each counter over runs that counted it.
+std::array<std::optional<double>, bench::Counters::kEventCount>
+medians(const std::vector<bench::Counters::Counts>& counts)
+{
+    std::array<std::optional<double>, bench::Counters::kEventCount> r;
+    for (std::size_t e = 0; e < r.size(); ++e)
+    {
+        std::vector<double> values;
+        for (const auto& c : counts)
+        {
+            if (c[e])
+            {
+                values.push_back(static_cast<double>(c[e].value()));
+            }
+        }
+        if ( ! values.empty() )
+        {
+            std::sort(values.begin(), values.end());
+            r[e] = percentile(values, 0.5);
+        }
+    }
+    return r;
+}
+
+Result summarize(const bench::Benchmark& b, std::vector<double> times)
+{
+    Result r;
+    r._name = b._name;
+    r._description = b._description;
+    r._times = times;
+    std::sort(times.begin(), times.end());
+    r._min = times.front();
+    r._median = percentile(times, 0.5);
+    r._p90 = percentile(times, 0.9);
+    r._p99 = percentile(times, 0.99);
+    r._max = times.back();
+    for (double t : times)
+    {
+        r._mean += t;
+    }
+    r._mean /= times.size();
+    for (double t : times)
+    {
+        r._stddev += (t - r._mean) * (t - r._mean);
+    }
+    r._stddev = std::sqrt(r._stddev / times.size());
+    return r;
+}
+
+std::string quote(const std::string& s)
+{
+    std::string r = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            r += '\\';
+        }
+        r += c;
+    }
+    return r + "\"";
+}
+
+std::string json(std::optional<double> v)
+{
+    if ( ! v )
+    {
+        return "null";
+    }
+    std::ostringstream s;
+    s << std::setprecision(9) << v.value();
+    return s.str();
+}
+
+// v to the given number of decimals, or a dash.
+std::string cell(std::optional<double> v, int decimals)
+{
+    if ( ! v )
+    {
+        return "-";
+    }
+    std::ostringstream s;
+    s << std::fixed << std::setprecision(decimals) << v.value();
+    return s.str();
+}
+
+void writeJson(std::ostream& out, const Settings& s,
+               const std::vector<Result>& results)
+{
+    out << std::setprecision(9);
+    out << "{\n"
+        << "  \"label\": " << quote(s._label) << ",\n"
+        << "  \"engine\": " << quote(s._engine) << ",\n"
+        << "  \"runs\": " << s._runs << ",\n"
+        << "  \"warmup\": " << s._warmup << ",\n"
+        << "  \"benchmarks\": [";
+    for (std::size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        out << (i ? "," : "") << "\n    {\n"
+            << "      \"name\": " << quote(r._name) << ",\n"
+            << "      \"description\": " << quote(r._description) << ",\n"
+            << "      \"seconds\": {\"min\": " << r._min
+            << ", \"median\": " << r._median
+            << ", \"p90\": " << r._p90
+            << ", \"p99\": " << r._p99
+            << ", \"max\": " << r._max
+            << ", \"mean\": " << r._mean
+            << ", \"stddev\": " << r._stddev << "},\n"
+            << "      \"times\": [";
+        for (std::size_t t = 0; t < r._times.size(); ++t)
+        {
+            out << (t ? ", " : "") << r._times[t];
+        }
+        out << "]";
+        if ( ! s._counters )
+        {
+            out << "\n    }";
+            continue;
+        }
+        out << ",\n"
+            << "      \"vm_instructions\": "
+            << (r._vmInstructions ? std::to_string(r._vmInstructions.value())
+                                  : "null") << ",\n"
+            << "      \"counters\": {";
+        for (std::size_t e = 0; e < r._counts.size(); ++e)
+        {
+            const auto event = static_cast<bench::Counters::Event>(e);
+            out << (e ? ", " : "") << quote(bench::Counters::name(event))
+                << ": " << json(r.count(event));
+        }
+        out << ", \"ipc\": " << json(r.ipc())
+            << ", \"instructions_per_vm_instruction\": "
+            << json(r.perInstruction(bench::Counters::instructions))
+            << "}\n    }";
+    }
+    out << "\n  ]\n}\n";
+}
+
+}
+
+int main(int argc, const char* argv[])
+{
+    auto settings = parse(argc, argv);
+    if ( ! settings )
+    {
+        return 2;
+    }
+    const Settings& s = settings.value();
+    
+    std::optional<bench::Counters> counters;
+    if (s._counters)
+    {
+        counters.emplace();
+    }
+    
+    std::cout << "engine " << s._engine << ", " << s._warmup << " warmup and "
+              << s._runs << " timed runs each, times in ms\n";
+    if (counters && ! counters->why().empty())
+    {
+        std::cout << "missing hardware counters: " << counters->why() << "\n";
+    }
+    // The per op columns need a count of VM instructions from the engine
+    // being measured, and only the simple engine keeps one.
+    const bool perOp = counters
+        && s._options._engine == vm::Engine::simple;
+    if (counters && ! perOp)
+    {
+        std::cout << "per op columns are only filled in for --engine simple\n";
+    }
+    std::cout << "\n" << std::left << std::setw(10) << "benchmark" << std::right
+              << std::setw(10) << "min" << std::setw(10) << "median"
+              << std::setw(10) << "p90" << std::setw(10) << "max";
+    if (counters)
+    {
+        // Per VM instruction: CPU instructions, branch misses, and L1d misses.
+        std::cout << std::setw(8) << "IPC" << std::setw(10) << "ins/op"
+                  << std::setw(10) << "brmis/op" << std::setw(10) << "l1d/op";
+    }
+    std::cout << "\n";
+    
+    std::vector<Result> results;
+    for (const bench::Benchmark& b : bench::benchmarks())
+    {
+        if ( ! s._filter.empty() && b._name != s._filter )
+        {
+            continue;
+        }
+        for (std::size_t i = 0; i < s._warmup; ++i)
+        {
+            if ( ! runOnce(b, s._options) )
+            {
+                return 1;
+            }
+        }
+        std::vector<double> times;
+        std::vector<bench::Counters::Counts> counts(s._runs);
+        for (std::size_t i = 0; i < s._runs; ++i)
+        {
+            auto t = runOnce(b, s._options, counters ? &*counters : nullptr,
+                             &counts[i]);
+            if ( ! t )
+            {
+                return 1;
+            }
+            times.push_back(t.value());
+        }
+        
+        Result r = summarize(b, std::move(times));
+        std::cout << std::left << std::setw(10) << r._name << std::right
+                  << std::fixed << std::setprecision(2)
+                  << std::setw(10) << r._min * 1000
+                  << std::setw(10) << r._median * 1000
+                  << std::setw(10) << r._p90 * 1000
+                  << std::setw(10) << r._max * 1000;
+        if (counters)
+        {
+            if (perOp)
+            {
+                auto instructions = vmInstructions(b, s._options);
+                if ( ! instructions )
+                {
+                    return 1;
+                }
+                r._vmInstructions = instructions;
+            }
+            r._counts = medians(counts);
+            std::cout << std::setw(8) << cell(r.ipc(), 2)
+                      << std::setw(10)
+                      << cell(r.perInstruction(bench::Counters::instructions), 1)
+                      << std::setw(10)
+                      << cell(r.perInstruction(bench::Counters::branchMisses), 3)
+                      << std::setw(10)
+                      << cell(r.perInstruction(bench::Counters::l1dMisses), 3);
+        }
+        std::cout << "\n";
+        results.push_back(r);
+    }
+    
+    if ( ! s._json.empty() )
+    {
+        std::ofstream out(s._json);
+        writeJson(out, s, results);
+        if ( ! out )
+        {
+            std::cerr << "Couldn't write " << s._json << "\n";
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,456 @@
+//
+//  aot.cpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/20/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#include "aot.hpp"
+#include "logger.hpp"
+
+#include <cctype>
+#include <cmath>
+#include <set>
+#include <sstream>
+
+using namespace vm;
+
+namespace {
+
+using FnIndex = std::vector<Function>::size_type;
+
+std::string functionName(FnIndex index)
+{
+    return "f" + std::to_string(index);
+}
+
+std::string constantName(FnIndex fn, std::size_t index)
+{
+    return "k" + std::to_string(fn) + "_" + std::to_string(index);
+}
+
+// The stack slot depth values above where the function's values start.
+std::string slot(std::int32_t depth)
+{
+    return "base[" + std::to_string(depth) + "]";
+}
+
+bool isIdentifier(const std::string& s)
+{
+    if (s.empty() || std::isdigit(static_cast<unsigned char>(s[0])))
+    {
+        return false;
+    }
+    for (char c : s)
+    {
+        if ( ! std::isalnum(static_cast<unsigned char>(c)) && c != '_' )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// A C++ expression for the number n that gives back exactly n.
+std::string numberLiteral(float n)
+{
+    if (std::isnan(n))
+    {
+        return "std::numeric_limits<float>::quiet_NaN()";
+    }
+    if (std::isinf(n))
+    {
+        return std::string(n < 0 ? "-" : "")
+            + "std::numeric_limits<float>::infinity()";
+    }
+    std::ostringstream s;
+    s << std::hexfloat << n << "f";
+    return s.str();
+}
+
+// A C++ string literal holding s, which may have any bytes in it.
+std::string stringLiteral(const std::string& s)
+{
+    std::ostringstream r;
+    r << '"';
+    for (unsigned char c : s)
+    {
+        if (c == '"' || c == '\\')
+        {
+            r << '\\' << c;
+        } else if (std::isprint(c))
+        {
+            r << c;
+        } else
+        {
+            // Octal escapes stop after three digits so whatever follows can't
+            // run into them.
+            r << '\\' << static_cast<char>('0' + (c >> 6))
+              << static_cast<char>('0' + ((c >> 3) & 7))
+              << static_cast<char>('0' + (c & 7));
+        }
+    }
+    r << '"';
+    return r.str();
+}
+
+// A comment line naming the function, which could be anything.
+std::string comment(const std::string& name)
+{
+    std::string r = "// ";
+    for (unsigned char c : name)
+    {
+        r += std::isprint(c) ? static_cast<char>(c) : '?';
+    }
+    return r;
+}
+
+class Emitter
+{
+public:
+    Emitter(const std::vector<Function>& functions, std::ostream& out)
+        : _functions(functions), _out(out) {}
+
+    // Writes out the string constants that the function at index uses.
+    bool constants(FnIndex index);
+    // Writes out the function at index.
+    bool function(FnIndex index, const std::string& name);
+
+private:
+    bool instruction(const Function& fn, std::size_t pc, std::int32_t depth);
+    // Can the tail call at pc in fn jump back to the start of fn?
+    bool restarts(const Function& fn, std::size_t pc) const;
+    bool fail(std::size_t pc, const std::string& what);
+
+    void line(const std::string& s) { _out << "    " << s << "\n"; }
+
+    const std::vector<Function>& _functions;
+    std::ostream& _out;
+    FnIndex _index = 0;
+};
+
+bool Emitter::constants(FnIndex index)
+{
+    const Function& fn = _functions[index];
+    for (std::size_t i = 0; i < fn._constants.size(); ++i)
+    {
+        const Value& v = fn._constants[i];
+        if (v.isFunction())
+        {
+            logger()->error("Function " + std::to_string(index)
+                            + ": Can't compile function constants ahead of time.");
+            return false;
+        }
+        if (v.isString())
+        {
+            const std::string& s = v.asString();
+            _out << "const vm::Value " << constantName(index, i)
+                 << "(std::string(" << stringLiteral(s) << ", "
+                 << s.size() << "));\n";
+        }
+    }
+    return true;
+}
+
+bool Emitter::function(FnIndex index, const std::string& name)
+{
+    _index = index;
+    const Function& fn = _functions[index];
+
+    // Jump targets get labels. Only jumps that can run count as the rest may
+    // land on code that isn't written out.
+    std::set<std::size_t> targets;
+    bool compares = false;
+    bool restarted = false;
+    for (std::size_t pc = 0; pc < fn._code.size(); ++pc)
+    {
+        const Word w = fn._code[pc];
+        switch (opcode(w))
+        {
+            case InstType::tailcall:
+                restarted = restarted || restarts(fn, pc);
+                break;
+            case InstType::jeq:
+            case InstType::jneq:
+            case InstType::jlt:
+            case InstType::jgt:
+                compares = compares || fn._depths[pc];
+                [[fallthrough]];
+            case InstType::jump:
+                if (fn._depths[pc])
+                {
+                    targets.insert(pc + operand(w));
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    _out << comment(name) << "\n";
+    _out << "bool " << functionName(index)
+         << "(vm::aot::Runtime& rt, vm::Value* sp)\n{\n";
+    if (fn._arity)
+    {
+        // Arguments are already where the first locals go and the stack
+        // above them is clear.
+        line("vm::Value* locals = sp - " + std::to_string(fn._arity.value())
+             + ";");
+        line("vm::Value* base = locals + " + std::to_string(fn._localCount)
+             + ";");
+        line("if ( ! rt.room(base, " + std::to_string(fn._maxStack)
+             + ") ) return false;");
+    } else
+    {
+        line("vm::Value* base = sp;");
+        line("if ( ! rt.room(base, " + std::to_string(fn._maxStack)
+             + ") ) return false;");
+        if (fn._localCount)
+        {
+            line("vm::Value* locals = rt.enter("
+                 + std::to_string(fn._localCount) + ");");
+            line("if ( ! locals ) return false;");
+        }
+    }
+    if (compares)
+    {
+        line("bool taken = false;");
+    }
+    if (restarted)
+    {
+        _out << "start:\n";
+    }
+
+    for (std::size_t pc = 0; pc < fn._code.size(); ++pc)
+    {
+        if ( ! fn._depths[pc] )
+        {
+            continue;
+        }
+        if (targets.count(pc))
+        {
+            _out << "L" << pc << ":\n";
+        }
+        if ( ! instruction(fn, pc, fn._depths[pc].value()) )
+        {
+            return false;
+        }
+    }
+    _out << "}\n\n";
+    return true;
+}
+
+bool Emitter::instruction(const Function& fn, std::size_t pc,
+                          std::int32_t depth)
+{
+    const Word w = fn._code[pc];
+    const std::int32_t op = operand(w);
+    const std::string top = slot(depth - 1);
+    const std::string next = slot(depth);
+    const std::string type = "vm::InstType::" + to_string(opcode(w));
+
+    // Leaves the frame before a ret or tailcall and says where the stack
+    // top is after.
+    auto leave = [&]()
+    {
+        if (fn._arity)
+        {
+            line("rt.leave(locals, base, " + std::to_string(depth) + ");");
+            return "locals + " + std::to_string(depth);
+        }
+        if (fn._localCount)
+        {
+            line("rt.leave(" + std::to_string(fn._localCount) + ");");
+        }
+        return "base + " + std::to_string(depth);
+    };
+
+    switch (opcode(w))
+    {
+        case InstType::pi:
+        {
+            const Value& v = fn._constants[op];
+            if (v.isNumber())
+            {
+                line("rt.push(" + next + ", vm::Value("
+                     + numberLiteral(v.asNumber()) + "));");
+            } else
+            {
+                line("rt.push(" + next + ", " + constantName(_index, op) + ");");
+            }
+            return true;
+        }
+        case InstType::sl:
+            line("locals[" + std::to_string(op) + "] = std::move(" + top
+                 + ");");
+            return true;
+        case InstType::ll:
+            line("rt.push(" + next + ", locals[" + std::to_string(op) + "]);");
+            return true;
+        case InstType::sg:
+            line("rt._globals[" + std::to_string(op) + "] = std::move(" + top
+                 + ");");
+            return true;
+        case InstType::lg:
+            line("rt.push(" + next + ", rt._globals[" + std::to_string(op)
+                 + "]);");
+            return true;
+        case InstType::puts:
+            line("rt.puts(" + top + ");");
+            return true;
+        case InstType::copy:
+            line("rt.push(" + next + ", " + top + ");");
+            return true;
+        case InstType::exit:
+            line("return rt.stop(vm::ExitStatus::exit);");
+            return true;
+        case InstType::ret:
+            leave();
+            line("return true;");
+            return true;
+        case InstType::add:
+        case InstType::sub:
+        case InstType::mul:
+        case InstType::div:
+            line("if ( ! rt.arithmetic(" + type + ", " + slot(depth - 2) + ", "
+                 + top + ") ) return false;");
+            return true;
+        case InstType::jump:
+            line("goto L" + std::to_string(pc + op) + ";");
+            return true;
+        case InstType::jeq:
+        case InstType::jneq:
+        case InstType::jlt:
+        case InstType::jgt:
+            line("if ( ! rt.compare(" + type + ", " + slot(depth - 2) + ", "
+                 + top + ", taken) ) return false;");
+            line("if (taken) goto L" + std::to_string(pc + op) + ";");
+            return true;
+        case InstType::call:
+            line("if ( ! " + functionName(op) + "(rt, base + "
+                 + std::to_string(depth) + ") ) return false;");
+            return true;
+        case InstType::tailcall:
+        {
+            if (restarts(fn, pc))
+            {
+                // Its arguments become its first locals and everything else
+                // goes back to how it was when it was called.
+                if (fn._arity)
+                {
+                    line("rt.restart(locals, base + " + std::to_string(depth)
+                         + ", " + std::to_string(fn._arity.value()) + ");");
+                } else
+                {
+                    if (fn._localCount)
+                    {
+                        line("rt.restart(locals, locals + "
+                             + std::to_string(fn._localCount) + ", 0);");
+                    }
+                    if (depth)
+                    {
+                        line("base += " + std::to_string(depth) + ";");
+                        line("if ( ! rt.room(base, "
+                             + std::to_string(fn._maxStack)
+                             + ") ) return false;");
+                    }
+                }
+                line("goto start;");
+                return true;
+            }
+            std::string sp = leave();
+            line("return " + functionName(op) + "(rt, " + sp + ");");
+            return true;
+        }
+        default:
+            return fail(pc, "Can't compile " + to_string(opcode(w))
+                        + " ahead of time.");
+    }
+}
+
+// A function that calls itself in tail position can jump back to its start
+// rather than relying on the C++ compiler to turn the call into a jump. One
+// with an arity has to have nothing but its arguments left on the stack, as
+// anything below them would stay there under the new frame.
+bool Emitter::restarts(const Function& fn, std::size_t pc) const
+{
+    const Word w = fn._code[pc];
+    if (opcode(w) != InstType::tailcall
+        || static_cast<FnIndex>(operand(w)) != _index || ! fn._depths[pc])
+    {
+        return false;
+    }
+    return ! fn._arity
+        || fn._depths[pc].value() == static_cast<std::int32_t>(fn._arity.value());
+}
+
+bool Emitter::fail(std::size_t pc, const std::string& what)
+{
+    logger()->error("Function " + std::to_string(_index) + " instruction "
+                    + std::to_string(pc) + ": " + what);
+    return false;
+}
+
+}
+
+bool aot::emitProgram(const std::vector<Function>& functions,
+                      const std::map<std::string, FnIndex>& names,
+                      FnIndex root, const std::string& entry,
+                      std::ostream& out)
+{
+    if ( ! isIdentifier(entry) )
+    {
+        logger()->error("Entry point isn't a C++ identifier: " + entry);
+        return false;
+    }
+
+    std::vector<std::string> nameOf(functions.size());
+    for (const auto& [name, index] : names)
+    {
+        nameOf[index] = name;
+    }
+
+    // Written to a buffer first so nothing reaches out if a function fails.
+    std::ostringstream code;
+    Emitter emitter(functions, code);
+
+    code << "// Written by semistack's ahead of time compiler.\n\n"
+         << "#include \"aot_runtime.hpp\"\n\n"
+         << "#include <limits>\n"
+         << "#include <string>\n"
+         << "#include <utility>\n\n"
+         << "namespace {\n\n";
+    const auto before = code.tellp();
+    for (FnIndex i = 0; i < functions.size(); ++i)
+    {
+        if ( ! emitter.constants(i) )
+        {
+            return false;
+        }
+    }
+    if (code.tellp() != before)
+    {
+        code << "\n";
+    }
+    for (FnIndex i = 0; i < functions.size(); ++i)
+    {
+        code << "bool " << functionName(i)
+             << "(vm::aot::Runtime& rt, vm::Value* sp);\n";
+    }
+    code << "\n";
+    for (FnIndex i = 0; i < functions.size(); ++i)
+    {
+        if ( ! emitter.function(i, nameOf[i]) )
+        {
+            return false;
+        }
+    }
+    code << "}\n\n"
+         << "vm::ExitStatus " << entry << "(vm::aot::Runtime& rt)\n{\n"
+         << "    return rt.status(" << functionName(root)
+         << "(rt, rt.stack()));\n}\n";
+
+    out << code.str();
+    return true;
+}
@@ -0,0 +1,72 @@
+//
+//  aot.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/20/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+#include "function.hpp"
+
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//  An ahead of time compiler. It writes a program out as C++ with one function
+//  per VM function so that a C++ compiler can optimize across instructions,
+//  which none of the engines can:
+//
+//      ll 0; pi 1; sub; call fib      ->      rt.push(base[1], locals[0]);
+//                                             rt.push(base[2], vm::Value(1.f));
+//                                             if ( ! rt.arithmetic(
+//                                                 vm::InstType::sub,
+//                                                 base[1], base[2]) )
+//                                                 return false;
+//                                             if ( ! f1(rt, base + 2) )
+//                                                 return false;
+//
+//  The verifier knows how deep the stack is before every instruction so every
+//  stack slot is a fixed offset from where the function's values start. Jumps
+//  are gotos, calls are C++ calls, and values are the VM's own Values on a
+//  stack laid out like the VM's, so functions with an arity take their
+//  arguments in place. Locals of functions without an arity go on a separate
+//  stack like the VM's. Output, globals, and errors go through the runtime in
+//  aot_runtime.hpp and arithmetic and comparisons do what operations.hpp says.
+//  A program run this way prints what the VM would have. The runtime checks
+//  for numbers before anything else so arithmetic on them is a few inline
+//  instructions.
+//
+//  A function that calls itself in tail position jumps back to its start, so
+//  a tail recursive loop runs in constant native stack however the output is
+//  compiled. Other tail calls are C++ calls in tail position. Compilers
+//  usually turn those into jumps when optimizing, but nothing promises that
+//  they will, so mutually tail recursive functions that run fine on the tail
+//  call engine can overflow the native stack in an unoptimized build. So can
+//  a function with an arity that calls itself with values left below its
+//  arguments.
+//
+//  aot/ at the top of the repository has programs written out by this and a
+//  driver that builds and runs them.
+
+namespace vm {
+namespace aot {
+
+// Writes functions out as a C++ translation unit with an entry point
+//
+//      vm::ExitStatus entry(vm::aot::Runtime& rt);
+//
+// that runs the function at root. functions must have been lowered and
+// verified but not fused, and names maps each one's name to its index.
+// Returns false after logging if a function can't be written out, which is
+// the case for ones with function constants.
+bool emitProgram(const std::vector<Function>& functions,
+                 const std::map<std::string,
+                 std::vector<Function>::size_type>& names,
+                 std::vector<Function>::size_type root,
+                 const std::string& entry, std::ostream& out);
+
+}
+}
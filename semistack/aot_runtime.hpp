@@ -0,0 +1,181 @@
+//
+//  aot_runtime.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/20/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+//  What C++ written by the ahead of time compiler needs from the VM when it
+//  runs without one. See aot.hpp. Generated code keeps its values on a value
+//  stack laid out just like the VM's and calls in here for anything that isn't
+//  a plain move: output, globals, errors, and the arithmetic and comparisons
+//  in operations.hpp. Build it with this directory on the include path and
+//  link it with instruction.cpp for printing values.
+
+#include "instruction.hpp"
+#include "logger.hpp"
+#include "operations.hpp"
+#include "value.hpp"
+#include "vm.hpp"
+
+#include <array>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <utility>
+
+namespace vm {
+namespace aot {
+
+class Runtime
+{
+public:
+    Runtime(): Runtime([](std::string s){ std::cout << s << "\n"; }) {}
+    Runtime(std::function<void(std::string)> output, Options options = {})
+        : _output(std::move(output)), _values(options._stackSize),
+          _locals(options._localStackSize),
+          _stackSize(options._stackSize) {}
+
+    // Where the root function's stack starts.
+    Value* stack() { return _values.begin(); }
+
+    // Checks that n more values fit above sp. Functions do this when they
+    // are entered, like VM::enterFrame.
+    bool room(const Value* sp, std::size_t n)
+    {
+        if (static_cast<std::size_t>(sp - _values.begin()) + n <= _stackSize)
+        {
+            return true;
+        }
+        return fail("Stack overflow.");
+    }
+
+    // A window of n locals for a function without an arity, or nullptr if
+    // there isn't room for it.
+    Value* enter(std::size_t n)
+    {
+        if (_locals.room() < n)
+        {
+            fail("Local stack overflow.");
+            return nullptr;
+        }
+        return _locals.grow(n);
+    }
+    // Gives back the window from enter.
+    void leave(std::size_t n) { _locals.shrink(n); }
+
+    // Moves the depth values above base down to locals and clears everything
+    // that was above them, which is how a function with an arity returns.
+    static void leave(Value* locals, Value* base, std::int32_t depth)
+    {
+        Value* results = std::move(base, base + depth, locals);
+        for (Value* v = base + depth; v-- != results; )
+        {
+            *v = Value();
+        }
+    }
+
+    // Moves the n values below top down to locals and clears everything from
+    // the locals after them up to top. That is how a function calls itself in
+    // tail position: its arguments become its first locals, and its other
+    // locals and its stack go back to holding the number 0.
+    static void restart(Value* locals, Value* top, std::size_t n)
+    {
+        Value* rest = std::move(top - n, top, locals);
+        for (Value* v = top; v-- != rest; )
+        {
+            *v = Value();
+        }
+    }
+
+    void puts(Value& v)
+    {
+        _output(vm::to_string(v));
+        v = Value();
+    }
+
+    // Pushes v into slot, which is just above the top of the stack. Slots up
+    // there always hold the number 0 so there is nothing to release.
+    static void push(Value& slot, const Value& v) { new (&slot) Value(v); }
+    static void push(Value& slot, Value&& v)
+    {
+        new (&slot) Value(std::move(v));
+    }
+
+    // add, sub, mul, and div. On success left holds the result and right has
+    // been popped.
+    bool arithmetic(InstType op, Value& left, Value& right)
+    {
+        if (left.isNumber() && right.isNumber())
+        {
+            new (&left) Value(ops::arithmetic(op, left.asNumber(),
+                                              right.asNumber()));
+            new (&right) Value();
+            return true;
+        }
+        ops::Error e = ops::arithmetic(op, left, right);
+        if (e != ops::Error::none)
+        {
+            return fail(ops::message(e, op));
+        }
+        right = Value();
+        return true;
+    }
+
+    // jeq, jneq, jlt, and jgt. On success both operands have been popped and
+    // taken says if the jump should be.
+    bool compare(InstType op, Value& left, Value& right, bool& taken)
+    {
+        if (left.isNumber() && right.isNumber())
+        {
+            taken = ops::compare(op, left.asNumber(), right.asNumber());
+            new (&left) Value();
+            new (&right) Value();
+            return true;
+        }
+        ops::Error e = ops::compare(op, left, right, taken);
+        if (e != ops::Error::none)
+        {
+            return fail(ops::message(e, op));
+        }
+        left = Value();
+        right = Value();
+        return true;
+    }
+
+    // Logs what and stops the program.
+    bool fail(std::string what)
+    {
+        logger()->error(std::move(what));
+        return stop(ExitStatus::error);
+    }
+    // Stops the program. Generated functions return false once this has been
+    // called and their callers pass that on.
+    bool stop(ExitStatus status)
+    {
+        _status = status;
+        return false;
+    }
+    // How the program stopped, given what the root function returned.
+    ExitStatus status(bool returned) const
+    {
+        return returned ? ExitStatus::ret : _status;
+    }
+
+    std::array<Value, kGlobalCount> _globals;
+
+private:
+    std::function<void(std::string)> _output;
+    ValueStack _values;
+    // Locals of functions without an arity, like VM::_localStack.
+    ValueStack _locals;
+    std::size_t _stackSize;
+    ExitStatus _status = ExitStatus::ret;
+};
+
+}
+}
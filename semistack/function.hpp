@@ -8,10 +8,12 @@
 
 #pragma once
 
+#include <optional>
 #include <string>
 #include <vector>
 
 #include "instruction.hpp"
+#include "registers.hpp"
 #include "util.hpp"
 
 namespace vm {
@@ -35,6 +37,41 @@ struct Function
     
     std::vector<vm::Instruction> _instructions;
     
+    // The lowered form of _instructions that the interpreter actually runs.
+    // This is filled in by transform::lowerFunction.
+    std::vector<Word> _code;
+    
+    // _code translated for the register tier by registers::translateFunction.
+    // Empty if the function runs as stack code.
+    std::vector<RegInstruction> _registerCode;
+    
+    // Constant pool. transform::assembleFunction moves every pi immediate in
+    // here, merging equal ones, and pi instructions in _code index into it.
+    std::vector<Value> _constants;
+    
+    // The most values this function has on the stack at once, not counting
+    // what the functions it calls push. Filled in by verify::verifyFunctions.
+    std::size_t _maxStack = 0;
+    
+    // How deep the stack is before each instruction in _code, relative to
+    // where it was when the function was called. Nothing for instructions that
+    // can't be reached. Filled in by verify::verifyFunctions.
+    std::vector<std::optional<std::int32_t>> _depths;
+    
+    // How many local slots the function uses, one past the highest sl or ll
+    // index or its arity if that is more. Call frames are this big. Filled in
+    // by transform::assembleFunction.
+    std::size_t _localCount = 0;
+    
+    // How many arguments the function takes, if it declares that. The caller's
+    // top _arity values become the function's first locals where they are,
+    // without being copied, and ret leaves whatever the function pushed where
+    // its arguments were. Such a function can't pop below its own values.
+    //
+    // Functions without an arity share the stack with their caller: they pop
+    // their arguments off of it themselves and their locals are separate.
+    std::optional<std::size_t> _arity;
+    
     std::vector<Upvalue> _closedUpvalues;
     
     bool operator==(const Function& l)
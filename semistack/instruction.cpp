@@ -43,6 +43,8 @@ std::string vm::to_string(const InstType& i)
             return "jlt";
         case InstType::call:
             return "call";
+        case InstType::tailcall:
+            return "tailcall";
         case InstType::copy:
             return "copy";
         case InstType::sl:
@@ -55,6 +57,48 @@ std::string vm::to_string(const InstType& i)
             return "lg";
         case InstType::ret:
             return "ret";
+        case InstType::add_imm:
+            return "add_imm";
+        case InstType::sub_imm:
+            return "sub_imm";
+        case InstType::ll_add:
+            return "ll_add";
+        case InstType::jlt_imm:
+            return "jlt_imm";
+        case InstType::jgt_imm:
+            return "jgt_imm";
+        case InstType::copy_jlt_imm:
+            return "copy_jlt_imm";
+        case InstType::copy_jgt_imm:
+            return "copy_jgt_imm";
+        case InstType::add_num:
+            return "add_num";
+        case InstType::add_str:
+            return "add_str";
+        case InstType::sub_num:
+            return "sub_num";
+        case InstType::jeq_num:
+            return "jeq_num";
+        case InstType::jeq_str:
+            return "jeq_str";
+        case InstType::jlt_num:
+            return "jlt_num";
+        case InstType::jgt_num:
+            return "jgt_num";
+        case InstType::add_imm_num:
+            return "add_imm_num";
+        case InstType::sub_imm_num:
+            return "sub_imm_num";
+        case InstType::ll_add_num:
+            return "ll_add_num";
+        case InstType::jlt_imm_num:
+            return "jlt_imm_num";
+        case InstType::jgt_imm_num:
+            return "jgt_imm_num";
+        case InstType::copy_jlt_imm_num:
+            return "copy_jlt_imm_num";
+        case InstType::copy_jgt_imm_num:
+            return "copy_jgt_imm_num";
         case InstType::label:
             return "label";
         case InstType::exit:
@@ -67,25 +111,16 @@ std::string vm::to_string(const InstType& i)
 
 std::string vm::to_string(const Value& v)
 {
-    return std::visit(util::overloaded {
-        [](float f)-> std::string
-        {
-            return std::to_string(f);
-        },
-        [](const Object& obj)-> std::string
-        {
-            return std::visit(util::overloaded {
-                [](const std::string& s)-> std::string
-                {
-                    return s;
-                },
-                [](const std::shared_ptr<Function>&)-> std::string
-                {
-                    return "<function>";
-                }
-            }, obj);
-        }
-    }, v);
+    switch (v.tag())
+    {
+        case Value::Tag::number:
+            return std::to_string(v.asNumber());
+        case Value::Tag::string:
+            return v.asString();
+        case Value::Tag::function:
+            return "<function>";
+    }
+    return "";
 }
 
 std::string vm::to_string(const Immediate& i)
@@ -107,33 +142,54 @@ std::string vm::to_string(const Instruction& i)
     return r;
 }
 
+std::string vm::to_string(Word w)
+{
+    auto r = ::to_string(opcode(w));
+    switch (genericOf(opcode(w)))
+    {
+        case InstType::pi:
+        case InstType::add_imm:
+        case InstType::sub_imm:
+            return r + " #" + std::to_string(operand(w));
+        case InstType::jlt_imm:
+        case InstType::jgt_imm:
+        case InstType::copy_jlt_imm:
+        case InstType::copy_jgt_imm:
+            return r + " #" + std::to_string(highOperand(w)) + " "
+                + std::to_string(lowOperand(w));
+        case InstType::sl:
+        case InstType::ll:
+        case InstType::ll_add:
+        case InstType::sg:
+        case InstType::lg:
+        case InstType::jump:
+        case InstType::call:
+        case InstType::tailcall:
+        case InstType::jeq:
+        case InstType::jneq:
+        case InstType::jlt:
+        case InstType::jgt:
+            return r + " " + std::to_string(operand(w));
+        default:
+            return r;
+    }
+}
+
 bool vm::operator==(const Instruction& l, const Instruction& r)
 {
     bool same = (l.first == r.first);
     if (l.second.has_value())
     {
         same &= r.second.has_value();
-        same &= std::visit(util::overloaded {
-            [&](float f)
-            {
-                return f == std::get<float>(r.second.value());
-            },
-            [&](const Object& lobj)
-            {
-                const auto& robj = std::get<Object>(r.second.value());
-                if (robj.index() != lobj.index()) return false;
-                return std::visit(util::overloaded {
-                    [&](const std::string& s)
-                    {
-                        return s == std::get<std::string>(lobj);
-                    },
-                    [&](const std::shared_ptr<Function>& fn)
-                    {
-                        return *fn == *std::get<std::shared_ptr<Function>>(robj);
-                    }
-                }, lobj);
-            }
-        }, l.second.value());
+        if ( ! same ) return false;
+        
+        const Value& lv = l.second.value();
+        const Value& rv = r.second.value();
+        if (lv.isFunction() && rv.isFunction())
+        {
+            return *lv.asFunction() == *rv.asFunction();
+        }
+        same &= (lv == rv);
     } else
     {
         same &= (not r.second.has_value());
@@ -8,6 +8,7 @@
 
 #pragma once
 
+#include <cstdint>
 #include <optional>
 #include <variant>
 #include <string>
@@ -37,6 +38,7 @@ enum class InstType
     
     jump,
     call,
+    tailcall, // call then ret, but the callee takes over the current frame.
     
     // These pop the compared values off the stack.
     jeq,   // Jump equal.
@@ -44,18 +46,177 @@ enum class InstType
     jlt,   // Jump less than.
     jgt,   // Jump greater than.
     
+    // Superinstructions. These are never written by hand. They are made by
+    // transform::fuseSuperinstructions out of common sequences of the above
+    // and only ever appear in lowered code.
+    add_imm,      // pi k; add
+    sub_imm,      // pi k; sub
+    ll_add,       // ll i; add
+    jlt_imm,      // pi k; jlt
+    jgt_imm,      // pi k; jgt
+    copy_jlt_imm, // copy; pi k; jlt
+    copy_jgt_imm, // copy; pi k; jgt
+    
+    // Quickened instructions. These are made by the VM as it runs: the first
+    // time one of the generic instructions above runs it rewrites itself into
+    // the version for the types it saw. Each checks that its operands still
+    // have those types and if they don't turns back into the generic version.
+    add_num,
+    add_str,
+    sub_num,
+    jeq_num,
+    jeq_str,
+    jlt_num,
+    jgt_num,
+    add_imm_num,
+    sub_imm_num,
+    ll_add_num,
+    jlt_imm_num,
+    jgt_imm_num,
+    copy_jlt_imm_num,
+    copy_jgt_imm_num,
+    
     label, // Represents a jumpable location in code. This should only appear in
            // before the code has entered the preprocessor.
+           //
+           // NOTE: label needs to stay last. It is used to count InstTypes.
 };
 
+constexpr std::size_t kInstTypeCount = static_cast<std::size_t>(InstType::label) + 1;
+
 using Immediate = std::optional<Value>;
 using Instruction = std::pair<InstType, Immediate>;
 
+// Once a function has been assembled and linked it is lowered into a dense
+// stream of Words for the interpreter to run. See transform::lowerFunction.
+//
+//      31                                   8 7            0
+//      +--------------------------------------+------------+
+//      |        signed operand (24 bits)      |   opcode   |
+//      +--------------------------------------+------------+
+//
+// Jumps store their relative distance, sl, ll, sg, lg store their index, call
+// stores the function's index, and pi stores an index into the function's
+// side table of constants.
+using Word = std::uint32_t;
+
+constexpr std::int32_t kMaxOperand = (1 << 23) - 1;
+constexpr std::int32_t kMinOperand = -(1 << 23);
+
+// How many local variable slots each call frame has and how many global slots
+// the VM has. sl, ll, sg, and lg operands index into these.
+constexpr std::int32_t kLocalCount = 256;
+constexpr std::int32_t kGlobalCount = 256;
+
+constexpr Word encode(InstType t, std::int32_t operand = 0)
+{
+    return (static_cast<Word>(operand) << 8) | static_cast<Word>(t);
+}
+
+constexpr InstType opcode(Word w)
+{
+    return static_cast<InstType>(w & 0xff);
+}
+
+constexpr std::int32_t operand(Word w)
+{
+    // Arithmetic shift to sign extend the operand.
+    return static_cast<std::int32_t>(w) >> 8;
+}
+
+// Superinstructions that compare against a constant and jump split their
+// operand in two. The top 12 bits are the constant's index and the bottom 12
+// bits are a signed jump distance.
+constexpr std::int32_t kMaxHighOperand = (1 << 12) - 1;
+constexpr std::int32_t kMaxLowOperand = (1 << 11) - 1;
+constexpr std::int32_t kMinLowOperand = -(1 << 11);
+
+constexpr Word encode(InstType t, std::int32_t high, std::int32_t low)
+{
+    return (static_cast<Word>(high) << 20)
+         | ((static_cast<Word>(low) & 0xfff) << 8)
+         | static_cast<Word>(t);
+}
+
+constexpr std::int32_t highOperand(Word w)
+{
+    return static_cast<std::int32_t>(w >> 20);
+}
+
+constexpr std::int32_t lowOperand(Word w)
+{
+    return static_cast<std::int32_t>(w << 12) >> 20;
+}
+
+constexpr Word withOpcode(Word w, InstType t)
+{
+    return (w & ~Word(0xff)) | static_cast<Word>(t);
+}
+
+// The generic instruction that a quickened one was made from.
+constexpr InstType genericOf(InstType t)
+{
+    switch (t)
+    {
+        case InstType::add_num: return InstType::add;
+        case InstType::add_str: return InstType::add;
+        case InstType::sub_num: return InstType::sub;
+        case InstType::jeq_num: return InstType::jeq;
+        case InstType::jeq_str: return InstType::jeq;
+        case InstType::jlt_num: return InstType::jlt;
+        case InstType::jgt_num: return InstType::jgt;
+        case InstType::add_imm_num: return InstType::add_imm;
+        case InstType::sub_imm_num: return InstType::sub_imm;
+        case InstType::ll_add_num: return InstType::ll_add;
+        case InstType::jlt_imm_num: return InstType::jlt_imm;
+        case InstType::jgt_imm_num: return InstType::jgt_imm;
+        case InstType::copy_jlt_imm_num: return InstType::copy_jlt_imm;
+        case InstType::copy_jgt_imm_num: return InstType::copy_jgt_imm;
+        default: return t;
+    }
+}
+
+// The quickened version of t for operands that are all numbers or all
+// strings, or t if there isn't one.
+constexpr InstType quickenedOf(InstType t, bool numbers, bool strings)
+{
+    if (numbers)
+    {
+        switch (t)
+        {
+            case InstType::add: return InstType::add_num;
+            case InstType::sub: return InstType::sub_num;
+            case InstType::jeq: return InstType::jeq_num;
+            case InstType::jlt: return InstType::jlt_num;
+            case InstType::jgt: return InstType::jgt_num;
+            case InstType::add_imm: return InstType::add_imm_num;
+            case InstType::sub_imm: return InstType::sub_imm_num;
+            case InstType::ll_add: return InstType::ll_add_num;
+            case InstType::jlt_imm: return InstType::jlt_imm_num;
+            case InstType::jgt_imm: return InstType::jgt_imm_num;
+            case InstType::copy_jlt_imm: return InstType::copy_jlt_imm_num;
+            case InstType::copy_jgt_imm: return InstType::copy_jgt_imm_num;
+            default: return t;
+        }
+    }
+    if (strings)
+    {
+        switch (t)
+        {
+            case InstType::add: return InstType::add_str;
+            case InstType::jeq: return InstType::jeq_str;
+            default: return t;
+        }
+    }
+    return t;
+}
+
 // to_string methods for VM types.
 std::string to_string(const InstType& i);
 std::string to_string(const Value& v);
 std::string to_string(const Immediate& i);
 std::string to_string(const Instruction& i);
+std::string to_string(Word w);
 
 bool operator==(const Instruction& l, const Instruction& r);
 
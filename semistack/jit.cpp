@@ -0,0 +1,1186 @@
+//
+//  jit.cpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/18/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#include "jit.hpp"
+#include "vm.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <utility>
+
+#if defined(__x86_64__) && defined(__linux__)
+#include <sys/mman.h>
+#endif
+
+using namespace vm;
+
+namespace vm {
+
+// The helpers that native code calls. They take the VM as their first
+// argument and do what runInstruction would. The ones that can fail return a
+// jit::Status and the ones that jump return 1 if they should, 0 if they
+// shouldn't, and jit::Status::error if something went wrong. Quickening is
+// left to the interpreter so every helper here is for a generic instruction.
+struct JitRuntime
+{
+    // How deep native calls can nest before the callee is left to the
+    // interpreter instead. Each one costs a little of the native stack.
+    static constexpr std::size_t kMaxNativeDepth = 1 << 12;
+
+    // Where compiled code finds things in the VM.
+    static Value** stackTop(VM& vm) { return &vm._valueStack._sp; }
+    static Value** nativeLocals(VM& vm) { return &vm._nativeLocals; }
+    
+    static std::int32_t status(bool ok)
+    {
+        return static_cast<std::int32_t>(ok ? jit::Status::returned
+                                            : jit::Status::error);
+    }
+
+    static std::int32_t jump(std::optional<bool> taken)
+    {
+        return taken ? taken.value()
+                     : static_cast<std::int32_t>(jit::Status::error);
+    }
+
+    static void pi(VM* vm, const Value* constant)
+    {
+        vm->_valueStack.push(*constant);
+    }
+
+    static void sl(VM* vm, std::int32_t i)
+    {
+        vm->_callStack.top()._locals[i] = std::move(vm->_valueStack.top());
+        vm->_valueStack.pop();
+    }
+
+    static void ll(VM* vm, std::int32_t i)
+    {
+        vm->_valueStack.push(vm->_callStack.top()._locals[i]);
+    }
+
+    static void sg(VM* vm, std::int32_t i)
+    {
+        vm->_globals[i] = std::move(vm->_valueStack.top());
+        vm->_valueStack.pop();
+    }
+
+    static void lg(VM* vm, std::int32_t i)
+    {
+        vm->_valueStack.push(vm->_globals[i]);
+    }
+
+    static void puts(VM* vm)
+    {
+        vm->_outputFn(vm::to_string(vm->_valueStack.top()));
+        vm->_valueStack.pop();
+    }
+
+    static void copy(VM* vm)
+    {
+        vm->_valueStack.push(vm->_valueStack.top());
+    }
+
+    template <InstType op>
+    static std::int32_t arithmetic(VM* vm)
+    {
+        return status(vm->arithmetic(op));
+    }
+
+    template <InstType op>
+    static std::int32_t arithmeticImm(VM* vm, const Value* constant)
+    {
+        return status(vm->arithmetic(op, vm->_valueStack.top(), *constant));
+    }
+
+    static std::int32_t llAdd(VM* vm, std::int32_t i)
+    {
+        return status(vm->arithmetic(InstType::add, vm->_valueStack.top(),
+                                     vm->_callStack.top()._locals[i]));
+    }
+
+    template <InstType op>
+    static std::int32_t compare(VM* vm)
+    {
+        return jump(vm->compare(op));
+    }
+
+    // jlt_imm and friends. kPop is false for the ones that start with a copy.
+    template <InstType op, bool kPop>
+    static std::int32_t compareImm(VM* vm, const Value* constant)
+    {
+        auto taken = vm->compare(op, vm->_valueStack.top(), *constant);
+        if (kPop)
+        {
+            vm->_valueStack.pop();
+        }
+        return jump(taken);
+    }
+
+    // Pushes a frame for the callee and runs it natively if it has been
+    // compiled. Otherwise asks for the interpreter, which will come back to
+    // the caller at resume once the callee returns.
+    static std::int32_t call(VM* vm, std::int32_t index, std::int32_t resume)
+    {
+        vm->_callStack.top()._pc = resume;
+        if ( ! vm->pushFrame(index) )
+        {
+            return static_cast<std::int32_t>(jit::Status::error);
+        }
+        const jit::NativeCode* callee = vm->jitCall(index);
+        if ( ! callee || vm->_nativeDepth >= kMaxNativeDepth )
+        {
+            return static_cast<std::int32_t>(jit::Status::leave);
+        }
+        ++vm->_nativeDepth;
+        jit::Status result = callee->enter(vm, 0, vm->_callStack.top()._locals);
+        --vm->_nativeDepth;
+        return static_cast<std::int32_t>(result);
+    }
+
+    // Returns where to jump to if the callee has been compiled, with its
+    // locals in _nativeLocals. Otherwise a jit::Status, which is never a valid
+    // address.
+    static std::uintptr_t tailcall(VM* vm, std::int32_t index)
+    {
+        if ( ! vm->replaceFrame(index) )
+        {
+            return static_cast<std::uintptr_t>(jit::Status::error);
+        }
+        const jit::NativeCode* callee = vm->jitCall(index);
+        if ( ! callee )
+        {
+            return static_cast<std::uintptr_t>(jit::Status::leave);
+        }
+        vm->_nativeLocals = vm->_callStack.top()._locals;
+        return reinterpret_cast<std::uintptr_t>(callee->start());
+    }
+
+    static std::int32_t ret(VM* vm)
+    {
+        vm->popFrame();
+        return static_cast<std::int32_t>(jit::Status::returned);
+    }
+    
+    // Jumps back go through this first in runs that are profiled or sampled.
+    // pc is where the jump goes.
+    static bool observing(const VM& vm) { return vm._observing; }
+    static void backEdge(VM* vm, std::int32_t pc)
+    {
+        CallFrame& frame = vm->_callStack.top();
+        frame._pc = pc;
+        vm->backEdge(frame._fnIndex);
+    }
+};
+
+}
+
+namespace {
+
+#if defined(__x86_64__) && defined(__linux__)
+
+// Writes x86-64 machine code. While native code runs it keeps
+//
+//   rbx  the VM,
+//   r12  the locals of the frame it is running,
+//   r13  the top of the value stack, and
+//   r14  where the VM keeps the top of the value stack.
+//
+// They are all callee saved so the helpers leave them alone. The VM's copy of
+// the top of the stack is only brought up to date around helper calls.
+class Assembler
+{
+public:
+    using Label = std::size_t;
+    
+    Label label()
+    {
+        _labels.push_back(0);
+        return _labels.size() - 1;
+    }
+    // Puts l here.
+    void bind(Label l) { _labels[l] = here(); }
+    std::size_t offset(Label l) const { return _labels[l]; }
+    
+    // Where the next byte goes.
+    std::size_t here() const { return _bytes.size(); }
+    const std::vector<std::uint8_t>& bytes() const { return _bytes; }
+    
+    void emit(std::initializer_list<std::uint8_t> bytes)
+    {
+        _bytes.insert(_bytes.end(), bytes);
+    }
+    
+    void emit32(std::uint32_t v)
+    {
+        for (int i = 0; i < 4; ++i) _bytes.push_back(v >> (8 * i));
+    }
+    
+    void emit64(std::uint64_t v)
+    {
+        for (int i = 0; i < 8; ++i) _bytes.push_back(v >> (8 * i));
+    }
+    
+    void jmp(Label to)
+    {
+        emit({0xe9});                                      // jmp to
+        fixup(to);
+    }
+    
+    // Jumps if cc, which is the second byte of a 0x0f Jcc rel32.
+    void jcc(std::uint8_t cc, Label to)
+    {
+        emit({0x0f, cc});
+        fixup(to);
+    }
+    
+    // Points the jumps at where their labels ended up.
+    void patch()
+    {
+        for (const auto& [at, to] : _fixups)
+        {
+            std::int64_t rel = static_cast<std::int64_t>(_labels[to])
+                - static_cast<std::int64_t>(at + 4);
+            for (int i = 0; i < 4; ++i) _bytes[at + i] = rel >> (8 * i);
+        }
+    }
+    
+    // Calls helper with the VM and up to two more arguments.
+    template <class Helper>
+    void call(Helper helper)
+    {
+        emit({0x4d, 0x89, 0x2e});                          // mov [r14], r13
+        emit({0x48, 0x89, 0xdf});                          // mov rdi, rbx
+        emit({0x48, 0xb8});                                // mov rax, helper
+        emit64(reinterpret_cast<std::uint64_t>(helper));
+        emit({0xff, 0xd0});                                // call rax
+        emit({0x4d, 0x8b, 0x2e});                          // mov r13, [r14]
+    }
+    
+    template <class Helper>
+    void call(Helper helper, std::int32_t a)
+    {
+        emit({0xbe});                                      // mov esi, a
+        emit32(a);
+        call(helper);
+    }
+    
+    template <class Helper>
+    void call(Helper helper, const void* a)
+    {
+        emit({0x48, 0xbe});                                // mov rsi, a
+        emit64(reinterpret_cast<std::uint64_t>(a));
+        call(helper);
+    }
+    
+    template <class Helper>
+    void call(Helper helper, std::int32_t a, std::int32_t b)
+    {
+        emit({0xba});                                      // mov edx, b
+        emit32(b);
+        call(helper, a);
+    }
+    
+    // The registers that the templates below use. Only the low three bits of
+    // rax and rcx's encodings show up so these are all they work with.
+    enum Reg: std::uint8_t { rax = 0, rcx = 1 };
+    
+    // mov r, [r13 + 8 * slot]. Slots count from the top of the stack.
+    void loadStack(Reg r, std::int8_t slot)
+    {
+        emit({0x49, 0x8b, static_cast<std::uint8_t>(0x45 | r << 3),
+              static_cast<std::uint8_t>(slot * 8)});
+    }
+    
+    // mov [r13 + 8 * slot], r
+    void storeStack(std::int8_t slot, Reg r)
+    {
+        emit({0x49, 0x89, static_cast<std::uint8_t>(0x45 | r << 3),
+              static_cast<std::uint8_t>(slot * 8)});
+    }
+    
+    // mov qword [r13 + 8 * slot], 0. Slots above the top are kept zeroed.
+    void clearStack(std::int8_t slot)
+    {
+        emit({0x49, 0xc7, 0x45, static_cast<std::uint8_t>(slot * 8)});
+        emit32(0);
+    }
+    
+    // Moves the top of the stack n slots.
+    void moveStack(std::int8_t n)
+    {
+        if (n > 0) emit({0x49, 0x83, 0xc5});               // add r13, 8n
+        else       emit({0x49, 0x83, 0xed});               // sub r13, -8n
+        emit({static_cast<std::uint8_t>((n > 0 ? n : -n) * 8)});
+    }
+    
+    // mov r, [r12 + 8 * i]
+    void loadLocal(Reg r, std::int32_t i)
+    {
+        emit({0x49, 0x8b, static_cast<std::uint8_t>(0x84 | r << 3), 0x24});
+        emit32(i * 8);
+    }
+    
+    // mov [r12 + 8 * i], r
+    void storeLocal(std::int32_t i, Reg r)
+    {
+        emit({0x49, 0x89, static_cast<std::uint8_t>(0x84 | r << 3), 0x24});
+        emit32(i * 8);
+    }
+    
+    // Jumps to otherwise unless r holds a number, which is when its tag is
+    // zero.
+    void checkNumber(Reg r, Label otherwise)
+    {
+        emit({0x48, 0x89, static_cast<std::uint8_t>(0xc2 | r << 3)}); // mov rdx, r
+        emit({0x48, 0xc1, 0xea, 0x30});                    // shr rdx, 48
+        jcc(kJne, otherwise);
+    }
+    
+    // The same for both rax and rcx.
+    void checkNumbers(Label otherwise)
+    {
+        emit({0x48, 0x89, 0xc2});                          // mov rdx, rax
+        emit({0x48, 0x09, 0xca});                          // or rdx, rcx
+        emit({0x48, 0xc1, 0xea, 0x30});                    // shr rdx, 48
+        jcc(kJne, otherwise);
+    }
+    
+    // mov ecx, the number in v
+    void loadNumber(const Value& v)
+    {
+        emit({0xb9});
+        emit32(static_cast<std::uint32_t>(v.bits()));
+    }
+    
+    // Moves the numbers in eax and ecx into xmm0 and xmm1.
+    void unpack()
+    {
+        emit({0x66, 0x0f, 0x6e, 0xc0});                    // movd xmm0, eax
+        emit({0x66, 0x0f, 0x6e, 0xc9});                    // movd xmm1, ecx
+    }
+    
+    // eax = xmm0 op xmm1. Writing eax clears the top half of rax so the result
+    // is tagged as a number.
+    void arithmetic(InstType op)
+    {
+        std::uint8_t code = op == InstType::add ? 0x58
+                          : op == InstType::sub ? 0x5c
+                          : op == InstType::mul ? 0x59 : 0x5e;
+        emit({0xf3, 0x0f, code, 0xc1});                    // op xmm0, xmm1
+        emit({0x66, 0x0f, 0x7e, 0xc0});                    // movd eax, xmm0
+    }
+    
+    // Compares xmm0 with xmm1 for op, which is jlt or jgt, so that ja jumps if
+    // it holds. Both are false if either side is NaN, which is what ja does
+    // with an unordered result.
+    void compare(InstType op)
+    {
+        if (op == InstType::jlt) emit({0x0f, 0x2e, 0xc8}); // ucomiss xmm1, xmm0
+        else                     emit({0x0f, 0x2e, 0xc1}); // ucomiss xmm0, xmm1
+    }
+    
+    // rax = v
+    void loadValue(const Value& v)
+    {
+        emit({0x48, 0xb8});
+        emit64(v.bits());
+    }
+    
+    static constexpr std::uint8_t kJb = 0x82;
+    static constexpr std::uint8_t kJe = 0x84;
+    static constexpr std::uint8_t kJne = 0x85;
+    static constexpr std::uint8_t kJbe = 0x86;
+    static constexpr std::uint8_t kJa = 0x87;
+    
+private:
+    void fixup(Label to)
+    {
+        _fixups.emplace_back(here(), to);
+        emit32(0);
+    }
+    
+    std::vector<std::uint8_t> _bytes;
+    std::vector<std::size_t> _labels;
+    std::vector<std::pair<std::size_t, Label>> _fixups;
+};
+
+using R = Assembler::Reg;
+using Label = Assembler::Label;
+
+// The entry point takes the VM, where to start, and the frame's locals.
+// Pushing rbp as well lines the stack up to 16 bytes for helper calls.
+void emitPrologue(Assembler& a, VM& vm)
+{
+    a.emit({0x53, 0x55});                                  // push rbx; rbp
+    a.emit({0x41, 0x54, 0x41, 0x55, 0x41, 0x56});          // push r12; r13; r14
+    a.emit({0x48, 0x89, 0xfb});                            // mov rbx, rdi
+    a.emit({0x49, 0x89, 0xd4});                            // mov r12, rdx
+    a.emit({0x49, 0xbe});                                  // mov r14, &sp
+    a.emit64(reinterpret_cast<std::uint64_t>(JitRuntime::stackTop(vm)));
+    a.emit({0x4d, 0x8b, 0x2e});                            // mov r13, [r14]
+    a.emit({0xff, 0xe6});                                  // jmp rsi
+}
+
+// Returns whatever is in eax.
+void emitEpilogue(Assembler& a)
+{
+    a.emit({0x4d, 0x89, 0x2e});                            // mov [r14], r13
+    a.emit({0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c});          // pop r14; r13; r12
+    a.emit({0x5d, 0x5b});                                  // pop rbp; rbx
+    a.emit({0xc3});                                        // ret
+}
+
+// What the helper for an instruction says in eax.
+enum class HelperResult
+{
+    nothing,  // It can't fail.
+    status,   // A jit::Status.
+    jump,     // If the jump should be taken, or an error.
+};
+
+HelperResult helperResult(InstType t)
+{
+    switch (t)
+    {
+        case InstType::pi:
+        case InstType::sl:
+        case InstType::ll:
+        case InstType::sg:
+        case InstType::lg:
+        case InstType::puts:
+        case InstType::copy:
+            return HelperResult::nothing;
+        case InstType::jeq:
+        case InstType::jneq:
+        case InstType::jlt:
+        case InstType::jgt:
+        case InstType::jlt_imm:
+        case InstType::jgt_imm:
+        case InstType::copy_jlt_imm:
+        case InstType::copy_jgt_imm:
+            return HelperResult::jump;
+        default:
+            return HelperResult::status;
+    }
+}
+
+// The constant that w uses, if it has one.
+const Value* constantOf(Word w, const Value* constants)
+{
+    switch (genericOf(opcode(w)))
+    {
+        case InstType::pi:
+        case InstType::add_imm:
+        case InstType::sub_imm:
+            return constants + operand(w);
+        case InstType::jlt_imm:
+        case InstType::jgt_imm:
+        case InstType::copy_jlt_imm:
+        case InstType::copy_jgt_imm:
+            return constants + highOperand(w);
+        default:
+            return nullptr;
+    }
+}
+
+// Calls the helper for w, which has to be one of the instructions that
+// helperResult knows about other than a call or return.
+void emitHelper(Assembler& a, Word w, const Value* constants)
+{
+    using J = JitRuntime;
+    const std::int32_t op = operand(w);
+    const Value* constant = constantOf(w, constants);
+    switch (genericOf(opcode(w)))
+    {
+        case InstType::pi: a.call(&J::pi, constant); break;
+        case InstType::sl: a.call(&J::sl, op); break;
+        case InstType::ll: a.call(&J::ll, op); break;
+        case InstType::sg: a.call(&J::sg, op); break;
+        case InstType::lg: a.call(&J::lg, op); break;
+        case InstType::puts: a.call(&J::puts); break;
+        case InstType::copy: a.call(&J::copy); break;
+        case InstType::add: a.call(&J::arithmetic<InstType::add>); break;
+        case InstType::sub: a.call(&J::arithmetic<InstType::sub>); break;
+        case InstType::mul: a.call(&J::arithmetic<InstType::mul>); break;
+        case InstType::div: a.call(&J::arithmetic<InstType::div>); break;
+        case InstType::jeq: a.call(&J::compare<InstType::jeq>); break;
+        case InstType::jneq: a.call(&J::compare<InstType::jneq>); break;
+        case InstType::jlt: a.call(&J::compare<InstType::jlt>); break;
+        case InstType::jgt: a.call(&J::compare<InstType::jgt>); break;
+        case InstType::add_imm:
+            a.call(&J::arithmeticImm<InstType::add>, constant);
+            break;
+        case InstType::sub_imm:
+            a.call(&J::arithmeticImm<InstType::sub>, constant);
+            break;
+        case InstType::ll_add: a.call(&J::llAdd, op); break;
+        case InstType::jlt_imm:
+            a.call(&J::compareImm<InstType::jlt, true>, constant);
+            break;
+        case InstType::jgt_imm:
+            a.call(&J::compareImm<InstType::jgt, true>, constant);
+            break;
+        case InstType::copy_jlt_imm:
+            a.call(&J::compareImm<InstType::jlt, false>, constant);
+            break;
+        case InstType::copy_jgt_imm:
+            a.call(&J::compareImm<InstType::jgt, false>, constant);
+            break;
+        default:
+            break;
+    }
+}
+
+// Does w have a template for when its values are numbers?
+bool hasFastPath(Word w, const Value* constants)
+{
+    const Value* constant = constantOf(w, constants);
+    if (constant && ! constant->isNumber())
+    {
+        return false;
+    }
+    switch (genericOf(opcode(w)))
+    {
+        case InstType::sg:
+        case InstType::lg:
+        case InstType::puts:
+        case InstType::jeq:
+        case InstType::jneq:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// The template for w when its values are numbers. Jumps to otherwise before
+// it changes anything if they aren't. Comparisons leave the flags set so that
+// ja jumps if the jump should be taken. Only for instructions that
+// hasFastPath says have one.
+void emitFastPath(Assembler& a, Word w, const Value* constants,
+                  Label otherwise)
+{
+    const std::int32_t op = operand(w);
+    const Value* constant = constantOf(w, constants);
+    const InstType t = genericOf(opcode(w));
+    switch (t)
+    {
+        case InstType::pi:
+            a.loadValue(*constant);
+            a.storeStack(0, R::rax);
+            a.moveStack(1);
+            break;
+        case InstType::sl:
+            // Moving a value over a number doesn't touch any reference
+            // counts.
+            a.loadLocal(R::rcx, op);
+            a.checkNumber(R::rcx, otherwise);
+            a.loadStack(R::rax, -1);
+            a.storeLocal(op, R::rax);
+            a.clearStack(-1);
+            a.moveStack(-1);
+            break;
+        case InstType::ll:
+            a.loadLocal(R::rax, op);
+            a.checkNumber(R::rax, otherwise);
+            a.storeStack(0, R::rax);
+            a.moveStack(1);
+            break;
+        case InstType::copy:
+            a.loadStack(R::rax, -1);
+            a.checkNumber(R::rax, otherwise);
+            a.storeStack(0, R::rax);
+            a.moveStack(1);
+            break;
+        case InstType::add:
+        case InstType::sub:
+        case InstType::mul:
+        case InstType::div:
+            a.loadStack(R::rax, -2);
+            a.loadStack(R::rcx, -1);
+            a.checkNumbers(otherwise);
+            a.unpack();
+            a.arithmetic(t);
+            a.storeStack(-2, R::rax);
+            a.clearStack(-1);
+            a.moveStack(-1);
+            break;
+        case InstType::add_imm:
+        case InstType::sub_imm:
+            a.loadStack(R::rax, -1);
+            a.checkNumber(R::rax, otherwise);
+            a.loadNumber(*constant);
+            a.unpack();
+            a.arithmetic(t == InstType::add_imm ? InstType::add
+                                                : InstType::sub);
+            a.storeStack(-1, R::rax);
+            break;
+        case InstType::ll_add:
+            a.loadStack(R::rax, -1);
+            a.loadLocal(R::rcx, op);
+            a.checkNumbers(otherwise);
+            a.unpack();
+            a.arithmetic(InstType::add);
+            a.storeStack(-1, R::rax);
+            break;
+        case InstType::jlt:
+        case InstType::jgt:
+            a.loadStack(R::rax, -2);
+            a.loadStack(R::rcx, -1);
+            a.checkNumbers(otherwise);
+            a.unpack();
+            a.clearStack(-2);
+            a.clearStack(-1);
+            a.moveStack(-2);
+            a.compare(t);
+            break;
+        case InstType::jlt_imm:
+        case InstType::jgt_imm:
+        case InstType::copy_jlt_imm:
+        case InstType::copy_jgt_imm:
+            a.loadStack(R::rax, -1);
+            a.checkNumber(R::rax, otherwise);
+            a.loadNumber(*constant);
+            a.unpack();
+            if (t == InstType::jlt_imm || t == InstType::jgt_imm)
+            {
+                a.clearStack(-1);
+                a.moveStack(-1);
+            }
+            a.compare((t == InstType::jlt_imm || t == InstType::copy_jlt_imm)
+                      ? InstType::jlt : InstType::jgt);
+            break;
+        default:
+            break;
+    }
+}
+
+// Where a jump goes, as an index into its function.
+std::size_t jumpTarget(Word w, std::size_t i)
+{
+    switch (genericOf(opcode(w)))
+    {
+        case InstType::jlt_imm:
+        case InstType::jgt_imm:
+        case InstType::copy_jlt_imm:
+        case InstType::copy_jgt_imm:
+            return i + lowOperand(w);
+        default:
+            return i + operand(w);
+    }
+}
+
+// Moves the code into memory that can be run. Pages are never writable and
+// executable at the same time.
+std::uint8_t* install(const std::vector<std::uint8_t>& bytes)
+{
+    void* memory = mmap(nullptr, bytes.size(), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    std::memcpy(memory, bytes.data(), bytes.size());
+    if (mprotect(memory, bytes.size(), PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(memory, bytes.size());
+        return nullptr;
+    }
+    return static_cast<std::uint8_t*>(memory);
+}
+
+std::unique_ptr<jit::NativeCode> finish(Assembler& a,
+                                        std::vector<std::uint32_t> offsets)
+{
+    a.patch();
+    std::uint8_t* memory = install(a.bytes());
+    if ( ! memory )
+    {
+        logger()->error("Failed to map memory for native code.");
+        return nullptr;
+    }
+    return std::make_unique<jit::NativeCode>(memory, a.bytes().size(),
+                                             std::move(offsets));
+}
+
+#endif
+
+}
+
+std::unique_ptr<jit::NativeCode> jit::compile(VM& vm, const Function& fn)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    const std::vector<Word>& code = fn._code;
+    const Value* constants = fn._constants.data();
+    const std::size_t n = code.size();
+    Assembler a;
+    
+    // A label for each instruction, one for the end of the function in case
+    // something jumps there, and one for leaving with a Status in eax.
+    for (std::size_t i = 0; i <= n; ++i) a.label();
+    const Label leave = a.label();
+    // Slow paths are kept out of the way until the end.
+    std::vector<std::function<void()>> slowPaths;
+    // Where a jump from instruction from to instruction to should go. Jumps
+    // back take a detour past JitRuntime::backEdge if the VM is observing.
+    const bool observing = JitRuntime::observing(vm);
+    auto jumpTo = [&a, &slowPaths, observing](std::size_t from,
+                                              std::size_t to) -> Label
+    {
+        if ( ! observing || to > from )
+        {
+            return to;
+        }
+        const Label detour = a.label();
+        slowPaths.push_back([&a, detour, to]()
+        {
+            a.bind(detour);
+            a.call(&JitRuntime::backEdge, static_cast<std::int32_t>(to));
+            a.jmp(to);
+        });
+        return detour;
+    };
+    
+    emitPrologue(a, vm);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        a.bind(i);
+        const Word w = code[i];
+        const std::int32_t op = operand(w);
+        const InstType t = genericOf(opcode(w));
+        
+        switch (t)
+        {
+            case InstType::exit:
+                a.emit({0xb8});                            // mov eax, exit
+                a.emit32(static_cast<std::uint32_t>(Status::exit));
+                a.jmp(leave);
+                continue;
+            case InstType::ret:
+                a.call(&JitRuntime::ret);
+                a.jmp(leave);
+                continue;
+            case InstType::jump:
+                a.jmp(jumpTo(i, i + op));
+                continue;
+            case InstType::call:
+                a.call(&JitRuntime::call, op, static_cast<std::int32_t>(i + 1));
+                a.emit({0x85, 0xc0});                      // test eax, eax
+                a.jcc(Assembler::kJne, leave);
+                continue;
+            case InstType::tailcall:
+                a.call(&JitRuntime::tailcall, op);
+                a.emit({0x48, 0x83, 0xf8});                // cmp rax, error
+                a.emit({static_cast<std::uint8_t>(Status::error)});
+                a.jcc(Assembler::kJbe, leave);
+                a.emit({0x48, 0xb9});                      // mov rcx, &locals
+                a.emit64(reinterpret_cast<std::uint64_t>(
+                    JitRuntime::nativeLocals(vm)));
+                a.emit({0x4c, 0x8b, 0x21});                // mov r12, [rcx]
+                a.emit({0xff, 0xe0});                      // jmp rax
+                continue;
+            case InstType::label:
+                logger()->error("Can't compile " + to_string(w) + ".");
+                return nullptr;
+            default:
+                break;
+        }
+        
+        // Everything else does what the helper says, either right away or
+        // after its fast path gives up.
+        const HelperResult result = helperResult(t);
+        const Label target = result == HelperResult::jump
+            ? jumpTo(i, jumpTarget(w, i)) : i + 1;
+        auto helper = [&a, w, constants, result, target, leave]()
+        {
+            emitHelper(a, w, constants);
+            if (result == HelperResult::status)
+            {
+                a.emit({0x85, 0xc0});                      // test eax, eax
+                a.jcc(Assembler::kJne, leave);
+            } else if (result == HelperResult::jump)
+            {
+                a.emit({0x83, 0xf8, 0x01});                // cmp eax, 1
+                a.jcc(Assembler::kJe, target);
+                a.jcc(Assembler::kJa, leave);
+            }
+        };
+        
+        if ( ! hasFastPath(w, constants) )
+        {
+            helper();
+            continue;
+        }
+        const Label slow = a.label();
+        emitFastPath(a, w, constants, slow);
+        if (result == HelperResult::jump)
+        {
+            a.jcc(Assembler::kJa, target);
+        }
+        slowPaths.push_back([&a, helper, slow, i]()
+        {
+            a.bind(slow);
+            helper();
+            a.jmp(i + 1);
+        });
+    }
+    
+    // Everything that leaves comes through here with a Status in eax.
+    a.bind(n);
+    a.bind(leave);
+    emitEpilogue(a);
+    for (const auto& emit : slowPaths)
+    {
+        emit();
+    }
+    
+    std::vector<std::uint32_t> offsets(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        offsets[i] = static_cast<std::uint32_t>(a.offset(i));
+    }
+    return finish(a, std::move(offsets));
+#else
+    return nullptr;
+#endif
+}
+
+std::unique_ptr<jit::Trace> jit::compileTrace(VM& vm, const Function& fn,
+                                              std::size_t start,
+                                              const std::vector<TraceStep>& steps)
+{
+#if defined(__x86_64__) && defined(__linux__)
+    const Value* constants = fn._constants.data();
+    std::vector<Trace::Exit> exits;
+    Assembler a;
+    
+    const Label loop = a.label();
+    const Label leave = a.label();
+    const Label failed = a.label();
+    std::vector<Label> exitLabels;
+    // A label that leaves the trace to carry on from pc in the interpreter.
+    auto exitTo = [&](std::size_t pc, bool guard)
+    {
+        exits.push_back(Trace::Exit{pc, guard});
+        exitLabels.push_back(a.label());
+        return exitLabels.back();
+    };
+    
+    emitPrologue(a, vm);
+    a.bind(loop);
+    for (const TraceStep& step : steps)
+    {
+        const Word w = step._instruction;
+        const InstType t = genericOf(opcode(w));
+        const HelperResult result = helperResult(t);
+        const std::size_t pc = step._pc;
+        // Where the interpreter picks up if the jump goes the way the trace
+        // didn't.
+        const std::size_t otherWay = result == HelperResult::jump
+            && step._taken ? pc + 1 : jumpTarget(w, pc);
+        
+        switch (t)
+        {
+            case InstType::jump:
+                continue;
+            case InstType::exit:
+            case InstType::ret:
+            case InstType::call:
+            case InstType::tailcall:
+            case InstType::label:
+                logger()->error("Can't trace " + to_string(w) + ".");
+                return nullptr;
+            default:
+                break;
+        }
+        
+        if (step._numbers && hasFastPath(w, constants))
+        {
+            emitFastPath(a, w, constants, exitTo(pc, true));
+            if (result == HelperResult::jump)
+            {
+                a.jcc(step._taken ? Assembler::kJbe : Assembler::kJa,
+                      exitTo(otherWay, false));
+            }
+            continue;
+        }
+        
+        emitHelper(a, w, constants);
+        if (result == HelperResult::status)
+        {
+            a.emit({0x85, 0xc0});                          // test eax, eax
+            a.jcc(Assembler::kJne, failed);
+        } else if (result == HelperResult::jump)
+        {
+            a.emit({0x83, 0xf8, 0x01});                    // cmp eax, 1
+            a.jcc(step._taken ? Assembler::kJb : Assembler::kJe,
+                  exitTo(otherWay, false));
+            a.jcc(Assembler::kJa, failed);
+        }
+    }
+    // The last step jumped back to the start.
+    if (JitRuntime::observing(vm))
+    {
+        a.call(&JitRuntime::backEdge, static_cast<std::int32_t>(start));
+    }
+    a.jmp(loop);
+    
+    // Exits leave with their index in eax, or -1 if a helper failed.
+    for (std::size_t i = 0; i < exitLabels.size(); ++i)
+    {
+        a.bind(exitLabels[i]);
+        a.emit({0xb8});                                    // mov eax, i
+        a.emit32(static_cast<std::uint32_t>(i));
+        a.jmp(leave);
+    }
+    a.bind(failed);
+    a.emit({0xb8});                                        // mov eax, -1
+    a.emit32(static_cast<std::uint32_t>(-1));
+    a.bind(leave);
+    emitEpilogue(a);
+    
+    auto code = finish(a, {static_cast<std::uint32_t>(a.offset(loop))});
+    if ( ! code )
+    {
+        return nullptr;
+    }
+    return std::make_unique<Trace>(std::move(code), std::move(exits), start,
+                                   steps.size());
+#else
+    return nullptr;
+#endif
+}
+
+jit::NativeCode::~NativeCode()
+{
+#if defined(__x86_64__) && defined(__linux__)
+    munmap(_code, _size);
+#endif
+}
+
+std::int32_t jit::NativeCode::run(VM* vm, std::size_t pc, Value* locals) const
+{
+    using Entry = std::int32_t (*)(VM*, const std::uint8_t*, Value*);
+    Entry entry = reinterpret_cast<Entry>(_code);
+    return entry(vm, _code + _offsets[pc], locals);
+}
+
+std::optional<std::size_t> jit::Trace::run(VM* vm, Value* locals)
+{
+    ++_stats._entries;
+    std::int32_t exit = _code->run(vm, 0, locals);
+    if (exit < 0)
+    {
+        return std::nullopt;
+    }
+    const Exit& e = _exits[exit];
+    ++(e._guard ? _stats._guardFailures : _stats._sideExits);
+    return e._pc;
+}
+
+const jit::NativeCode* vm::VM::jitCall(FnIndex index)
+{
+    // pushFrame and replaceFrame count calls when the jit engine runs. The
+    // count keeps going after the function is compiled so that it shows up
+    // in profile().
+    const std::size_t calls = _profile[index]._calls;
+    if ( ! _native[index]
+        && calls == std::max<std::size_t>(_options._jitThreshold, 1) )
+    {
+        // A function that fails to compile is only tried once.
+        _native[index] = jit::compile(*this, _functions[index]);
+    }
+    return _native[index].get();
+}
+
+ExitStatus vm::VM::runJit()
+{
+    // Starting counted as a call when the root frame was pushed.
+    jitCall(_callStack.top()._fnIndex);
+    for (;;)
+    {
+        CallFrame& frame = _callStack.top();
+        if (const jit::NativeCode* native = _native[frame._fnIndex].get())
+        {
+            switch (native->enter(this, frame._pc, frame._locals))
+            {
+                case jit::Status::returned:
+                    if (_callStack.empty())
+                    {
+                        return ExitStatus::ret;
+                    }
+                    continue;
+                case jit::Status::leave:
+                    continue;
+                case jit::Status::exit:
+                    return ExitStatus::exit;
+                case jit::Status::error:
+                    return ExitStatus::error;
+            }
+        }
+
+        const std::size_t pc = frame._pc++;
+        Word& instruction = _functions[frame._fnIndex]._code[pc];
+        const InstType t = opcode(instruction);
+        if (_recording)
+        {
+            record(frame, pc, instruction);
+        }
+        ExitStatus res = runInstruction<false>(instruction);
+        if (res != ExitStatus::cont)
+        {
+            return res;
+        }
+        
+        switch (t)
+        {
+            case InstType::call:
+            case InstType::tailcall:
+                jitCall(_callStack.top()._fnIndex);
+                break;
+            case InstType::ret:
+                break;
+            default:
+                // Still in the same frame.
+                if (_recording)
+                {
+                    _recording->_steps.back()._taken = frame._pc != pc + 1;
+                }
+                if (frame._pc <= pc && (res = loopBack(frame)) != ExitStatus::cont)
+                {
+                    return res;
+                }
+                break;
+        }
+    }
+}
+
+ExitStatus vm::VM::loopBack(CallFrame& frame)
+{
+    const auto loop = std::make_pair(frame._fnIndex, frame._pc);
+    ++_profile[loop.first]._backEdges;
+    poll();
+    if (_recording)
+    {
+        // Recording stops at the first jump back, which only makes a trace if
+        // it goes to where recording started.
+        if (_recording->_fnIndex == loop.first
+            && _recording->_start == loop.second)
+        {
+            _traces[loop] = jit::compileTrace(*this, _functions[loop.first],
+                                              loop.second, _recording->_steps);
+        }
+        _recording.reset();
+    }
+    
+    auto trace = _traces.find(loop);
+    if (trace == _traces.end())
+    {
+        // Each loop is only recorded once, so a loop that couldn't be traced
+        // isn't tried again.
+        if (_options._traceThreshold
+            && ++_loopCounts[loop] == _options._traceThreshold)
+        {
+            _recording = Recording{loop.first, loop.second, {}};
+        }
+        return ExitStatus::cont;
+    }
+    if ( ! trace->second )
+    {
+        return ExitStatus::cont;
+    }
+    
+    auto pc = trace->second->run(this, frame._locals);
+    if ( ! pc )
+    {
+        return ExitStatus::error;
+    }
+    frame._pc = pc.value();
+    return ExitStatus::cont;
+}
+
+void vm::VM::record(const CallFrame& frame, std::size_t pc, Word instruction)
+{
+    const InstType t = genericOf(opcode(instruction));
+    if (frame._fnIndex != _recording->_fnIndex
+        || _recording->_steps.size() == jit::kMaxTraceLength
+        || t == InstType::call || t == InstType::tailcall
+        || t == InstType::ret || t == InstType::exit)
+    {
+        _recording.reset();
+        return;
+    }
+    
+    // Which values the instruction works on depends on what it is.
+    const Value* sp = _valueStack._sp;
+    const Value* locals = frame._locals;
+    const std::vector<Value>& constants = _functions[frame._fnIndex]._constants;
+    const std::int32_t op = operand(instruction);
+    bool numbers = true;
+    switch (t)
+    {
+        case InstType::sl:
+        case InstType::ll:
+            numbers = locals[op].isNumber();
+            break;
+        case InstType::copy:
+            numbers = sp[-1].isNumber();
+            break;
+        case InstType::add:
+        case InstType::sub:
+        case InstType::mul:
+        case InstType::div:
+        case InstType::jeq:
+        case InstType::jneq:
+        case InstType::jlt:
+        case InstType::jgt:
+            numbers = sp[-2].isNumber() && sp[-1].isNumber();
+            break;
+        case InstType::add_imm:
+        case InstType::sub_imm:
+            numbers = sp[-1].isNumber() && constants[op].isNumber();
+            break;
+        case InstType::ll_add:
+            numbers = sp[-1].isNumber() && locals[op].isNumber();
+            break;
+        case InstType::jlt_imm:
+        case InstType::jgt_imm:
+        case InstType::copy_jlt_imm:
+        case InstType::copy_jgt_imm:
+            numbers = sp[-1].isNumber()
+                && constants[highOperand(instruction)].isNumber();
+            break;
+        default:
+            break;
+    }
+    _recording->_steps.push_back(jit::TraceStep{pc, instruction, numbers, false});
+}
+
+std::vector<jit::TraceStats> vm::VM::traceStats() const
+{
+    std::vector<jit::TraceStats> stats;
+    for (const auto& [loop, trace] : _traces)
+    {
+        if ( ! trace )
+        {
+            continue;
+        }
+        stats.push_back(trace->stats());
+        for (const auto& [name, index] : _fnLookup)
+        {
+            if (index == loop.first)
+            {
+                stats.back()._function = name;
+            }
+        }
+    }
+    return stats;
+}
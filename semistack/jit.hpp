@@ -0,0 +1,189 @@
+//
+//  jit.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/18/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+#include "instruction.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+//  A baseline JIT. Lowered code is already a flat list of instructions with
+//  fixed operands, so each instruction can be compiled on its own by copying a
+//  short machine code template into an executable buffer and filling in the
+//  operands. That takes away the fetch, decode, and indirect jump that the
+//  interpreter pays on every instruction. Jumps are real jumps, and the
+//  templates for arithmetic, comparisons, and moving values around do the work
+//  inline when it is on numbers:
+//
+//      sub_imm k       mov rax, [r13 - 8]; check rax is a number
+//                      mov ecx, k; movd xmm0, eax; movd xmm1, ecx
+//                      subss xmm0, xmm1; movd eax, xmm0; mov [r13 - 8], rax
+//
+//  Anything else goes to a slow path that calls a helper to do what the
+//  interpreter would have.
+//
+//  Native code runs on the same call frames and value stack as the
+//  interpreter. A call to a compiled function is a native call and a call to
+//  one that isn't leaves native code with the caller's frame saved, so that
+//  the interpreter can run the callee. When that returns, the caller picks
+//  back up where it left off from a table of where each instruction's code
+//  starts.
+//
+//  Loops in functions that aren't called often enough to be compiled are
+//  traced instead. Once the interpreter has jumped back to the start of a loop
+//  enough times it records the instructions that the next trip around runs and
+//  the types of the values they see. The trace is compiled into a straight line
+//  of templates that only handle those types and jumps back to its own start.
+//  Guards check that the types and the direction of every jump are still what
+//  was recorded and if one isn't the trace exits back to the interpreter at
+//  the instruction where things went differently.
+//
+//  Only x86-64 Linux is supported. Elsewhere nothing is ever compiled and the
+//  jit engine is an interpreter.
+
+namespace vm {
+
+class VM;
+struct Function;
+
+namespace jit {
+
+#if defined(__x86_64__) && defined(__linux__)
+constexpr bool kSupported = true;
+#else
+constexpr bool kSupported = false;
+#endif
+
+// What native code says when it hands control back.
+enum class Status: std::int32_t
+{
+    returned, // The function returned. Its frame is gone.
+    leave,    // The interpreter has to run the function on top of the stack.
+    exit,     // An exit instruction ran.
+    error,    // Something went wrong and has been logged.
+};
+
+// A function's machine code.
+class NativeCode
+{
+public:
+    NativeCode(std::uint8_t* code, std::size_t size,
+               std::vector<std::uint32_t> offsets)
+        : _code(code), _size(size), _offsets(std::move(offsets)) {}
+    ~NativeCode();
+
+    NativeCode(const NativeCode&) = delete;
+    NativeCode& operator=(const NativeCode&) = delete;
+
+    // Runs the function on top of vm's call stack from instruction pc until
+    // it returns, or something it calls has to be interpreted. locals are the
+    // top frame's.
+    Status enter(VM* vm, std::size_t pc, Value* locals) const
+    {
+        return static_cast<Status>(run(vm, pc, locals));
+    }
+    // The same but returns whatever the code left in eax.
+    std::int32_t run(VM* vm, std::size_t pc, Value* locals) const;
+    // Where the function's first instruction starts.
+    const std::uint8_t* start() const { return _code + _offsets[0]; }
+    // How many bytes of machine code there are.
+    std::size_t size() const { return _size; }
+
+private:
+    std::uint8_t* _code;
+    std::size_t _size;
+    // Where each instruction in the function's _code starts.
+    std::vector<std::uint32_t> _offsets;
+};
+
+// One instruction of a loop as the interpreter ran it while recording a trace.
+struct TraceStep
+{
+    std::size_t _pc;
+    Word _instruction;
+    // Were the values it worked on all numbers?
+    bool _numbers;
+    // For jumps, was it taken?
+    bool _taken;
+};
+
+// Longer loops aren't traced.
+constexpr std::size_t kMaxTraceLength = 1 << 10;
+
+// How a trace has done.
+struct TraceStats
+{
+    // The function that the loop is in.
+    std::string _function;
+    // Where the loop starts in the function's _code.
+    std::size_t _pc;
+    // How many instructions were recorded.
+    std::size_t _length;
+    // How many times it has been run.
+    std::size_t _entries = 0;
+    // How many times it exited because a value didn't have the type that it
+    // was recorded with.
+    std::size_t _guardFailures = 0;
+    // How many times it exited because a jump went the other way, which is how
+    // loops finish.
+    std::size_t _sideExits = 0;
+};
+
+// A compiled loop.
+class Trace
+{
+public:
+    // Where the interpreter carries on from when the trace leaves, and if it
+    // is leaving because of a type guard.
+    struct Exit
+    {
+        std::size_t _pc;
+        bool _guard;
+    };
+    
+    Trace(std::unique_ptr<NativeCode> code, std::vector<Exit> exits,
+          std::size_t pc, std::size_t length)
+        : _code(std::move(code)), _exits(std::move(exits))
+    {
+        _stats._pc = pc;
+        _stats._length = length;
+    }
+    
+    // Runs the loop in the frame on top of vm's call stack, whose locals are
+    // locals, until it exits. Returns where the interpreter should pick up, or
+    // nothing if something went wrong.
+    std::optional<std::size_t> run(VM* vm, Value* locals);
+    // Everything but the function's name, which the VM knows.
+    const TraceStats& stats() const { return _stats; }
+    
+private:
+    std::unique_ptr<NativeCode> _code;
+    std::vector<Exit> _exits;
+    TraceStats _stats;
+};
+
+// Compiles fn's lowered _code for vm. Returns nullptr if it can't, which is
+// always the case on unsupported platforms. fn must have been verified and
+// mustn't be changed while the result is around.
+std::unique_ptr<NativeCode> compile(VM& vm, const Function& fn);
+
+// Compiles the steps recorded for the loop starting at start in fn. Returns
+// nullptr if it can't, which is also always the case on unsupported platforms.
+// The steps can't call or return, and the last one has to be the jump back to
+// start.
+std::unique_ptr<Trace> compileTrace(VM& vm, const Function& fn,
+                                    std::size_t start,
+                                    const std::vector<TraceStep>& steps);
+
+}
+}
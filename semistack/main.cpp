@@ -6,12 +6,17 @@
 //  Copyright © 2020 Zeke Medley. All rights reserved.
 //
 
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <sstream>
 
 #include "logger.hpp"
 #include "instruction.hpp"
 #include "vm.hpp"
 #include "transform.hpp"
+#include "verify.hpp"
+#include "strings.hpp"
 
 #define DOCTEST_CONFIG_IMPLEMENT
 #include "doctest.h"
@@ -36,6 +41,155 @@ int main(int argc, const char * argv[]) {
     return 0;
 }
 
+// Runs the rest of the calling test case once with each of the VM's engines.
+vm::Options eachEngine()
+{
+    vm::Options options;
+    SUBCASE("simple engine") { options._engine = vm::Engine::simple; }
+    SUBCASE("threaded engine") { options._engine = vm::Engine::threaded; }
+    SUBCASE("tailcall engine") { options._engine = vm::Engine::tailcall; }
+    SUBCASE("register engine") { options._engine = vm::Engine::registers; }
+    SUBCASE("jit engine")
+    {
+        // Compile everything so that the tests run machine code.
+        options._engine = vm::Engine::jit;
+        options._jitThreshold = 1;
+    }
+    SUBCASE("tracing jit engine")
+    {
+        // Compile no functions and trace every loop.
+        options._engine = vm::Engine::jit;
+        options._jitThreshold = 1 << 20;
+        options._traceThreshold = 1;
+    }
+    return options;
+}
+
+//  return n < 2 ? n : fib(n - 1) + fib(n - 2)
+//
+//  copy        | n n
+//  pi 2        | n n 2
+//  jlt done    | n
+//  copy        | n n
+//  sl 1        | n
+//  pi 1        | n 1
+//  sub         | n-1
+//  call fib    | fib(n-1)
+//  ll 1        | fib(n-1) n
+//  pi 2        | fib(n-1) n 2
+//  sub         | fib(n-1) n-2
+//  call fib    | fib(n-1) fib(n-2)
+//  add         | fib(n)
+//done:
+//  ret
+//
+// The calls go to callee, which can be an index for fib that isn't linked.
+template <class Callee = const char*>
+vm::Function fibFunction(Callee callee = "fib")
+{
+    vm::Function fib;
+    fib.addInstruction(InstType::copy);
+    fib.addInstruction(InstType::pi, 2);
+    fib.addInstruction(InstType::jlt, "done");
+    fib.addInstruction(InstType::copy);
+    fib.addInstruction(InstType::sl, 1);
+    fib.addInstruction(InstType::pi, 1);
+    fib.addInstruction(InstType::sub);
+    fib.addInstruction(InstType::call, callee);
+    fib.addInstruction(InstType::ll, 1);
+    fib.addInstruction(InstType::pi, 2);
+    fib.addInstruction(InstType::sub);
+    fib.addInstruction(InstType::call, callee);
+    fib.addInstruction(InstType::add);
+    fib.addInstruction(InstType::label, "done");
+    fib.addInstruction(InstType::ret);
+    return fib;
+}
+
+// Adds main, which puts fib(n), and fib to v.
+void addFib(vm::VM& v, int n)
+{
+    vm::Function main;
+    main.addInstruction(InstType::pi, n);
+    main.addInstruction(InstType::call, "fib");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+    v.addFunction(fibFunction(), "fib");
+}
+
+// Puts its argument with suffix on the end. It keeps the argument in a local
+// without having an arity.
+vm::Function shoutFunction(const char* suffix)
+{
+    vm::Function shout;
+    shout.addInstruction(InstType::sl, 0);
+    shout.addInstruction(InstType::ll, 0);
+    shout.addInstruction(InstType::pi, suffix);
+    shout.addInstruction(InstType::add);
+    shout.addInstruction(InstType::puts);
+    shout.addInstruction(InstType::ret);
+    return shout;
+}
+
+// Appends a loop that calls shout with "hey" three times, counting in
+// global 0, to main.
+void addShoutLoop(vm::Function& main)
+{
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sg, 0);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::pi, "hey");
+    main.addInstruction(InstType::call, "shout");
+    main.addInstruction(InstType::lg, 0);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sg, 0);
+    main.addInstruction(InstType::pi, 3);
+    main.addInstruction(InstType::jlt, "loop");
+}
+
+// Adds main, which counts to trips in local 0 by calling inc, and inc to v.
+void addIncLoop(vm::VM& v, int trips)
+{
+    vm::Function inc;
+    inc._arity = 1;
+    inc.addInstruction(InstType::ll, 0);
+    inc.addInstruction(InstType::pi, 1);
+    inc.addInstruction(InstType::add);
+    inc.addInstruction(InstType::ret);
+    
+    vm::Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::call, "inc");
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, trips);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::exit);
+    
+    v.addFunction(std::move(main), "main");
+    v.addFunction(std::move(inc), "inc");
+}
+
+// What the file at path, relative to the directory this file is in, holds.
+std::string readFile(const std::string& path)
+{
+    const std::string here = __FILE__;
+    const auto slash = here.find_last_of('/');
+    const std::string dir = slash == std::string::npos ? "."
+                                                       : here.substr(0, slash);
+    std::ifstream in(dir + "/" + path, std::ios::binary);
+    std::ostringstream contents;
+    contents << in.rdbuf();
+    return contents.str();
+}
+
 TEST_CASE("Processed call instruction.")
 {
     vm::Function start;
@@ -48,7 +202,7 @@ TEST_CASE("Processed call instruction.")
     end.addInstruction({vm::InstType::exit, std::nullopt});
 
     std::string output;
-    vm::VM v([&](std::string s){ output += s; });
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
     v.addFunction(std::move(start), "start");
     v.addFunction(std::move(end), "end");
 
@@ -69,7 +223,7 @@ TEST_CASE("Unprocessed call instruction.")
     end.addInstruction(vm::InstType::exit);
 
     std::string output;
-    vm::VM v([&](std::string s){ output += s; });
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
     v.addFunction(std::move(start), "start");
     v.addFunction(std::move(end), "end");
 
@@ -90,7 +244,7 @@ TEST_CASE("Hello world.")
     main.addInstruction(vm::InstType::exit);
 
     std::string output;
-    vm::VM v([&](std::string s){ output += s; });
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
     v.addFunction(std::move(main), "main");
     v.run("main");
 
@@ -139,7 +293,7 @@ TEST_CASE("Basic loop")
     loop.addInstruction(vm::InstType::exit);
 
     std::string output;
-    vm::VM v([&](std::string s){ output += s; });
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
     v.addFunction(std::move(loop), "loop");
     v.run("loop");
 
@@ -148,56 +302,16 @@ TEST_CASE("Basic loop")
 
 TEST_CASE("fib!")
 {
-    vm::Function main;
-    vm::Function fib;
-
-    main.addInstruction(InstType::pi, 8);
-    main.addInstruction(InstType::call, "fib");
-    main.addInstruction(InstType::puts);
-    main.addInstruction(InstType::exit);
-
-    //  return n < 2 ? n : fib(n - 1) + fib(n - 2)
-    //
-    //  copy        | n n
-    //  pi 2        | n n 2
-    //  jlt done    | n
-    //  copy        | n n
-    //  sl 1        | n
-    //  pi 1        | n 1
-    //  sub         | n-1
-    //  call fib    | fib(n-1)
-    //  ll 1        | fib(n-1) n
-    //  pi 2        | fib(n-1) n 2
-    //  sub         | fib(n-1) n-2
-    //  call fib    | fib(n-1) fib(n-2)
-    //  add         | fib(n)
-    //done:
-    //  ret
-
-    fib.addInstruction(InstType::copy);
-    fib.addInstruction(InstType::pi, 2);
-    fib.addInstruction(InstType::jlt, "done");
-    fib.addInstruction(InstType::copy);
-    fib.addInstruction(InstType::sl, 1);
-    fib.addInstruction(InstType::pi, 1);
-    fib.addInstruction(InstType::sub);
-    fib.addInstruction(InstType::call, "fib");
-    fib.addInstruction(InstType::ll, 1);
-    fib.addInstruction(InstType::pi, 2);
-    fib.addInstruction(InstType::sub);
-    fib.addInstruction(InstType::call, "fib");
-    fib.addInstruction(InstType::add);
-    fib.addInstruction(InstType::label, "done");
-    fib.addInstruction(InstType::ret);
-
     std::string output;
-    vm::VM v([&](std::string s){ output += s; });
-
-    v.addFunction(std::move(main), "main");
-    v.addFunction(std::move(fib), "fib");
+    const vm::Options options = eachEngine();
+    vm::VM v([&](std::string s){ output += s; }, options);
+    addFib(v, 8);
     v.run("main");
 
     CHECK(output == "21.000000");
+    // fib keeps n - 1 in a local without having an arity.
+    CHECK(v.function("fib")->_registerCode.empty()
+          != (options._engine == vm::Engine::registers));
 }
 
 TEST_CASE("assembler output")
@@ -231,3 +345,1513 @@ TEST_CASE("assembler output")
     bool a = (pre == post);
     CHECK(a);
 }
+
+TEST_CASE("lowered bytecode")
+{
+    vm::Function fn;
+    fn.addInstruction(vm::InstType::pi, "hi");
+    fn.addInstruction(vm::InstType::label, "top");
+    fn.addInstruction(vm::InstType::sl, 3);
+    fn.addInstruction(vm::InstType::jump, "top");
+    fn.addInstruction(vm::InstType::exit);
+
+    CHECK(vm::transform::assembleFunction(fn));
+    CHECK(vm::transform::lowerFunction(fn));
+
+    std::vector<vm::Word> expected = {
+        vm::encode(vm::InstType::pi, 0),
+        vm::encode(vm::InstType::sl, 3),
+        vm::encode(vm::InstType::jump, -1),
+        vm::encode(vm::InstType::exit),
+    };
+    CHECK(fn._code == expected);
+    CHECK(fn._constants.size() == 1);
+    CHECK(vm::operand(fn._code[2]) == -1);
+
+    // Unresolved labels can't be lowered.
+    vm::Function bad;
+    bad.addInstruction(vm::InstType::jump, "nowhere");
+    CHECK(vm::transform::assembleFunction(bad));
+    CHECK( ! vm::transform::lowerFunction(bad));
+}
+
+TEST_CASE("constant pool")
+{
+    vm::Function fn;
+    fn.addInstruction(vm::InstType::pi, "hello");
+    fn.addInstruction(vm::InstType::pi, 1);
+    fn.addInstruction(vm::InstType::pi, "hello");
+    fn.addInstruction(vm::InstType::pi, 1.0);
+    fn.addInstruction(vm::InstType::pi, -0.0);
+    fn.addInstruction(vm::InstType::exit);
+
+    CHECK(vm::transform::assembleFunction(fn));
+    CHECK(fn._constants.size() == 3);
+
+    CHECK(vm::transform::lowerFunction(fn));
+    CHECK(fn._code[0] == fn._code[2]);
+    CHECK(fn._code[1] == fn._code[3]);
+    CHECK(fn._code[1] != fn._code[4]);
+
+    // Equal string immediates share the pool's object.
+    CHECK(fn._instructions[0].second->object() == fn._constants[0].object());
+    CHECK(fn._instructions[2].second->object() == fn._constants[0].object());
+    
+    // The empty string and the number whose bits are 1 get slots of their
+    // own.
+    vm::Function small;
+    small.addInstruction(vm::InstType::pi, "");
+    small.addInstruction(vm::InstType::pi,
+                         std::numeric_limits<float>::denorm_min());
+    small.addInstruction(vm::InstType::exit);
+    CHECK(vm::transform::assembleFunction(small));
+    CHECK(vm::transform::lowerFunction(small));
+    REQUIRE(small._constants.size() == 2);
+    CHECK(small._constants[0].isString());
+    CHECK(small._constants[1].bits() == 1);
+}
+
+TEST_CASE("superinstructions")
+{
+    vm::Function fib = fibFunction(0);
+    CHECK(vm::transform::assembleFunction(fib));
+    CHECK(vm::transform::lowerFunction(fib));
+
+    vm::transform::FusionCounts counts;
+    CHECK(vm::transform::fuseSuperinstructions(fib, counts));
+
+    CHECK(counts[InstType::copy_jlt_imm] == 1);
+    CHECK(counts[InstType::sub_imm] == 2);
+    CHECK(fib._code.size() == 10);
+
+    // The jump to done now skips 9 instructions rather than 12.
+    CHECK(vm::opcode(fib._code[0]) == InstType::copy_jlt_imm);
+    CHECK(vm::lowOperand(fib._code[0]) == 9);
+    CHECK(vm::opcode(fib._code[9]) == InstType::ret);
+
+    // Nothing is fused across a jump target.
+    vm::Function loop;
+    loop.addInstruction(InstType::pi, 1);
+    loop.addInstruction(InstType::label, "top");
+    loop.addInstruction(InstType::add);
+    loop.addInstruction(InstType::jump, "top");
+
+    CHECK(vm::transform::assembleFunction(loop));
+    CHECK(vm::transform::lowerFunction(loop));
+    CHECK(vm::transform::fuseSuperinstructions(loop, counts));
+    CHECK(loop._code.size() == 3);
+    
+    // A profiled run counts how many times each one ran as well.
+    vm::Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::label, "top");
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::pi, 3);
+    main.addInstruction(InstType::jlt, "top");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    vm::Options options;
+    options._engine = vm::Engine::simple;
+    options._optimize = false;
+    options._profile = true;
+    vm::VM v([](std::string){}, options);
+    v.addFunction(std::move(main), "main");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(v.fusionCounts() == vm::transform::FusionCounts{
+        {InstType::add_imm, 1}, {InstType::copy_jlt_imm, 1}});
+    CHECK(v.fusionRuns() == vm::transform::FusionCounts{
+        {InstType::add_imm, 3}, {InstType::copy_jlt_imm, 3}});
+}
+
+TEST_CASE("peephole")
+{
+    vm::Function fn;
+    fn.addInstruction(InstType::pi, 1);
+    fn.addInstruction(InstType::sl, 0);
+    fn.addInstruction(InstType::ll, 0);
+    fn.addInstruction(InstType::ll, 1);
+    fn.addInstruction(InstType::sl, 1);
+    fn.addInstruction(InstType::copy);
+    fn.addInstruction(InstType::sl, 2);
+    fn.addInstruction(InstType::jump, "a");
+    fn.addInstruction(InstType::puts);
+    fn.addInstruction(InstType::label, "a");
+    fn.addInstruction(InstType::jump, "b");
+    fn.addInstruction(InstType::label, "b");
+    fn.addInstruction(InstType::puts);
+    fn.addInstruction(InstType::pi, 2);
+    fn.addInstruction(InstType::jeq, "c");
+    fn.addInstruction(InstType::exit);
+    fn.addInstruction(InstType::puts);
+    fn.addInstruction(InstType::label, "c");
+    fn.addInstruction(InstType::jump, "d");
+    fn.addInstruction(InstType::label, "d");
+    fn.addInstruction(InstType::jump, "e");
+    fn.addInstruction(InstType::label, "e");
+    fn.addInstruction(InstType::exit);
+    
+    CHECK(vm::transform::assembleFunction(fn));
+    
+    vm::transform::OptimizationStats stats;
+    CHECK(vm::transform::optimizeFunction(fn, stats));
+    
+    // The jeq is threaded through both jumps which then fall away along with
+    // the puts after the first exit.
+    std::vector<vm::Instruction> expected = {
+        {InstType::pi, 1},
+        {InstType::puts, std::nullopt},
+        {InstType::pi, 2},
+        {InstType::jeq, 2},
+        {InstType::exit, std::nullopt},
+        {InstType::exit, std::nullopt},
+    };
+    CHECK(fn._instructions == expected);
+    
+    CHECK(stats["local round trips"]._saved == 6);
+    CHECK(stats["jumps to next"]._saved == 3);
+    CHECK(stats["unreachable code"]._saved == 3);
+    CHECK(stats["thread jumps"]._changes == 3);
+    
+    // Optimized code still runs the same.
+    std::string output;
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
+    vm::Function hello;
+    hello.addInstruction(InstType::pi, "hello");
+    hello.addInstruction(InstType::sl, 0);
+    hello.addInstruction(InstType::ll, 0);
+    hello.addInstruction(InstType::jump, "out");
+    hello.addInstruction(InstType::pi, "unreachable");
+    hello.addInstruction(InstType::label, "out");
+    hello.addInstruction(InstType::puts);
+    hello.addInstruction(InstType::exit);
+    v.addFunction(std::move(hello), "main");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == "hello");
+    CHECK(v.optimizationStats().at("unreachable code")._saved == 1);
+}
+
+TEST_CASE("constant folding")
+{
+    // The same program as Hello world.
+    vm::Function hello;
+    hello.addInstruction(InstType::pi, "hello world!");
+    hello.addInstruction(InstType::pi, -5.0);
+    hello.addInstruction(InstType::pi, -5.0);
+    hello.addInstruction(InstType::jeq, 2.0);
+    hello.addInstruction(InstType::div);
+    hello.addInstruction(InstType::puts);
+    hello.addInstruction(InstType::exit);
+    
+    vm::transform::OptimizationStats stats;
+    CHECK(vm::transform::assembleFunction(hello));
+    CHECK(vm::transform::optimizeFunction(hello, stats));
+    
+    std::vector<vm::Instruction> expected = {
+        {InstType::pi, "hello world!"},
+        {InstType::puts, std::nullopt},
+        {InstType::exit, std::nullopt},
+    };
+    CHECK(hello._instructions == expected);
+    
+    // Constants are followed through locals and strings are concatenated.
+    vm::Function fn;
+    fn.addInstruction(InstType::pi, 2);
+    fn.addInstruction(InstType::pi, 3);
+    fn.addInstruction(InstType::mul);
+    fn.addInstruction(InstType::sl, 0);
+    fn.addInstruction(InstType::ll, 0);
+    fn.addInstruction(InstType::ll, 0);
+    fn.addInstruction(InstType::add);
+    fn.addInstruction(InstType::pi, "a");
+    fn.addInstruction(InstType::pi, "b");
+    fn.addInstruction(InstType::add);
+    fn.addInstruction(InstType::pi, 1);
+    fn.addInstruction(InstType::pi, "c");
+    fn.addInstruction(InstType::add);
+    fn.addInstruction(InstType::exit);
+    
+    CHECK(vm::transform::assembleFunction(fn));
+    CHECK(vm::transform::optimizeFunction(fn, stats));
+    
+    // Adding a number to a string is left for the VM to complain about.
+    expected = {
+        {InstType::pi, 12},
+        {InstType::pi, "ab"},
+        {InstType::pi, 1},
+        {InstType::pi, "c"},
+        {InstType::add, std::nullopt},
+        {InstType::exit, std::nullopt},
+    };
+    CHECK(fn._instructions == expected);
+    
+    // Locals aren't followed into another block.
+    vm::Function loop;
+    loop.addInstruction(InstType::pi, 0);
+    loop.addInstruction(InstType::sl, 0);
+    loop.addInstruction(InstType::label, "top");
+    loop.addInstruction(InstType::ll, 0);
+    loop.addInstruction(InstType::pi, 1);
+    loop.addInstruction(InstType::add);
+    loop.addInstruction(InstType::copy);
+    loop.addInstruction(InstType::sl, 0);
+    loop.addInstruction(InstType::pi, 3);
+    loop.addInstruction(InstType::jlt, "top");
+    loop.addInstruction(InstType::ll, 0);
+    loop.addInstruction(InstType::puts);
+    loop.addInstruction(InstType::exit);
+    
+    std::string output;
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
+    v.addFunction(std::move(loop), "main");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == "3.000000");
+}
+
+TEST_CASE("verifier")
+{
+    // Assembles, lowers, and verifies a program whose functions are called
+    // 0, 1, ...
+    auto verify = [](std::vector<vm::Function> fns)
+    {
+        std::map<std::string, std::size_t> table;
+        for (auto& fn : fns)
+        {
+            table.insert({std::to_string(table.size()), table.size()});
+            REQUIRE(vm::transform::assembleFunction(fn));
+            REQUIRE(vm::transform::lowerFunction(fn));
+        }
+        return vm::verify::verifyFunctions(fns, table, 0);
+    };
+    auto program = [](std::vector<vm::Instruction> code)
+    {
+        vm::Function fn;
+        for (auto& i : code) fn.addInstruction(std::move(i));
+        return fn;
+    };
+    
+    using I = vm::Instruction;
+    using vm::verify::Result;
+    const I exit = {InstType::exit, std::nullopt};
+    
+    std::vector<vm::Function> fns;
+    fns.push_back(program({{InstType::pi, 1}, {InstType::puts, std::nullopt}, exit}));
+    CHECK(verify(std::move(fns)) == Result::verified);
+    
+    // Popping from an empty stack.
+    fns.clear();
+    fns.push_back(program({{InstType::pi, 1}, {InstType::add, std::nullopt}, exit}));
+    CHECK(verify(std::move(fns)) == Result::rejected);
+    
+    // Out of range local and global indices.
+    fns.clear();
+    fns.push_back(program({{InstType::ll, 256}, exit}));
+    CHECK(verify(std::move(fns)) == Result::rejected);
+    fns.clear();
+    fns.push_back(program({{InstType::lg, -1}, exit}));
+    CHECK(verify(std::move(fns)) == Result::rejected);
+    
+    // Negative local indices don't assemble, even ones that would truncate
+    // to 0, and locals are bounded by the slots the function has.
+    vm::Function negative = program({{InstType::ll, -0.5}, exit});
+    CHECK_FALSE(vm::transform::assembleFunction(negative));
+    vm::Function one = program({{InstType::ll, 0}, {InstType::puts, std::nullopt},
+                                exit});
+    REQUIRE(vm::transform::assembleFunction(one));
+    REQUIRE(vm::transform::lowerFunction(one));
+    CHECK(one._localCount == 1);
+    one._code[0] = vm::encode(InstType::ll, 1);
+    fns.clear();
+    fns.push_back(std::move(one));
+    CHECK(vm::verify::verifyFunctions(fns, {{"0", 0}}, 0) == Result::rejected);
+    
+    // Jumping out of the function is rejected, even where it can't run.
+    fns.clear();
+    fns.push_back(program({exit, {InstType::jump, 5}}));
+    CHECK(verify(std::move(fns)) == Result::rejected);
+    
+    // Falling off the end only goes wrong if it happens.
+    fns.clear();
+    fns.push_back(program({{InstType::pi, 1}}));
+    CHECK(verify(std::move(fns)) == Result::unverified);
+    
+    // Two paths that meet with different depths.
+    fns.clear();
+    fns.push_back(program({
+        {InstType::lg, 0}, {InstType::lg, 1}, {InstType::jeq, 2},
+        {InstType::pi, 1}, exit}));
+    CHECK(verify(std::move(fns)) == Result::unverified);
+    
+    // Subtracting strings is always an error, if it runs.
+    fns.clear();
+    fns.push_back(program({
+        {InstType::pi, "a"}, {InstType::pi, "b"}, {InstType::sub, std::nullopt},
+        exit}));
+    CHECK(verify(std::move(fns)) == Result::unverified);
+    
+    // Functions other than the root can pop their caller's values, but only
+    // as many as the caller has.
+    fns.clear();
+    fns.push_back(program({{InstType::pi, 1}, {InstType::call, 1},
+                           {InstType::puts, std::nullopt}, exit}));
+    fns.push_back(program({{InstType::pi, 1}, {InstType::add, std::nullopt},
+                           {InstType::ret, std::nullopt}}));
+    CHECK(verify(std::move(fns)) == Result::verified);
+    fns.clear();
+    fns.push_back(program({{InstType::call, 1}, exit}));
+    fns.push_back(program({{InstType::puts, std::nullopt},
+                           {InstType::ret, std::nullopt}}));
+    CHECK(verify(std::move(fns)) == Result::rejected);
+    
+    // The VM won't run a program that the verifier rejects. Without the
+    // verifier the simple engine catches the underflow as it happens.
+    vm::Function bad = program({{InstType::pi, 1}, {InstType::puts, std::nullopt},
+                                {InstType::puts, std::nullopt}, exit});
+    vm::Function alsoBad;
+    for (auto& i : bad._instructions) alsoBad.addInstruction(i);
+    
+    std::string output;
+    vm::Options options = eachEngine();
+    vm::VM v([&](std::string s){ output += s; }, options);
+    v.addFunction(std::move(bad), "main");
+    CHECK(v.run("main") == vm::ExitStatus::error);
+    CHECK(output == "");
+    
+    options._verify = false;
+    vm::VM unverified([&](std::string s){ output += s; }, options);
+    unverified.addFunction(std::move(alsoBad), "main");
+    CHECK(unverified.run("main") == vm::ExitStatus::error);
+    CHECK(output == "1.000000");
+    
+    // Programs that can't be verified still run, with checks. This loop
+    // leaves a value behind on every trip.
+    vm::Function grows;
+    grows.addInstruction(InstType::pi, 0);
+    grows.addInstruction(InstType::sg, 0);
+    grows.addInstruction(InstType::label, "loop");
+    grows.addInstruction(InstType::pi, 1);
+    grows.addInstruction(InstType::lg, 0);
+    grows.addInstruction(InstType::pi, 1);
+    grows.addInstruction(InstType::add);
+    grows.addInstruction(InstType::copy);
+    grows.addInstruction(InstType::sg, 0);
+    grows.addInstruction(InstType::pi, 3);
+    grows.addInstruction(InstType::jlt, "loop");
+    grows.addInstruction(InstType::add);
+    grows.addInstruction(InstType::add);
+    grows.addInstruction(InstType::puts);
+    grows.addInstruction(InstType::exit);
+    
+    // Returns one value or two depending on global 0.
+    vm::Function uneven;
+    uneven.addInstruction(InstType::lg, 0);
+    uneven.addInstruction(InstType::pi, 0);
+    uneven.addInstruction(InstType::jeq, "one");
+    uneven.addInstruction(InstType::pi, 1);
+    uneven.addInstruction(InstType::pi, 2);
+    uneven.addInstruction(InstType::ret);
+    uneven.addInstruction(InstType::label, "one");
+    uneven.addInstruction(InstType::pi, 3);
+    uneven.addInstruction(InstType::ret);
+    
+    vm::Function callsUneven;
+    callsUneven.addInstruction(InstType::call, "uneven");
+    callsUneven.addInstruction(InstType::puts);
+    callsUneven.addInstruction(InstType::exit);
+    
+    // Adds a number to a string where it never runs.
+    vm::Function dead;
+    dead.addInstruction(InstType::lg, 0);
+    dead.addInstruction(InstType::pi, 1);
+    dead.addInstruction(InstType::jeq, "never");
+    dead.addInstruction(InstType::pi, "ok");
+    dead.addInstruction(InstType::puts);
+    dead.addInstruction(InstType::exit);
+    dead.addInstruction(InstType::label, "never");
+    dead.addInstruction(InstType::pi, 1);
+    dead.addInstruction(InstType::pi, "a");
+    dead.addInstruction(InstType::add);
+    dead.addInstruction(InstType::puts);
+    dead.addInstruction(InstType::exit);
+    
+    options._verify = true;
+    output.clear();
+    vm::VM x([&](std::string s){ output += s; }, options);
+    x.addFunction(std::move(grows), "main");
+    CHECK(x.run("main") == vm::ExitStatus::exit);
+    vm::VM y([&](std::string s){ output += s; }, options);
+    y.addFunction(std::move(callsUneven), "main");
+    y.addFunction(std::move(uneven), "uneven");
+    CHECK(y.run("main") == vm::ExitStatus::exit);
+    vm::VM z([&](std::string s){ output += s; }, options);
+    z.addFunction(std::move(dead), "main");
+    CHECK(z.run("main") == vm::ExitStatus::exit);
+    CHECK(output == "3.0000003.000000ok");
+}
+
+TEST_CASE("quickening")
+{
+    // Adds whatever it is passed.
+    vm::Function add;
+    add.addInstruction(InstType::add);
+    add.addInstruction(InstType::ret);
+    
+    vm::Function main;
+    main.addInstruction(InstType::lg, 0);
+    main.addInstruction(InstType::lg, 1);
+    main.addInstruction(InstType::call, "add");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::pi, 10);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::sub);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::jgt, "loop");
+    main.addInstruction(InstType::pi, "a");
+    main.addInstruction(InstType::pi, "b");
+    main.addInstruction(InstType::call, "add");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    std::string output;
+    vm::Options options = eachEngine();
+    vm::VM v([&](std::string s){ output += s; }, options);
+    v.addFunction(std::move(main), "main");
+    v.addFunction(std::move(add), "add");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == "0.000000ab");
+    
+    // The loop is quickened for numbers by the stack engines. The register
+    // tier may run main as register code and the jit as machine code, neither
+    // of which are quickened.
+    const vm::Function* m = v.function("main");
+    REQUIRE(m);
+    std::vector<InstType> ops;
+    for (vm::Word w : m->_code) ops.push_back(vm::opcode(w));
+    const bool stackEngine = options._engine == vm::Engine::simple
+        || options._engine == vm::Engine::threaded
+        || options._engine == vm::Engine::tailcall;
+    if (stackEngine || (m->_registerCode.empty() && ! v.compiled("main")))
+    {
+        CHECK(std::count(ops.begin(), ops.end(), InstType::sub_imm_num) == 1);
+        CHECK(std::count(ops.begin(), ops.end(), InstType::copy_jgt_imm_num) == 1);
+    }
+    
+    // add was quickened for the numbers it saw first and fell back to the
+    // generic instruction when it saw strings.
+    const vm::Function* a = v.function("add");
+    REQUIRE(a);
+    CHECK(vm::opcode(a->_code[0]) == InstType::add);
+    
+    // Nothing changes with quickening off.
+    vm::Function plain;
+    plain.addInstruction(InstType::pi, 1);
+    plain.addInstruction(InstType::lg, 0);
+    plain.addInstruction(InstType::add);
+    plain.addInstruction(InstType::puts);
+    plain.addInstruction(InstType::exit);
+    
+    options._quicken = false;
+    options._superinstructions = false;
+    vm::VM slow([&](std::string s){ output += s; }, options);
+    slow.addFunction(std::move(plain), "plain");
+    CHECK(slow.run("plain") == vm::ExitStatus::exit);
+    CHECK(vm::opcode(slow.function("plain")->_code[2]) == InstType::add);
+    
+    // Without the verifier a quickened instruction can come around again at
+    // a different depth and is checked like the generic one. The add here
+    // becomes add_num and then runs with one value on the stack.
+    vm::Function loop;
+    loop.addInstruction(InstType::pi, 1);
+    loop.addInstruction(InstType::pi, 2);
+    loop.addInstruction(InstType::label, "top");
+    loop.addInstruction(InstType::add);
+    loop.addInstruction(InstType::copy);
+    loop.addInstruction(InstType::puts);
+    loop.addInstruction(InstType::jump, "top");
+    
+    vm::Options unchecked;
+    unchecked._verify = false;
+    unchecked._engine = vm::Engine::simple;
+    output.clear();
+    vm::VM underflow([&](std::string s){ output += s; }, unchecked);
+    underflow.addFunction(std::move(loop), "main");
+    // Errors are logged to stdout.
+    std::ostringstream logged;
+    std::streambuf* out = std::cout.rdbuf(logged.rdbuf());
+    const vm::ExitStatus status = underflow.run("main");
+    std::cout.rdbuf(out);
+    CHECK(status == vm::ExitStatus::error);
+    CHECK(output == "3.000000");
+    CHECK(logged.str().find("Stack underflow.") != std::string::npos);
+    CHECK(vm::opcode(underflow.function("main")->_code[2]) == InstType::add_num);
+}
+
+TEST_CASE("value stack")
+{
+    // Pushes one more value every time it recurses.
+    auto recurse = []()
+    {
+        vm::Function fn;
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::call, "recurse");
+        fn.addInstruction(InstType::ret);
+        return fn;
+    };
+    
+    std::string output;
+    vm::Options options = eachEngine();
+    options._stackSize = 64;
+    
+    vm::VM v([&](std::string s){ output += s; }, options);
+    v.addFunction(recurse(), "recurse");
+    CHECK(v.run("recurse") == vm::ExitStatus::error);
+    CHECK(v.function("recurse")->_maxStack == 1);
+    
+    options._verify = false;
+    vm::VM unverified([&](std::string s){ output += s; }, options);
+    unverified.addFunction(recurse(), "recurse");
+    CHECK(unverified.run("recurse") == vm::ExitStatus::error);
+    
+    // The deepest fib gets is n and the 2 it compares against.
+    options._verify = true;
+    vm::VM f([&](std::string s){ output += s; }, options);
+    addFib(f, 3);
+    CHECK(f.run("main") == vm::ExitStatus::exit);
+    CHECK(output == "2.000000");
+    CHECK(f.function("main")->_maxStack == 1);
+    CHECK(f.function("fib")->_maxStack == 2);
+}
+
+TEST_CASE("call frames")
+{
+    // Stores n in its local, recurses on n - 1, and then adds its local back
+    // in. That only works if every call gets its own locals.
+    auto sum = []()
+    {
+        vm::Function fn;
+        fn.addInstruction(InstType::copy);
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::jlt, "done");
+        fn.addInstruction(InstType::copy);
+        fn.addInstruction(InstType::sl, 3);
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::sub);
+        fn.addInstruction(InstType::call, "sum");
+        fn.addInstruction(InstType::ll, 3);
+        fn.addInstruction(InstType::add);
+        fn.addInstruction(InstType::label, "done");
+        fn.addInstruction(InstType::ret);
+        return fn;
+    };
+    auto main = [](float n)
+    {
+        vm::Function fn;
+        fn.addInstruction(InstType::pi, n);
+        fn.addInstruction(InstType::call, "sum");
+        fn.addInstruction(InstType::puts);
+        fn.addInstruction(InstType::exit);
+        return fn;
+    };
+    
+    std::string output;
+    vm::Options options = eachEngine();
+    options._localStackSize = 4 * 8;
+    
+    vm::VM v([&](std::string s){ output += s; }, options);
+    v.addFunction(main(5), "main");
+    v.addFunction(sum(), "sum");
+    CHECK(v.function("main")->_localCount == 0);
+    CHECK(v.function("sum")->_localCount == 4);
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == "15.000000");
+    
+    // Each call to sum takes 4 slots so 8 calls fill up the local stack.
+    vm::VM deep([&](std::string s){ output += s; }, options);
+    deep.addFunction(main(9), "main");
+    deep.addFunction(sum(), "sum");
+    CHECK(deep.run("main") == vm::ExitStatus::error);
+    
+    options._verify = false;
+    vm::VM unverified([&](std::string s){ output += s; }, options);
+    unverified.addFunction(main(9), "main");
+    unverified.addFunction(sum(), "sum");
+    CHECK(unverified.run("main") == vm::ExitStatus::error);
+}
+
+TEST_CASE("argument windows")
+{
+    // fib with its argument in local 0 rather than copied off of the stack.
+    auto fib = []()
+    {
+        vm::Function fn;
+        fn._arity = 1;
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::pi, 2);
+        fn.addInstruction(InstType::jlt, "small");
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::sub);
+        fn.addInstruction(InstType::call, "fib");
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::pi, 2);
+        fn.addInstruction(InstType::sub);
+        fn.addInstruction(InstType::call, "fib");
+        fn.addInstruction(InstType::add);
+        fn.addInstruction(InstType::ret);
+        fn.addInstruction(InstType::label, "small");
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::ret);
+        return fn;
+    };
+    // Returns its arguments' difference and their sum, with the sum kept in a
+    // local that isn't an argument.
+    auto diffSum = []()
+    {
+        vm::Function fn;
+        fn._arity = 2;
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::ll, 1);
+        fn.addInstruction(InstType::add);
+        fn.addInstruction(InstType::sl, 2);
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::ll, 1);
+        fn.addInstruction(InstType::sub);
+        fn.addInstruction(InstType::ll, 2);
+        fn.addInstruction(InstType::ret);
+        return fn;
+    };
+    auto main = []()
+    {
+        vm::Function fn;
+        fn.addInstruction(InstType::pi, 10);
+        fn.addInstruction(InstType::call, "fib");
+        fn.addInstruction(InstType::puts);
+        fn.addInstruction(InstType::pi, 10);
+        fn.addInstruction(InstType::pi, 3);
+        fn.addInstruction(InstType::call, "diffSum");
+        fn.addInstruction(InstType::puts);
+        fn.addInstruction(InstType::puts);
+        fn.addInstruction(InstType::exit);
+        return fn;
+    };
+    
+    vm::Options options = eachEngine();
+    for (bool verify : {true, false})
+    {
+        options._verify = verify;
+        std::vector<std::string> output;
+        vm::VM v([&](std::string s){ output.push_back(s); }, options);
+        v.addFunction(main(), "main");
+        v.addFunction(fib(), "fib");
+        v.addFunction(diffSum(), "diffSum");
+        CHECK(v.run("main") == vm::ExitStatus::exit);
+        CHECK(output == std::vector<std::string>{"55.000000", "13.000000",
+                                                  "7.000000"});
+        CHECK(v.function("fib")->_localCount == 1);
+        CHECK(v.function("diffSum")->_localCount == 3);
+    }
+    
+    // A function with an arity finds its arguments in locals. It can't pop
+    // them, or anything under them, off of the stack.
+    auto greedy = []()
+    {
+        vm::Function fn;
+        fn._arity = 1;
+        fn.addInstruction(InstType::puts);
+        fn.addInstruction(InstType::ret);
+        return fn;
+    };
+    auto caller = []()
+    {
+        vm::Function fn;
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::pi, 2);
+        fn.addInstruction(InstType::call, "greedy");
+        fn.addInstruction(InstType::exit);
+        return fn;
+    };
+    for (bool verify : {true, false})
+    {
+        options._verify = verify;
+        vm::VM v([](std::string){}, options);
+        v.addFunction(caller(), "caller");
+        v.addFunction(greedy(), "greedy");
+        CHECK(v.run("caller") == vm::ExitStatus::error);
+    }
+    
+    // Nothing passes arguments to the function a program starts in.
+    vm::VM v([](std::string){}, options);
+    v.addFunction(fib(), "fib");
+    CHECK(v.run("fib") == vm::ExitStatus::error);
+}
+
+TEST_CASE("tail calls")
+{
+    // Counts down from its first argument, adding one to its second each time.
+    auto loop = []()
+    {
+        vm::Function fn;
+        fn._arity = 2;
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::pi, 0);
+        fn.addInstruction(InstType::jeq, "done");
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::sub);
+        fn.addInstruction(InstType::ll, 1);
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::add);
+        fn.addInstruction(InstType::call, "loop");
+        fn.addInstruction(InstType::ret);
+        fn.addInstruction(InstType::label, "done");
+        fn.addInstruction(InstType::ll, 1);
+        fn.addInstruction(InstType::ret);
+        return fn;
+    };
+    // The same without an arity.
+    auto countdown = []()
+    {
+        vm::Function fn;
+        fn.addInstruction(InstType::copy);
+        fn.addInstruction(InstType::pi, 0);
+        fn.addInstruction(InstType::jeq, "done");
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::sub);
+        fn.addInstruction(InstType::sl, 0);
+        fn.addInstruction(InstType::pi, 1);
+        fn.addInstruction(InstType::add);
+        fn.addInstruction(InstType::ll, 0);
+        fn.addInstruction(InstType::call, "countdown");
+        fn.addInstruction(InstType::ret);
+        fn.addInstruction(InstType::label, "done");
+        fn.addInstruction(InstType::sl, 0);
+        fn.addInstruction(InstType::ret);
+        return fn;
+    };
+    auto main = [](std::string callee)
+    {
+        vm::Function fn;
+        // Something under the arguments to check that it is left alone.
+        fn.addInstruction(InstType::pi, 0);
+        // loop takes the count first and countdown takes it last.
+        fn.addInstruction(InstType::pi, callee == "loop" ? 10000 : 0);
+        fn.addInstruction(InstType::pi, callee == "loop" ? 0 : 10000);
+        fn.addInstruction(InstType::call, callee);
+        fn.addInstruction(InstType::puts);
+        fn.addInstruction(InstType::puts);
+        fn.addInstruction(InstType::exit);
+        return fn;
+    };
+    
+    vm::Options options = eachEngine();
+    options._stackSize = 64;
+    options._localStackSize = 64;
+    
+    for (std::string callee : {"loop", "countdown"})
+    {
+        std::vector<std::string> output;
+        vm::VM v([&](std::string s){ output.push_back(s); }, options);
+        v.addFunction(main(callee), "main");
+        v.addFunction(callee == "loop" ? loop() : countdown(), callee);
+        CHECK(v.optimizationStats().at("tail calls")._changes == 1);
+        
+        const auto& code = v.function(callee)->_instructions;
+        CHECK(std::count_if(code.begin(), code.end(), [](const auto& i)
+        {
+            return i.first == InstType::tailcall;
+        }) == 1);
+        CHECK(std::count_if(code.begin(), code.end(), [](const auto& i)
+        {
+            return i.first == InstType::ret;
+        }) == 1);
+        
+        CHECK(v.run("main") == vm::ExitStatus::exit);
+        CHECK(output == std::vector<std::string>{"10000.000000", "0.000000"});
+    }
+    
+    // Without them every call takes more room.
+    options._optimize = false;
+    for (std::string callee : {"loop", "countdown"})
+    {
+        vm::VM v([](std::string){}, options);
+        v.addFunction(main(callee), "main");
+        v.addFunction(callee == "loop" ? loop() : countdown(), callee);
+        CHECK(v.run("main") == vm::ExitStatus::error);
+    }
+}
+
+TEST_CASE("register tier")
+{
+    auto addProgram = [](vm::VM& v)
+    {
+        // Loads of locals and constants become operands.
+        vm::Function inc;
+        inc._arity = 1;
+        inc.addInstruction(InstType::ll, 0);
+        inc.addInstruction(InstType::pi, 1);
+        inc.addInstruction(InstType::add);
+        inc.addInstruction(InstType::sl, 0);
+        inc.addInstruction(InstType::ll, 0);
+        inc.addInstruction(InstType::ret);
+        
+        // Has locals but no arity so they get operands of their own.
+        vm::Function greet;
+        greet.addInstruction(InstType::sl, 0);
+        greet.addInstruction(InstType::pi, "hello ");
+        greet.addInstruction(InstType::ll, 0);
+        greet.addInstruction(InstType::add);
+        greet.addInstruction(InstType::puts);
+        greet.addInstruction(InstType::ret);
+        
+        // No locals, so it is translated even though it pops what its caller
+        // pushed.
+        vm::Function twice;
+        twice.addInstruction(InstType::copy);
+        twice.addInstruction(InstType::add);
+        twice.addInstruction(InstType::ret);
+        
+        vm::Function main;
+        main.addInstruction(InstType::pi, 0);
+        main.addInstruction(InstType::sg, 0);
+        main.addInstruction(InstType::label, "loop");
+        main.addInstruction(InstType::lg, 0);
+        main.addInstruction(InstType::call, "inc");
+        main.addInstruction(InstType::copy);
+        main.addInstruction(InstType::sg, 0);
+        main.addInstruction(InstType::call, "twice");
+        main.addInstruction(InstType::puts);
+        main.addInstruction(InstType::lg, 0);
+        main.addInstruction(InstType::pi, 3);
+        main.addInstruction(InstType::jlt, "loop");
+        main.addInstruction(InstType::pi, "world");
+        main.addInstruction(InstType::call, "greet");
+        main.addInstruction(InstType::exit);
+        
+        v.addFunction(std::move(main), "main");
+        v.addFunction(std::move(inc), "inc");
+        v.addFunction(std::move(greet), "greet");
+        v.addFunction(std::move(twice), "twice");
+    };
+    
+    auto run = [&](vm::Engine engine)
+    {
+        vm::Options options;
+        options._engine = engine;
+        std::vector<std::string> output;
+        vm::VM v([&](std::string s){ output.push_back(s); }, options);
+        addProgram(v);
+        CHECK(v.run("main") == vm::ExitStatus::exit);
+        
+        bool translated = engine == vm::Engine::registers;
+        CHECK(v.function("main")->_registerCode.empty() != translated);
+        CHECK(v.function("twice")->_registerCode.empty() != translated);
+        CHECK(v.function("greet")->_registerCode.empty() != translated);
+        
+        std::vector<std::string> code;
+        for (const char* name : {"inc", "greet"})
+        {
+            for (const auto& i : v.function(name)->_registerCode)
+            {
+                code.push_back(vm::to_string(i));
+            }
+        }
+        return std::make_pair(output, code);
+    };
+    
+    auto [stack, none] = run(vm::Engine::threaded);
+    CHECK(none.empty());
+    auto [registers, code] = run(vm::Engine::registers);
+    CHECK(stack == std::vector<std::string>{"2.000000", "4.000000", "6.000000",
+                                            "hello world"});
+    CHECK(registers == stack);
+    // inc, and then greet, whose local is l0 and whose argument was pushed by
+    // its caller below where its registers start.
+    CHECK(code == std::vector<std::string>{"add r-1, r-1, k0", "move r0, r-1",
+                                           "ret 1", "move l0, r-1",
+                                           "add r-1, k0, l0", "puts r-1",
+                                           "ret -1"});
+}
+
+TEST_CASE("jit")
+{
+    auto addProgram = [](vm::VM& v)
+    {
+        // Counts to n without tail calls, so native calls nest deeper than the
+        // jit lets them and have to go back through the interpreter.
+        vm::Function count;
+        count._arity = 1;
+        count.addInstruction(InstType::ll, 0);
+        count.addInstruction(InstType::pi, 0);
+        count.addInstruction(InstType::jgt, "more");
+        count.addInstruction(InstType::pi, 0);
+        count.addInstruction(InstType::ret);
+        count.addInstruction(InstType::label, "more");
+        count.addInstruction(InstType::pi, 1);
+        count.addInstruction(InstType::ll, 0);
+        count.addInstruction(InstType::pi, 1);
+        count.addInstruction(InstType::sub);
+        count.addInstruction(InstType::call, "count");
+        count.addInstruction(InstType::add);
+        count.addInstruction(InstType::ret);
+        
+        vm::Function main;
+        main.addInstruction(InstType::pi, 6000);
+        main.addInstruction(InstType::call, "count");
+        main.addInstruction(InstType::puts);
+        addShoutLoop(main);
+        main.addInstruction(InstType::exit);
+        
+        v.addFunction(std::move(main), "main");
+        v.addFunction(std::move(count), "count");
+        v.addFunction(shoutFunction("!"), "shout");
+    };
+    
+    // The first ten calls to count are interpreted and the frames they leave
+    // behind finish as machine code. shout isn't called often enough to be
+    // compiled.
+    std::vector<std::string> output;
+    vm::Options options;
+    options._engine = vm::Engine::jit;
+    options._jitThreshold = 10;
+    vm::VM v([&](std::string s){ output.push_back(s); }, options);
+    addProgram(v);
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == std::vector<std::string>{"6000.000000", "hey!", "hey!",
+                                             "hey!"});
+    CHECK(v.compiled("count") == vm::jit::kSupported);
+    CHECK_FALSE(v.compiled("shout"));
+    CHECK_FALSE(v.compiled("main"));
+    
+    // Nothing is compiled until it is hot.
+    output.clear();
+    options._jitThreshold = 1 << 20;
+    vm::VM cold([&](std::string s){ output.push_back(s); }, options);
+    addProgram(cold);
+    CHECK(cold.run("main") == vm::ExitStatus::exit);
+    CHECK(output.size() == 4);
+    CHECK_FALSE(cold.compiled("count"));
+}
+
+TEST_CASE("tracing")
+{
+    // Counts i to 1000 and copies x into y on every trip. x turns into a
+    // string halfway through.
+    vm::Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::pi, 500);
+    main.addInstruction(InstType::jneq, "same");
+    main.addInstruction(InstType::pi, "s");
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::label, "same");
+    main.addInstruction(InstType::ll, 1);
+    main.addInstruction(InstType::sl, 2);
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 1000);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::ll, 2);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    std::vector<std::string> output;
+    vm::Options options;
+    options._engine = vm::Engine::jit;
+    options._traceThreshold = 10;
+    vm::VM v([&](std::string s){ output.push_back(s); }, options);
+    v.addFunction(std::move(main), "main");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == std::vector<std::string>{"1000.000000", "s"});
+    
+    auto stats = v.traceStats();
+    if ( ! vm::jit::kSupported )
+    {
+        CHECK(stats.empty());
+        return;
+    }
+    REQUIRE(stats.size() == 1);
+    const vm::jit::TraceStats& loop = stats[0];
+    CHECK(loop._function == "main");
+    CHECK(loop._pc == 4);
+    // The loop was recorded on its tenth trip and its trace ran from the
+    // eleventh until i was 500, when the jneq went the other way. Every trip
+    // after that the trace was entered and failed the guard on loading x, so
+    // the interpreter finished the loop.
+    CHECK(loop._entries == 500);
+    CHECK(loop._sideExits == 1);
+    CHECK(loop._guardFailures == 499);
+}
+
+TEST_CASE("ahead of time")
+{
+    auto addProgram = [](vm::VM& v)
+    {
+        vm::Function half;
+        half._arity = 1;
+        half.addInstruction(InstType::ll, 0);
+        half.addInstruction(InstType::pi, 2);
+        half.addInstruction(InstType::div);
+        half.addInstruction(InstType::ret);
+        
+        vm::Function main;
+        addShoutLoop(main);
+        main.addInstruction(InstType::lg, 0);
+        main.addInstruction(InstType::call, "half");
+        main.addInstruction(InstType::puts);
+        main.addInstruction(InstType::exit);
+        
+        v.addFunction(std::move(main), "main");
+        v.addFunction(shoutFunction("!\n"), "shout");
+        v.addFunction(std::move(half), "half");
+    };
+    
+    std::vector<std::string> output;
+    vm::VM v([&](std::string s){ output.push_back(s); });
+    addProgram(v);
+    
+    std::ostringstream out;
+    REQUIRE(v.compileAhead("main", "program", out));
+    const std::string code = out.str();
+    auto has = [&](const std::string& s)
+    {
+        return code.find(s) != std::string::npos;
+    };
+    // A function each, named in a comment.
+    CHECK(has("// main\nbool f0(vm::aot::Runtime& rt, vm::Value* sp)"));
+    CHECK(has("// shout\nbool f1(vm::aot::Runtime& rt, vm::Value* sp)"));
+    CHECK(has("// half\nbool f2(vm::aot::Runtime& rt, vm::Value* sp)"));
+    CHECK(has("vm::ExitStatus program(vm::aot::Runtime& rt)"));
+    // Strings keep every byte.
+    CHECK(has("std::string(\"!\\012\", 2)"));
+    // The loop is a goto and shout's locals are on the runtime's stack.
+    CHECK(has("if (taken) goto L2;"));
+    CHECK(has("vm::Value* locals = rt.enter(1);"));
+    // half takes its argument in place.
+    CHECK(has("vm::Value* locals = sp - 1;"));
+    CHECK(has("if ( ! f2(rt, base + 1) ) return false;"));
+    // aot/ builds and runs a copy of the program, which has to be kept up to
+    // date.
+    CHECK(code == readFile("../aot/program.cpp"));
+    
+    // Writing the program out doesn't stop it from running.
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == std::vector<std::string>{"hey!\n", "hey!\n", "hey!\n",
+                                             "1.500000"});
+    
+    // Entry points have to be C++ names.
+    std::ostringstream bad;
+    CHECK_FALSE(v.compileAhead("main", "not a name", bad));
+    CHECK(bad.str().empty());
+    
+    // Function values only exist in a VM.
+    vm::Function constant;
+    constant.addInstruction(InstType::pi, std::make_shared<vm::Function>());
+    constant.addInstruction(InstType::puts);
+    constant.addInstruction(InstType::exit);
+    vm::VM w([](std::string){});
+    w.addFunction(std::move(constant), "main");
+    CHECK_FALSE(w.compileAhead("main", "program", bad));
+    CHECK(bad.str().empty());
+    
+    // Counts down from n by calling itself in tail position.
+    vm::Function count;
+    count._arity = 1;
+    count.addInstruction(InstType::ll, 0);
+    count.addInstruction(InstType::pi, 0);
+    count.addInstruction(InstType::jeq, "done");
+    count.addInstruction(InstType::ll, 0);
+    count.addInstruction(InstType::pi, 1);
+    count.addInstruction(InstType::sub);
+    count.addInstruction(InstType::tailcall, "count");
+    count.addInstruction(InstType::label, "done");
+    count.addInstruction(InstType::ret);
+    
+    // Counts global 0 down the same way, leaving it in local 0 each time.
+    // Local 0 is back to 0 on every call.
+    vm::Function spin;
+    spin.addInstruction(InstType::lg, 0);
+    spin.addInstruction(InstType::pi, 0);
+    spin.addInstruction(InstType::jeq, "done");
+    spin.addInstruction(InstType::lg, 0);
+    spin.addInstruction(InstType::pi, 1);
+    spin.addInstruction(InstType::sub);
+    spin.addInstruction(InstType::copy);
+    spin.addInstruction(InstType::sg, 0);
+    spin.addInstruction(InstType::sl, 0);
+    spin.addInstruction(InstType::tailcall, "spin");
+    spin.addInstruction(InstType::label, "done");
+    spin.addInstruction(InstType::ll, 0);
+    spin.addInstruction(InstType::puts);
+    spin.addInstruction(InstType::ret);
+    
+    vm::Function main;
+    main.addInstruction(InstType::pi, 1000000);
+    main.addInstruction(InstType::call, "count");
+    main.addInstruction(InstType::pi, 1000000);
+    main.addInstruction(InstType::sg, 0);
+    main.addInstruction(InstType::call, "spin");
+    main.addInstruction(InstType::pi, "done");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    output.clear();
+    vm::VM deep([&](std::string s){ output.push_back(s); });
+    deep.addFunction(std::move(main), "main");
+    deep.addFunction(std::move(count), "count");
+    deep.addFunction(std::move(spin), "spin");
+    
+    // Neither grows the native stack however the output is compiled, which
+    // aot/ checks by running it.
+    std::ostringstream tail;
+    REQUIRE(deep.compileAhead("main", "countdown", tail));
+    CHECK(tail.str().find("rt.restart(locals, base + 1, 1);\n    goto start;")
+          != std::string::npos);
+    CHECK(tail.str().find("rt.restart(locals, locals + 1, 0);\n    goto start;")
+          != std::string::npos);
+    CHECK(tail.str() == readFile("../aot/countdown.cpp"));
+    
+    CHECK(deep.run("main") == vm::ExitStatus::exit);
+    CHECK(output == std::vector<std::string>{"0.000000", "done"});
+}
+
+TEST_CASE("profile")
+{
+    auto addProgram = [](vm::VM& v)
+    {
+        addIncLoop(v, 3);
+        
+        vm::Function cold;
+        cold.addInstruction(InstType::ret);
+        v.addFunction(std::move(cold), "cold");
+    };
+    
+    // Keep the instructions as written so they are easy to count.
+    vm::Options options = eachEngine();
+    options._optimize = false;
+    options._superinstructions = false;
+    options._profile = true;
+    vm::VM v([](std::string){}, options);
+    addProgram(v);
+    CHECK(v.profile().empty());
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    
+    auto profile = v.profile();
+    if (options._engine != vm::Engine::simple)
+    {
+        // The other engines count calls and back edges but not
+        // instructions.
+        REQUIRE(profile.size() == 3);
+        CHECK(profile[0]._function == "inc");
+        CHECK(profile[0]._calls == 3);
+        CHECK(profile[0]._backEdges == 0);
+        CHECK(profile[1]._function == "main");
+        CHECK(profile[1]._calls == 1);
+        CHECK(profile[1]._backEdges == 2);
+        for (const auto& p : profile)
+        {
+            CHECK(p._instructions == 0);
+        }
+        return;
+    }
+    REQUIRE(profile.size() == 3);
+    // Two instructions before the loop, six on each of its three trips, and
+    // the exit.
+    CHECK(profile[0]._function == "main");
+    CHECK(profile[0]._calls == 1);
+    CHECK(profile[0]._instructions == 21);
+    CHECK(profile[0]._backEdges == 2);
+    CHECK(profile[1]._function == "inc");
+    CHECK(profile[1]._calls == 3);
+    CHECK(profile[1]._instructions == 12);
+    CHECK(profile[1]._backEdges == 0);
+    CHECK(profile[2]._function == "cold");
+    CHECK(profile[2]._calls == 0);
+    CHECK(profile[2]._instructions == 0);
+    
+    // Without profiling only the jit engine counts, and only what it uses.
+    options._profile = false;
+    options._engine = vm::Engine::jit;
+    vm::VM j([](std::string){}, options);
+    addProgram(j);
+    CHECK(j.run("main") == vm::ExitStatus::exit);
+    profile = j.profile();
+    REQUIRE(profile.size() == 3);
+    CHECK(profile[0]._function == "inc");
+    CHECK(profile[0]._calls == 3);
+    CHECK(profile[1]._function == "main");
+    CHECK(profile[1]._calls == 1);
+    CHECK(profile[1]._instructions == 0);
+    CHECK(profile[1]._backEdges == 2);
+    
+    options._engine = vm::Engine::threaded;
+    vm::VM t([](std::string){}, options);
+    addProgram(t);
+    CHECK(t.run("main") == vm::ExitStatus::exit);
+    for (const auto& p : t.profile())
+    {
+        CHECK(p._calls == 0);
+        CHECK(p._instructions == 0);
+        CHECK(p._backEdges == 0);
+    }
+}
+
+TEST_CASE("opcode histogram")
+{
+    vm::Function main;
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 3);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::exit);
+    
+    // Run the instructions as written.
+    vm::Options options;
+    options._engine = vm::Engine::simple;
+    options._optimize = false;
+    options._superinstructions = false;
+    options._quicken = false;
+    vm::VM v([](std::string){}, options);
+    v.addFunction(std::move(main), "main");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    
+    using Histogram = std::vector<std::pair<std::string, std::size_t>>;
+    if ( ! SEMISTACK_OPCODE_HISTOGRAM )
+    {
+        CHECK(v.opcodeHistogram().empty());
+        CHECK(v.opcodePairHistogram().empty());
+        return;
+    }
+    CHECK(v.opcodeHistogram() == Histogram{
+        {"pi", 7}, {"sl", 4}, {"add", 3}, {"copy", 3}, {"jlt", 3}, {"ll", 3},
+        {"exit", 1}});
+    // Each trip around the loop runs its six pairs and then either jumps back
+    // or exits.
+    Histogram pairs = v.opcodePairHistogram();
+    REQUIRE(pairs.size() == 10);
+    CHECK(pairs[0] == Histogram::value_type{"add copy", 3});
+    CHECK(pairs[6] == Histogram::value_type{"jlt ll", 2});
+    CHECK(pairs[7] == Histogram::value_type{"jlt exit", 1});
+}
+
+TEST_CASE("sampling")
+{
+    vm::Options options = eachEngine();
+    options._sampleInterval = 1000;
+    vm::VM v([](std::string){}, options);
+    addIncLoop(v, 1000000);
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    
+    // main is always on its call when inc is running. Where that is depends
+    // on whether main ran as register code.
+    std::size_t call = 3;
+    const auto& registerCode = v.function("main")->_registerCode;
+    for (std::size_t i = 0; i < registerCode.size(); ++i)
+    {
+        if (registerCode[i]._op == vm::RegOp::call)
+        {
+            call = i;
+        }
+    }
+    
+    // How many samples there are depends on how fast the machine is, but
+    // every one is in main or in inc called from main.
+    std::istringstream lines(v.collapsedStacks());
+    std::size_t samples = 0;
+    for (std::string line; std::getline(lines, line); )
+    {
+        INFO(line);
+        const auto space = line.rfind(' ');
+        REQUIRE(space != std::string::npos);
+        const std::string stack = line.substr(0, space);
+        CHECK(stack.rfind("main@", 0) == 0);
+        const auto inc = stack.find(";inc@");
+        if (inc != std::string::npos)
+        {
+            CHECK(stack.substr(0, inc) == "main@" + std::to_string(call));
+        }
+        samples += std::stoul(line.substr(space + 1));
+    }
+#if defined(__unix__) || defined(__APPLE__)
+    CHECK(samples > 0);
+#endif
+    
+    options._sampleInterval = 0;
+    vm::VM quiet([](std::string){}, options);
+    addIncLoop(quiet, 1000000);
+    CHECK(quiet.run("main") == vm::ExitStatus::exit);
+    CHECK(quiet.collapsedStacks().empty());
+}
+
+TEST_CASE("string interning")
+{
+    vm::StringTable table;
+    vm::Value ab("ab");
+    vm::Value built(std::string("a") + "b");
+    CHECK(ab.bits() != built.bits());
+    table.intern(ab);
+    table.intern(built);
+    CHECK(ab.bits() == built.bits());
+    CHECK(table.size() == 1);
+    
+    vm::Value ac("ac");
+    table.intern(ac);
+    CHECK(ab != ac);
+    // Strings that weren't interned are compared by what they hold.
+    CHECK(ab == vm::Value("ab"));
+    CHECK(ac != vm::Value("ab"));
+    
+    // Long strings are left alone.
+    vm::Value l(std::string(vm::StringTable::kMaxShortLength + 1, 'x'));
+    vm::Value m(std::string(vm::StringTable::kMaxShortLength + 1, 'x'));
+    table.intern(l);
+    table.intern(m);
+    CHECK(l.bits() != m.bits());
+    CHECK(l == m);
+    
+    // Another table can't share a string with this one so it makes a copy.
+    vm::StringTable other;
+    vm::Value copy = ab;
+    other.intern(copy);
+    CHECK(copy.bits() != ab.bits());
+    CHECK(copy == ab);
+    
+    // Strings that only the table holds go when it needs room.
+    for (int i = 0; i < 100; ++i)
+    {
+        vm::Value v(std::to_string(i));
+        table.intern(v);
+    }
+    CHECK(table.size() < 100);
+    vm::Value again("ab");
+    table.intern(again);
+    CHECK(again.bits() == ab.bits());
+    
+    // Concatenation in the VM gives back the interned constant.
+    vm::Function main;
+    main.addInstruction(InstType::pi, "a");
+    main.addInstruction(InstType::sg, 0);
+    main.addInstruction(InstType::lg, 0);
+    main.addInstruction(InstType::pi, "b");
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::pi, "ab");
+    main.addInstruction(InstType::jneq, "different");
+    main.addInstruction(InstType::pi, "same");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    main.addInstruction(InstType::label, "different");
+    main.addInstruction(InstType::pi, "different");
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    std::string output;
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
+    v.addFunction(std::move(main), "main");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    CHECK(output == "same");
+    CHECK(v.strings().size() >= 4);
+}
+
+TEST_CASE("string appends")
+{
+    const std::string longer(vm::String::kMaxEagerLength, 'a');
+    
+    // Nothing else holds a, so it grows in place.
+    vm::Value a(longer);
+    vm::Object* before = a.object();
+    a.append(vm::Value("b"));
+    CHECK(a.object() == before);
+    CHECK(a.asString() == longer + "b");
+    
+    // b is shared with c, which mustn't change.
+    vm::Value b(longer);
+    vm::Value c = b;
+    b.append(vm::Value("b"));
+    CHECK(b.object() != c.object());
+    CHECK(c.asString() == longer);
+    CHECK(b.asString() == longer + "b");
+    CHECK(b == vm::Value(longer + "b"));
+    
+    // Halves stay readable after the concatenation is flattened and a
+    // concatenation can be a half of another.
+    vm::Value d = c;
+    d.append(c);
+    vm::Value e = d;
+    e.append(d);
+    CHECK(e.asString() == longer + longer + longer + longer);
+    CHECK(d.asString() == longer + longer);
+    
+    // Appending to an empty string gives back the other one.
+    vm::Value empty("");
+    empty.append(c);
+    CHECK(empty.bits() == c.bits());
+    
+    // Deep chains of concatenations are flattened and freed without
+    // recursing.
+    vm::Value deep(longer);
+    vm::Value piece("xy");
+    for (int i = 0; i < 1000000; ++i)
+    {
+        vm::Value held = deep;
+        deep.append(piece);
+    }
+    CHECK(deep.asString().size() == longer.size() + 2000000);
+    vm::Value unread(longer);
+    for (int i = 0; i < 1000000; ++i)
+    {
+        vm::Value held = unread;
+        unread.append(piece);
+    }
+    unread = vm::Value();
+    
+    // A program building a string a piece at a time.
+    vm::Function main;
+    main.addInstruction(InstType::pi, "");
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::pi, 0);
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::label, "loop");
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::pi, "ab");
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::sl, 0);
+    main.addInstruction(InstType::ll, 1);
+    main.addInstruction(InstType::pi, 1);
+    main.addInstruction(InstType::add);
+    main.addInstruction(InstType::copy);
+    main.addInstruction(InstType::sl, 1);
+    main.addInstruction(InstType::pi, 10000);
+    main.addInstruction(InstType::jlt, "loop");
+    main.addInstruction(InstType::ll, 0);
+    main.addInstruction(InstType::puts);
+    main.addInstruction(InstType::exit);
+    
+    std::string output;
+    vm::VM v([&](std::string s){ output += s; }, eachEngine());
+    v.addFunction(std::move(main), "main");
+    CHECK(v.run("main") == vm::ExitStatus::exit);
+    std::string expected;
+    for (int i = 0; i < 10000; ++i)
+    {
+        expected += "ab";
+    }
+    CHECK(output == expected);
+}
@@ -0,0 +1,140 @@
+//
+//  operations.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/20/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+//  What arithmetic and comparisons do to values, away from any VM. The VM and
+//  code written by the ahead of time compiler (see aot.hpp) both call these so
+//  that a program means the same thing wherever it runs.
+
+#include "instruction.hpp"
+#include "value.hpp"
+
+#include <string>
+
+namespace vm {
+namespace ops {
+
+enum class Error: std::uint8_t
+{
+    none,
+    differentTypes,   // Arithmetic on values of two types.
+    unsupportedTypes, // Arithmetic that isn't defined for the type.
+    typeMismatch,     // Ordering values of two types.
+    functionType,     // Ordering functions.
+};
+
+// What to log for e coming out of an op instruction.
+inline std::string message(Error e, InstType op)
+{
+    switch (e)
+    {
+        case Error::differentTypes:
+            return "Different types in " + to_string(op) + " instruction";
+        case Error::unsupportedTypes:
+            return "Unsupported types in " + to_string(op) + " instruction.";
+        case Error::typeMismatch:
+            return "Type missmatch in " + to_string(op) + " instruction.";
+        case Error::functionType:
+            return "Function type in " + to_string(op) + " instruction.";
+        case Error::none:
+            break;
+    }
+    return "";
+}
+
+// add, sub, mul, or div on two numbers.
+inline float arithmetic(InstType op, float l, float r)
+{
+    switch (op)
+    {
+        case InstType::add: return l + r;
+        case InstType::sub: return l - r;
+        case InstType::mul: return l * r;
+        default: return l / r;
+    }
+}
+
+// jeq, jneq, jlt, or jgt on two numbers.
+inline bool compare(InstType op, float l, float r)
+{
+    switch (op)
+    {
+        case InstType::jeq: return l == r;
+        case InstType::jneq: return l != r;
+        case InstType::jlt: return l < r;
+        default: return l > r;
+    }
+}
+
+// add, sub, mul, and div. Replaces left with left op right.
+inline Error arithmetic(InstType op, Value& left, const Value& right)
+{
+    if ( ! left.sameType(right) )
+    {
+        return Error::differentTypes;
+    }
+
+    if (right.isNumber())
+    {
+        switch (op)
+        {
+            case InstType::add:
+            case InstType::sub:
+            case InstType::mul:
+            case InstType::div:
+                left = arithmetic(op, left.asNumber(), right.asNumber());
+                return Error::none;
+            default:
+                break;
+        }
+    }
+
+    if (op == InstType::add && right.isString())
+    {
+        left.append(right);
+        return Error::none;
+    }
+
+    return Error::unsupportedTypes;
+}
+
+// jeq, jneq, jlt, and jgt. Sets taken to whether the jump should be taken.
+inline Error compare(InstType op, const Value& left, const Value& right,
+                     bool& taken)
+{
+    switch (op)
+    {
+        case InstType::jeq:
+            taken = left == right;
+            return Error::none;
+        case InstType::jneq:
+            taken = left != right;
+            return Error::none;
+        default:
+            break;
+    }
+
+    // Relative comparasons aren't quite as clean here as function's aren't
+    // comparable.
+    if ( ! left.sameType(right) )
+    {
+        return Error::typeMismatch;
+    }
+
+    if (right.isFunction())
+    {
+        return Error::functionType;
+    }
+
+    taken = op == InstType::jlt ? left < right : left > right;
+    return Error::none;
+}
+
+}
+}
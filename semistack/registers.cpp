@@ -0,0 +1,596 @@
+//
+//  registers.cpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/16/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+//  Translation keeps a virtual stack while it walks each basic block. pi, ll,
+//  and copy don't emit anything, they just note which operand the value they
+//  push can be read from. Instructions that pop use those operands directly
+//  and write their result to the register for the stack slot it would have
+//  been pushed to. Anything still only noted when the block ends, or when a
+//  call needs its arguments on the real stack, is moved into its register
+//  then.
+
+#include "registers.hpp"
+#include "function.hpp"
+#include "vm.hpp"
+
+#include <map>
+#include <optional>
+
+using namespace vm;
+
+namespace {
+
+class Translator
+{
+public:
+    Translator(const Function& fn): _fn(fn) {}
+
+    bool run(std::vector<RegInstruction>& out);
+
+private:
+    // The register that holds the value at depth p.
+    static std::int32_t slot(std::int64_t p)
+    {
+        return static_cast<std::int32_t>(p - 1);
+    }
+    // Locals of a function with an arity are just below its registers.
+    std::int32_t local(std::int32_t i) const
+    {
+        return _fn._arity ? i - static_cast<std::int32_t>(_fn._localCount)
+                          : kLocalOperand + i;
+    }
+
+    // Where the value at depth p can be read from.
+    std::int32_t at(std::int64_t p) const
+    {
+        auto where = _noted.find(p);
+        return where == _noted.end() ? slot(p) : where->second;
+    }
+    std::int32_t pop()
+    {
+        std::int32_t operand = at(_depth);
+        _noted.erase(_depth--);
+        return operand;
+    }
+    void note(std::int32_t operand)
+    {
+        _noted[++_depth] = operand;
+    }
+    void emit(RegOp op, std::int32_t a = 0, std::int32_t b = 0,
+              std::int32_t c = 0)
+    {
+        _out->push_back({op, a, b, c});
+    }
+    // Moves noted values into their registers. Only the ones that read from
+    // operand if that is given.
+    void flush(std::optional<std::int32_t> operand = std::nullopt);
+
+    const Function& _fn;
+    std::vector<RegInstruction>* _out = nullptr;
+
+    std::int64_t _depth = 0;
+    // Values on the stack that aren't in their own register yet.
+    std::map<std::int64_t, std::int32_t> _noted;
+    // The depth of the value that the last instruction wrote to its register,
+    // if it was the last thing emitted.
+    std::optional<std::int64_t> _result;
+};
+
+void Translator::flush(std::optional<std::int32_t> operand)
+{
+    for (auto it = _noted.begin(); it != _noted.end(); )
+    {
+        if (operand && it->second != operand.value())
+        {
+            ++it;
+            continue;
+        }
+        emit(RegOp::move, slot(it->first), it->second);
+        it = _noted.erase(it);
+    }
+}
+
+bool Translator::run(std::vector<RegInstruction>& out)
+{
+    _out = &out;
+    const std::vector<Word>& code = _fn._code;
+    const std::size_t n = code.size();
+
+    // Control only meets at jump targets so that is the only place that
+    // values need to be in their registers, other than around calls.
+    std::vector<bool> isTarget(n + 1, false);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        InstType t = opcode(code[i]);
+        if (t == InstType::jump || t == InstType::jeq || t == InstType::jneq
+            || t == InstType::jlt || t == InstType::jgt)
+        {
+            isTarget[i + operand(code[i])] = true;
+        }
+    }
+
+    // Where each instruction's translation starts and the jumps that need
+    // their distances filled in once that is known.
+    std::vector<std::size_t> starts(n + 1, 0);
+    std::vector<std::pair<std::size_t, std::size_t>> jumps;
+
+    for (std::size_t pc = 0; pc < n; ++pc)
+    {
+        if (isTarget[pc])
+        {
+            flush();
+            _result.reset();
+        }
+        starts[pc] = out.size();
+
+        if ( ! _fn._depths[pc] )
+        {
+            _result.reset();
+            continue;
+        }
+        _depth = _fn._depths[pc].value();
+
+        const InstType t = opcode(code[pc]);
+        const std::int32_t op = operand(code[pc]);
+        std::optional<std::int64_t> result;
+
+        switch (t)
+        {
+            case InstType::pi:
+                note(kConstantOperand + op);
+                break;
+            case InstType::ll:
+                note(local(op));
+                break;
+            case InstType::copy:
+                note(at(_depth));
+                break;
+            case InstType::sl:
+            {
+                std::int64_t from = _depth;
+                std::int32_t value = pop();
+                flush(local(op));
+                // Have whatever computed the value write it straight to the
+                // local if nothing has been emitted since.
+                if (_result == from && value == slot(from)
+                    && starts[pc] == out.size())
+                {
+                    out.back()._a = local(op);
+                } else if (value != local(op))
+                {
+                    emit(RegOp::move, local(op), value);
+                }
+                break;
+            }
+            case InstType::sg:
+                emit(RegOp::sg, op, pop());
+                break;
+            case InstType::lg:
+                emit(RegOp::lg, slot(_depth + 1), op);
+                _noted.erase(++_depth);
+                result = _depth;
+                break;
+            case InstType::puts:
+                emit(RegOp::puts, pop());
+                break;
+            case InstType::add:
+            case InstType::sub:
+            case InstType::mul:
+            case InstType::div:
+            {
+                std::int32_t right = pop();
+                std::int32_t left = pop();
+                RegOp r = t == InstType::add ? RegOp::add
+                        : t == InstType::sub ? RegOp::sub
+                        : t == InstType::mul ? RegOp::mul : RegOp::div;
+                emit(r, slot(_depth + 1), left, right);
+                ++_depth;
+                result = _depth;
+                break;
+            }
+            case InstType::jeq:
+            case InstType::jneq:
+            case InstType::jlt:
+            case InstType::jgt:
+            {
+                std::int32_t right = pop();
+                std::int32_t left = pop();
+                flush();
+                RegOp r = t == InstType::jeq ? RegOp::jeq
+                        : t == InstType::jneq ? RegOp::jneq
+                        : t == InstType::jlt ? RegOp::jlt : RegOp::jgt;
+                jumps.emplace_back(out.size(), pc + op);
+                emit(r, left, right);
+                break;
+            }
+            case InstType::jump:
+                flush();
+                jumps.emplace_back(out.size(), pc + op);
+                emit(RegOp::jump);
+                break;
+            case InstType::call:
+            {
+                flush();
+                // A call to a function that never returns has no depth after.
+                std::optional<std::int32_t> after;
+                if (pc + 1 < n) after = _fn._depths[pc + 1];
+                emit(RegOp::call, op, static_cast<std::int32_t>(_depth),
+                     after.value_or(static_cast<std::int32_t>(_depth)));
+                break;
+            }
+            case InstType::tailcall:
+                flush();
+                emit(RegOp::tailcall, op, static_cast<std::int32_t>(_depth));
+                break;
+            case InstType::ret:
+                flush();
+                emit(RegOp::ret, static_cast<std::int32_t>(_depth));
+                break;
+            case InstType::exit:
+                emit(RegOp::exit, static_cast<std::int32_t>(_depth));
+                break;
+            default:
+                return false;
+        }
+        _result = result;
+    }
+    starts[n] = out.size();
+
+    for (auto [at, target] : jumps)
+    {
+        RegInstruction& i = out[at];
+        std::int32_t distance = static_cast<std::int32_t>(starts[target])
+                              - static_cast<std::int32_t>(at);
+        (i._op == RegOp::jump ? i._a : i._c) = distance;
+    }
+    return true;
+}
+
+std::string operandString(std::int32_t operand)
+{
+    if (operand >= kConstantOperand)
+    {
+        return "k" + std::to_string(operand - kConstantOperand);
+    }
+    if (operand >= kLocalOperand)
+    {
+        return "l" + std::to_string(operand - kLocalOperand);
+    }
+    return "r" + std::to_string(operand);
+}
+
+}
+
+std::string vm::to_string(const RegInstruction& i)
+{
+    switch (i._op)
+    {
+        case RegOp::move:
+            return "move " + operandString(i._a) + ", " + operandString(i._b);
+        case RegOp::puts:
+            return "puts " + operandString(i._a);
+        case RegOp::sg:
+            return "sg " + std::to_string(i._a) + ", " + operandString(i._b);
+        case RegOp::lg:
+            return "lg " + operandString(i._a) + ", " + std::to_string(i._b);
+        case RegOp::add:
+        case RegOp::sub:
+        case RegOp::mul:
+        case RegOp::div:
+        {
+            const char* name = i._op == RegOp::add ? "add"
+                             : i._op == RegOp::sub ? "sub"
+                             : i._op == RegOp::mul ? "mul" : "div";
+            return name + (" " + operandString(i._a)) + ", "
+                + operandString(i._b) + ", " + operandString(i._c);
+        }
+        case RegOp::jump:
+            return "jump " + std::to_string(i._a);
+        case RegOp::jeq:
+        case RegOp::jneq:
+        case RegOp::jlt:
+        case RegOp::jgt:
+        {
+            const char* name = i._op == RegOp::jeq ? "jeq"
+                             : i._op == RegOp::jneq ? "jneq"
+                             : i._op == RegOp::jlt ? "jlt" : "jgt";
+            return name + (" " + operandString(i._a)) + ", "
+                + operandString(i._b) + ", " + std::to_string(i._c);
+        }
+        case RegOp::call:
+            return "call " + std::to_string(i._a) + ", " + std::to_string(i._b)
+                + ", " + std::to_string(i._c);
+        case RegOp::tailcall:
+            return "tailcall " + std::to_string(i._a) + ", "
+                + std::to_string(i._b);
+        case RegOp::ret:
+            return "ret " + std::to_string(i._a);
+        case RegOp::exit:
+            return "exit " + std::to_string(i._a);
+    }
+    return "unknown";
+}
+
+bool registers::translateFunction(Function& fn)
+{
+    fn._registerCode.clear();
+    if (fn._depths.size() != fn._code.size())
+    {
+        return false;
+    }
+
+    Translator t(fn);
+    std::vector<RegInstruction> code;
+    if ( ! t.run(code) )
+    {
+        return false;
+    }
+    fn._registerCode = std::move(code);
+    return true;
+}
+
+ExitStatus vm::VM::runRegisters()
+{
+    for (;;)
+    {
+        CallFrame& frame = _callStack.top();
+        Function& fn = _functions[frame._fnIndex];
+        if ( ! fn._registerCode.empty() )
+        {
+            ExitStatus res = runRegisterCode();
+            if (res != ExitStatus::cont)
+            {
+                return res;
+            }
+            continue;
+        }
+        
+        const std::size_t pc = frame._pc++;
+        Word& instruction = fn._code[pc];
+        ExitStatus res = runInstruction<false>(instruction);
+        if (res != ExitStatus::cont)
+        {
+            return res;
+        }
+        // frame is gone after a ret. Otherwise only jumps move its pc
+        // anywhere but forward by one.
+        const InstType t = opcode(instruction);
+        if (_observing && t != InstType::call && t != InstType::tailcall
+            && t != InstType::ret && frame._pc <= pc)
+        {
+            backEdge(frame._fnIndex);
+        }
+    }
+}
+
+// Runs register code until control reaches stack code.
+ExitStatus vm::VM::runRegisterCode()
+{
+    CallFrame* frame;
+    const Function* fn;
+    const RegInstruction* code;
+    const RegInstruction* pc;
+    const Value* constants;
+    Value* regs;
+    Value* locals;
+
+    // Caches the frame on top of the call stack in the locals above. Returns
+    // false if it is running stack code.
+    auto enter = [&]()
+    {
+        frame = &_callStack.top();
+        fn = &_functions[frame->_fnIndex];
+        if (fn->_registerCode.empty())
+        {
+            return false;
+        }
+        code = fn->_registerCode.data();
+        pc = code + frame->_pc;
+        constants = fn->_constants.data();
+        // The frame is either just starting or coming back from a call, which
+        // left the stack as deep as the call says.
+        regs = _valueStack._sp - (frame->_pc ? pc[-1]._c : 0);
+        locals = frame->_locals;
+        return true;
+    };
+    if ( ! enter() )
+    {
+        return ExitStatus::cont;
+    }
+
+    auto value = [&](std::int32_t operand)-> const Value&
+    {
+        if (operand < kLocalOperand)
+        {
+            return regs[operand];
+        }
+        return operand >= kConstantOperand
+            ? constants[operand - kConstantOperand]
+            : locals[operand - kLocalOperand];
+    };
+
+    // Where an instruction's result goes, which is never a constant.
+    auto target = [&](std::int32_t operand)-> Value&
+    {
+        return operand < kLocalOperand ? regs[operand]
+                                       : locals[operand - kLocalOperand];
+    };
+
+    // Puts the value stack where the stack engines expect it to be. Registers
+    // above the top may still hold values that are no longer on the stack.
+    auto settle = [&](std::int32_t depth)
+    {
+        Value* top = regs + depth;
+        for (Value* p = top; p < regs + fn->_maxStack; ++p)
+        {
+            *p = Value();
+        }
+        _valueStack._sp = top;
+    };
+
+    // Leaves every register on the stack so that the values in them are
+    // still released, and the frame on the instruction that failed.
+    auto fail = [&]()
+    {
+        settle(fn->_maxStack);
+        frame->_pc = pc + 1 - code;
+        return ExitStatus::error;
+    };
+
+    auto slowArithmetic = [&](InstType op)
+    {
+        Value left = value(pc->_b);
+        if ( ! arithmetic(op, left, value(pc->_c)) )
+        {
+            return false;
+        }
+        target(pc->_a) = std::move(left);
+        return true;
+    };
+
+    // Moves pc distance, telling backEdge if it went back.
+    auto jumpBy = [&](std::int32_t distance)
+    {
+        pc += distance;
+        if (distance <= 0 && _observing)
+        {
+            frame->_pc = pc - code;
+            backEdge(frame->_fnIndex);
+        }
+    };
+
+    auto jumpIf = [&](std::optional<bool> taken)
+    {
+        if ( ! taken ) return false;
+        jumpBy(taken.value() ? pc->_c : 1);
+        return true;
+    };
+
+    for (;;)
+    {
+        switch (pc->_op)
+        {
+            case RegOp::move:
+                target(pc->_a) = value(pc->_b);
+                ++pc;
+                break;
+            case RegOp::puts:
+                _outputFn(vm::to_string(value(pc->_a)));
+                ++pc;
+                break;
+            case RegOp::sg:
+                _globals[pc->_a] = value(pc->_b);
+                ++pc;
+                break;
+            case RegOp::lg:
+                target(pc->_a) = _globals[pc->_b];
+                ++pc;
+                break;
+            case RegOp::add:
+            {
+                const Value& l = value(pc->_b);
+                const Value& r = value(pc->_c);
+                if (l.isNumber() && r.isNumber())
+                {
+                    target(pc->_a) = l.asNumber() + r.asNumber();
+                } else if ( ! slowArithmetic(InstType::add) )
+                {
+                    return fail();
+                }
+                ++pc;
+                break;
+            }
+            case RegOp::sub:
+            {
+                const Value& l = value(pc->_b);
+                const Value& r = value(pc->_c);
+                if (l.isNumber() && r.isNumber())
+                {
+                    target(pc->_a) = l.asNumber() - r.asNumber();
+                } else if ( ! slowArithmetic(InstType::sub) )
+                {
+                    return fail();
+                }
+                ++pc;
+                break;
+            }
+            case RegOp::mul:
+                if ( ! slowArithmetic(InstType::mul) ) return fail();
+                ++pc;
+                break;
+            case RegOp::div:
+                if ( ! slowArithmetic(InstType::div) ) return fail();
+                ++pc;
+                break;
+            case RegOp::jump:
+                jumpBy(pc->_a);
+                break;
+            case RegOp::jeq:
+                if ( ! jumpIf(compare(InstType::jeq, value(pc->_a),
+                                      value(pc->_b))) )
+                {
+                    return fail();
+                }
+                break;
+            case RegOp::jneq:
+                if ( ! jumpIf(compare(InstType::jneq, value(pc->_a),
+                                      value(pc->_b))) )
+                {
+                    return fail();
+                }
+                break;
+            case RegOp::jlt:
+            {
+                const Value& l = value(pc->_a);
+                const Value& r = value(pc->_b);
+                if (l.isNumber() && r.isNumber())
+                {
+                    jumpBy(l.asNumber() < r.asNumber() ? pc->_c : 1);
+                } else if ( ! jumpIf(compare(InstType::jlt, l, r)) )
+                {
+                    return fail();
+                }
+                break;
+            }
+            case RegOp::jgt:
+            {
+                const Value& l = value(pc->_a);
+                const Value& r = value(pc->_b);
+                if (l.isNumber() && r.isNumber())
+                {
+                    jumpBy(l.asNumber() > r.asNumber() ? pc->_c : 1);
+                } else if ( ! jumpIf(compare(InstType::jgt, l, r)) )
+                {
+                    return fail();
+                }
+                break;
+            }
+            case RegOp::call:
+                settle(pc->_b);
+                frame->_pc = pc + 1 - code;
+                if ( ! pushFrame(pc->_a) ) return ExitStatus::error;
+                if ( ! enter() ) return ExitStatus::cont;
+                break;
+            case RegOp::tailcall:
+                settle(pc->_b);
+                if ( ! replaceFrame(pc->_a) ) return ExitStatus::error;
+                if ( ! enter() ) return ExitStatus::cont;
+                break;
+            case RegOp::ret:
+                settle(pc->_a);
+                popFrame();
+                if (_callStack.empty()) return ExitStatus::ret;
+                if ( ! enter() ) return ExitStatus::cont;
+                break;
+            case RegOp::exit:
+                settle(pc->_a);
+                frame->_pc = pc + 1 - code;
+                return ExitStatus::exit;
+        }
+    }
+}
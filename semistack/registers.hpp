@@ -0,0 +1,86 @@
+//
+//  registers.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/16/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+//  The register tier. docs/Design.md notes that stack machines are often slower
+//  than register machines, and a lot of that is time spent moving values onto
+//  and off of the stack. Once a program has been verified we know how deep the
+//  stack is at every instruction, so each stack slot can be given a fixed name
+//  instead. Loads of locals and constants then disappear into the operands of
+//  the instructions that use them:
+//
+//      ll 0; pi 1; sub; sl 0      ->      sub r-1, r-1, k0
+//
+//  Registers are slots on the value stack relative to where it was when the
+//  function was entered. Register n is the value that is n + 1 deep and a
+//  function with an arity finds its locals just below that, at negative
+//  registers. Functions without an arity keep their locals off of the value
+//  stack so their locals get operands of their own. Functions that can't be
+//  translated keep running as stack code and the two can call each other
+//  freely.
+
+namespace vm {
+
+struct Function;
+
+enum class RegOp: std::uint8_t
+{
+    move,     // a = b
+    puts,     // Prints a.
+    sg,       // Global a = b.
+    lg,       // a = global b.
+
+    add,      // a = b + c
+    sub,      // a = b - c
+    mul,      // a = b * c
+    div,      // a = b / c
+
+    jump,     // Jumps a instructions.
+    jeq,      // Jumps c instructions if a == b.
+    jneq,     // Jumps c instructions if a != b.
+    jlt,      // Jumps c instructions if a < b.
+    jgt,      // Jumps c instructions if a > b.
+
+    // The stack engines expect the stack to be exactly as deep as the verifier
+    // says it is, so these say how deep that is.
+    call,     // Calls function a with the stack b deep. It is c deep after.
+    tailcall, // Tail calls function a with the stack b deep.
+    ret,      // Returns with the stack a deep.
+    exit,     // Stops with the stack a deep.
+};
+
+// Operands at or above this name a constant in the function's constant pool.
+// Operands from kLocalOperand up to there name a local of a function without
+// an arity. Everything below that is a register.
+constexpr std::int32_t kConstantOperand = 1 << 30;
+constexpr std::int32_t kLocalOperand = 1 << 29;
+
+struct RegInstruction
+{
+    RegOp _op;
+    std::int32_t _a = 0;
+    std::int32_t _b = 0;
+    std::int32_t _c = 0;
+};
+
+std::string to_string(const RegInstruction& i);
+
+namespace registers {
+
+// Translates a verified function's _code into _registerCode. Returns false
+// and leaves _registerCode empty for functions that can't be translated, which
+// are the ones without stack depths from the verifier. Run after
+// verify::verifyFunctions and before fusing superinstructions.
+bool translateFunction(Function& fn);
+
+}
+}
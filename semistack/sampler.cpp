@@ -0,0 +1,79 @@
+//
+//  sampler.cpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/21/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#include "sampler.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#endif
+
+volatile std::sig_atomic_t vm::sampler::pending = 0;
+
+#if defined(__unix__) || defined(__APPLE__)
+
+namespace {
+
+struct sigaction previous;
+
+void handle(int)
+{
+    vm::sampler::pending = 1;
+}
+
+itimerval timer(std::size_t interval)
+{
+    itimerval t{};
+    t.it_interval.tv_sec = interval / 1000000;
+    t.it_interval.tv_usec = interval % 1000000;
+    t.it_value = t.it_interval;
+    return t;
+}
+
+}
+
+bool vm::sampler::start(std::size_t interval)
+{
+    pending = 0;
+    
+    struct sigaction action{};
+    action.sa_handler = handle;
+    sigemptyset(&action.sa_mask);
+    // Don't make the program's own system calls fail with EINTR.
+    action.sa_flags = SA_RESTART;
+    if (sigaction(SIGPROF, &action, &previous) != 0)
+    {
+        return false;
+    }
+    
+    itimerval t = timer(interval);
+    if (setitimer(ITIMER_PROF, &t, nullptr) != 0)
+    {
+        sigaction(SIGPROF, &previous, nullptr);
+        return false;
+    }
+    return true;
+}
+
+void vm::sampler::stop()
+{
+    itimerval t = timer(0);
+    setitimer(ITIMER_PROF, &t, nullptr);
+    sigaction(SIGPROF, &previous, nullptr);
+    pending = 0;
+}
+
+#else
+
+bool vm::sampler::start(std::size_t)
+{
+    return false;
+}
+
+void vm::sampler::stop() {}
+
+#endif
@@ -0,0 +1,37 @@
+//
+//  sampler.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/21/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+#include <csignal>
+#include <cstddef>
+
+//  A timer for the sampling profiler. While it runs the process gets a SIGPROF
+//  every so often, counted in CPU time, and all the handler does is set a
+//  flag. The engines check the flag at calls, returns, and jumps back and
+//  when it is set record where the program is, which keeps everything that
+//  isn't safe to do in a signal handler out of it. There is one timer per process so
+//  only one VM can be sampled at a time.
+//
+//  Only POSIX systems have the timer. Elsewhere start fails and nothing is
+//  sampled.
+
+namespace vm {
+namespace sampler {
+
+// Set by the signal handler when a sample is due. Clear it after taking one.
+extern volatile std::sig_atomic_t pending;
+
+// Starts sending a SIGPROF every interval microseconds of CPU time. Returns
+// false if it can't.
+bool start(std::size_t interval);
+// Stops the timer and puts back whatever handled SIGPROF before.
+void stop();
+
+}
+}
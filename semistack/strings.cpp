@@ -0,0 +1,108 @@
+//
+//  strings.cpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/22/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#include "strings.hpp"
+
+#include <functional>
+#include <string_view>
+
+using namespace vm;
+
+namespace {
+
+std::uint32_t nextId()
+{
+    static std::uint32_t last = 0;
+    return ++last;
+}
+
+std::size_t hash(const std::string& s)
+{
+    return std::hash<std::string_view>()(s);
+}
+
+String* string(const Value& v)
+{
+    return static_cast<String*>(v.object());
+}
+
+}
+
+StringTable::StringTable(): _slots(16), _id(nextId()) {}
+
+void StringTable::internShort(Value& v)
+{
+    // Keep at most three quarters of the slots full.
+    if ((_count + 1) * 4 > _slots.size() * 3)
+    {
+        grow();
+    }
+    
+    const std::size_t h = hash(v.asString());
+    const std::size_t mask = _slots.size() - 1;
+    for (std::size_t i = h & mask; ; i = (i + 1) & mask)
+    {
+        Value& slot = _slots[i];
+        if ( ! slot.isString() )
+        {
+            String* s = string(v);
+            if (s->_table)
+            {
+                // Interned by some other table already. It can't be in two
+                // so this one gets its own copy.
+                v = Value(s->str());
+                s = string(v);
+            }
+            s->_table = _id;
+            s->_hash = h;
+            slot = v;
+            ++_count;
+            return;
+        }
+        if (string(slot)->_hash == h && slot.asString() == v.asString())
+        {
+            v = slot;
+            return;
+        }
+    }
+}
+
+void StringTable::grow()
+{
+    std::vector<Value> old(std::move(_slots));
+    _count = 0;
+    for (const Value& v : old)
+    {
+        if (v.isString() && string(v)->_refs > 1)
+        {
+            ++_count;
+        }
+    }
+    
+    std::size_t size = 16;
+    while (size < (_count + 1) * 2)
+    {
+        size *= 2;
+    }
+    _slots = std::vector<Value>(size);
+    
+    const std::size_t mask = size - 1;
+    for (Value& v : old)
+    {
+        if ( ! v.isString() || string(v)->_refs == 1 )
+        {
+            continue;
+        }
+        std::size_t i = string(v)->_hash & mask;
+        while (_slots[i].isString())
+        {
+            i = (i + 1) & mask;
+        }
+        _slots[i] = std::move(v);
+    }
+}
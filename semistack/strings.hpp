@@ -0,0 +1,78 @@
+//
+//  strings.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/22/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+//  Interning for short strings, after Lua (see Lua Implementation Notes.md).
+//  Each VM keeps one StringTable and puts every short string it makes through
+//  it: string constants when a program is prepared to run, and the results of
+//  concatenation. A table holds at most one String with given contents so two
+//  strings it interned are equal exactly when they are the same object, and
+//  Value's operator== only looks at the contents of strings that don't share
+//  a table. Copies of any string were already just a count bump.
+//
+//  Long strings are left alone. Hashing them costs as much as comparing them,
+//  they are rarely compared, and concatenation has to be able to append to
+//  ones that nothing else holds.
+//
+//  The table holds a reference to each string so that it can hand it out
+//  again. Strings that only the table still holds are dropped whenever it
+//  needs more room, which is the closest thing to Lua's collector sweeping
+//  its string table that reference counting has.
+
+#include "value.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace vm {
+
+class StringTable
+{
+public:
+    // Strings longer than this aren't interned. Lua uses the same limit.
+    static constexpr std::size_t kMaxShortLength = 40;
+    
+    StringTable();
+    
+    StringTable(const StringTable&) = delete;
+    StringTable& operator=(const StringTable&) = delete;
+    
+    // Makes v the interned copy of itself if it is a short string.
+    void intern(Value& v)
+    {
+        if (v.isString()
+            && static_cast<String*>(v.object())->_length <= kMaxShortLength
+            && static_cast<String*>(v.object())->_table != _id)
+        {
+            internShort(v);
+        }
+    }
+    
+    // How many strings the table holds, including ones nothing else does
+    // any more.
+    std::size_t size() const { return _count; }
+    
+private:
+    void internShort(Value& v);
+    // Drops the strings that only the table holds and resizes it so that it
+    // is at most half full after one more goes in.
+    void grow();
+    
+    // Open addressing with linear probing. Empty slots hold the number 0.
+    // There is no deleting other than in grow, which rebuilds the table.
+    std::vector<Value> _slots;
+    std::size_t _count = 0;
+    // What interned strings' _table is set to. Unique to each table ever
+    // made so a string that outlives its table is never mistaken for one
+    // interned by another.
+    std::uint32_t _id;
+};
+
+}
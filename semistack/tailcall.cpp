@@ -0,0 +1,511 @@
+//
+//  tailcall.cpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/2/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+//  The tail call engine. Rather than one big loop, every instruction gets its
+//  own small handler function that finishes by tail calling the handler for
+//  the next instruction. The interpreter state (program counter, top of the
+//  value stack, call frame, and constants) is passed as arguments so it stays
+//  in registers across the whole run, and each handler is small enough for
+//  the compiler to allocate registers for it well. The approach is described in:
+//  https://blog.reverberate.org/2021/04/21/musttail-efficient-interpreters.html
+//
+//  This only works if the compiler promises to turn those calls into jumps,
+//  otherwise every instruction we run costs a native stack frame. Clang
+//  promises with [[clang::musttail]] and newer GCCs with [[gnu::musttail]].
+//  Without either we fall back to returning to a trampoline after each
+//  instruction, which is correct but slow.
+
+#include "vm.hpp"
+#include "logger.hpp"
+
+#include <array>
+
+#if defined(__has_cpp_attribute)
+#if __has_cpp_attribute(clang::musttail)
+#define SEMISTACK_MUSTTAIL [[clang::musttail]]
+#elif __has_cpp_attribute(gnu::musttail)
+#define SEMISTACK_MUSTTAIL [[gnu::musttail]]
+#endif
+#endif
+
+using namespace vm;
+
+namespace vm {
+
+struct TailCallEngine
+{
+    using Handler = ExitStatus (*)(VM& vm, Word* pc, Value* sp,
+                                   CallFrame* frame, const Value* constants);
+    
+    static const std::array<Handler, kInstTypeCount> handlers;
+    
+    // Calls the handler for the instruction at pc.
+    static ExitStatus dispatch(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                               const Value* constants)
+    {
+        return handlers[static_cast<std::size_t>(opcode(*pc))](vm, pc, sp,
+                                                               frame,
+                                                               constants);
+    }
+    
+    // The top of the value stack is kept in sp while handlers run rather than
+    // in the VM. These do what ValueStack's push and pop do to it.
+    static void push(Value*& sp, const Value& v) { *sp++ = v; }
+    static void pop(Value*& sp) { *--sp = Value(); }
+    
+    // Hands the top of the stack back to the VM before anything that uses
+    // its value stack, which is calls, returns, and leaving the engine.
+    static void sync(VM& vm, Value* sp) { vm._valueStack._sp = sp; }
+    
+    // Stores the program counter and the top of the stack back into the VM
+    // before leaving the engine.
+    static void leave(VM& vm, Word* pc, Value* sp, CallFrame* frame)
+    {
+        frame->_pc = pc - vm._functions[frame->_fnIndex]._code.data();
+        sync(vm, sp);
+    }
+    
+    // Moves pc distance instructions, telling the VM if it went back.
+    static void branch(VM& vm, Word*& pc, Value* sp, CallFrame* frame,
+                       std::int32_t distance)
+    {
+        pc += distance;
+        if (distance <= 0 && vm._observing)
+        {
+            leave(vm, pc, sp, frame);
+            vm.backEdge(frame->_fnIndex);
+        }
+    }
+    
+#define SEMISTACK_HANDLER(name)                                                \
+    static ExitStatus name(VM& vm, Word* pc, Value* sp, CallFrame* frame,      \
+                           const Value* constants)
+    
+    SEMISTACK_HANDLER(pi);
+    SEMISTACK_HANDLER(sl);
+    SEMISTACK_HANDLER(ll);
+    SEMISTACK_HANDLER(sg);
+    SEMISTACK_HANDLER(lg);
+    SEMISTACK_HANDLER(puts);
+    SEMISTACK_HANDLER(copy);
+    SEMISTACK_HANDLER(exit);
+    SEMISTACK_HANDLER(ret);
+    template <InstType op> SEMISTACK_HANDLER(arithmetic);
+    SEMISTACK_HANDLER(jump);
+    SEMISTACK_HANDLER(call);
+    SEMISTACK_HANDLER(tailcall);
+    template <InstType op> SEMISTACK_HANDLER(compare);
+    template <InstType op> SEMISTACK_HANDLER(arithmeticImm);
+    SEMISTACK_HANDLER(llAdd);
+    template <InstType op, bool keep> SEMISTACK_HANDLER(compareImm);
+    template <InstType quick> SEMISTACK_HANDLER(arithmeticQuick);
+    template <InstType quick> SEMISTACK_HANDLER(compareQuick);
+    template <InstType quick> SEMISTACK_HANDLER(arithmeticImmQuick);
+    SEMISTACK_HANDLER(llAddQuick);
+    template <InstType quick, bool keep> SEMISTACK_HANDLER(compareImmQuick);
+    SEMISTACK_HANDLER(label);
+    
+#undef SEMISTACK_HANDLER
+};
+
+}
+
+#ifdef SEMISTACK_MUSTTAIL
+#define NEXT()                                                                 \
+    SEMISTACK_MUSTTAIL return TailCallEngine::dispatch(vm, pc, sp, frame,      \
+                                                       constants)
+#else
+// Hand the state back to the trampoline in VM::runTailCall.
+#define NEXT()                                                                 \
+    do {                                                                       \
+        vm._resume = {pc, sp, frame, constants};                               \
+        return ExitStatus::cont;                                               \
+    } while (0)
+#endif
+
+// Handlers must not have anything with a destructor alive at NEXT() or the
+// compiler can't make it a tail call. Hence all the extra scopes below.
+
+ExitStatus TailCallEngine::pi(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                              const Value* constants)
+{
+    push(sp, constants[operand(*pc++)]);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::sl(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                              const Value* constants)
+{
+    frame->_locals[operand(*pc++)] = std::move(sp[-1]);
+    pop(sp);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::ll(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                              const Value* constants)
+{
+    push(sp, frame->_locals[operand(*pc++)]);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::sg(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                              const Value* constants)
+{
+    vm._globals[operand(*pc++)] = std::move(sp[-1]);
+    pop(sp);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::lg(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                              const Value* constants)
+{
+    push(sp, vm._globals[operand(*pc++)]);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::puts(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                                const Value* constants)
+{
+    ++pc;
+    vm._outputFn(vm::to_string(sp[-1]));
+    pop(sp);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::copy(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                                const Value* constants)
+{
+    ++pc;
+    push(sp, sp[-1]);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::exit(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                                const Value*)
+{
+    leave(vm, pc + 1, sp, frame);
+    return ExitStatus::exit;
+}
+
+ExitStatus TailCallEngine::ret(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                               const Value* constants)
+{
+    sync(vm, sp);
+    vm.popFrame();
+    if (vm._callStack.empty())
+    {
+        return ExitStatus::ret;
+    }
+    frame = &vm._callStack.top();
+    Function& fn = vm._functions[frame->_fnIndex];
+    pc = fn._code.data() + frame->_pc;
+    sp = vm._valueStack._sp;
+    constants = fn._constants.data();
+    NEXT();
+}
+
+template <InstType op>
+ExitStatus TailCallEngine::arithmetic(VM& vm, Word* pc, Value* sp,
+                                      CallFrame* frame, const Value* constants)
+{
+    // mul and div have nothing to be quickened into.
+    Word* site = op == InstType::add || op == InstType::sub ? pc : nullptr;
+    if ( ! vm.arithmetic(op, sp[-2], sp[-1], site) )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    pop(sp);
+    ++pc;
+    NEXT();
+}
+
+ExitStatus TailCallEngine::jump(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                                const Value* constants)
+{
+    branch(vm, pc, sp, frame, operand(*pc));
+    NEXT();
+}
+
+ExitStatus TailCallEngine::call(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                                const Value* constants)
+{
+    FnIndex callee = operand(*pc);
+    leave(vm, pc + 1, sp, frame);
+    if ( ! vm.pushFrame(callee) )
+    {
+        return ExitStatus::error;
+    }
+    frame = &vm._callStack.top();
+    Function& fn = vm._functions[callee];
+    pc = fn._code.data();
+    sp = vm._valueStack._sp;
+    constants = fn._constants.data();
+    NEXT();
+}
+
+// The frame stays the same, only what it runs changes.
+ExitStatus TailCallEngine::tailcall(VM& vm, Word* pc, Value* sp,
+                                    CallFrame* frame, const Value* constants)
+{
+    FnIndex callee = operand(*pc);
+    sync(vm, sp);
+    if ( ! vm.replaceFrame(callee) )
+    {
+        return ExitStatus::error;
+    }
+    Function& fn = vm._functions[callee];
+    pc = fn._code.data();
+    sp = vm._valueStack._sp;
+    constants = fn._constants.data();
+    NEXT();
+}
+
+template <InstType op>
+ExitStatus TailCallEngine::compare(VM& vm, Word* pc, Value* sp,
+                                   CallFrame* frame, const Value* constants)
+{
+    Word* site = op == InstType::jneq ? nullptr : pc;
+    auto taken = vm.compare(op, sp[-2], sp[-1], site);
+    pop(sp);
+    pop(sp);
+    if ( ! taken )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    branch(vm, pc, sp, frame, taken.value() ? operand(*pc) : 1);
+    NEXT();
+}
+
+// add_imm and sub_imm.
+template <InstType op>
+ExitStatus TailCallEngine::arithmeticImm(VM& vm, Word* pc, Value* sp,
+                                         CallFrame* frame,
+                                         const Value* constants)
+{
+    if ( ! vm.arithmetic(op, sp[-1], constants[operand(*pc)], pc) )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    ++pc;
+    NEXT();
+}
+
+ExitStatus TailCallEngine::llAdd(VM& vm, Word* pc, Value* sp, CallFrame* frame,
+                                 const Value* constants)
+{
+    if ( ! vm.arithmetic(InstType::add, sp[-1], frame->_locals[operand(*pc)],
+                         pc) )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    ++pc;
+    NEXT();
+}
+
+// jlt_imm, jgt_imm, and their copy_ versions which keep the compared value on
+// the stack.
+template <InstType op, bool keep>
+ExitStatus TailCallEngine::compareImm(VM& vm, Word* pc, Value* sp,
+                                      CallFrame* frame, const Value* constants)
+{
+    auto taken = vm.compare(op, sp[-1], constants[highOperand(*pc)], pc);
+    if ( ! keep )
+    {
+        pop(sp);
+    }
+    if ( ! taken )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    branch(vm, pc, sp, frame, taken.value() ? lowOperand(*pc) : 1);
+    NEXT();
+}
+
+// add_num, add_str, and sub_num.
+template <InstType quick>
+ExitStatus TailCallEngine::arithmeticQuick(VM& vm, Word* pc, Value* sp,
+                                           CallFrame* frame,
+                                           const Value* constants)
+{
+    if ( ! vm.arithmeticQuick(quick, sp[-2], sp[-1], *pc) )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    pop(sp);
+    ++pc;
+    NEXT();
+}
+
+// jeq_num, jeq_str, jlt_num, and jgt_num.
+template <InstType quick>
+ExitStatus TailCallEngine::compareQuick(VM& vm, Word* pc, Value* sp,
+                                        CallFrame* frame,
+                                        const Value* constants)
+{
+    auto taken = vm.compareQuick(quick, sp[-2], sp[-1], *pc);
+    pop(sp);
+    pop(sp);
+    if ( ! taken )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    branch(vm, pc, sp, frame, taken.value() ? operand(*pc) : 1);
+    NEXT();
+}
+
+// add_imm_num and sub_imm_num.
+template <InstType quick>
+ExitStatus TailCallEngine::arithmeticImmQuick(VM& vm, Word* pc, Value* sp,
+                                              CallFrame* frame,
+                                              const Value* constants)
+{
+    if ( ! vm.arithmeticQuick(quick, sp[-1], constants[operand(*pc)], *pc) )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    ++pc;
+    NEXT();
+}
+
+ExitStatus TailCallEngine::llAddQuick(VM& vm, Word* pc, Value* sp,
+                                      CallFrame* frame, const Value* constants)
+{
+    if ( ! vm.arithmeticQuick(InstType::ll_add_num, sp[-1],
+                              frame->_locals[operand(*pc)], *pc) )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    ++pc;
+    NEXT();
+}
+
+// The quickened versions of compareImm.
+template <InstType quick, bool keep>
+ExitStatus TailCallEngine::compareImmQuick(VM& vm, Word* pc, Value* sp,
+                                           CallFrame* frame,
+                                           const Value* constants)
+{
+    auto taken = vm.compareQuick(quick, sp[-1], constants[highOperand(*pc)],
+                                 *pc);
+    if ( ! keep )
+    {
+        pop(sp);
+    }
+    if ( ! taken )
+    {
+        leave(vm, pc + 1, sp, frame);
+        return ExitStatus::error;
+    }
+    branch(vm, pc, sp, frame, taken.value() ? lowOperand(*pc) : 1);
+    NEXT();
+}
+
+ExitStatus TailCallEngine::label(VM&, Word*, Value*, CallFrame*, const Value*)
+{
+    logger()->maintain(false, "Label instructions should not be executed.");
+    return ExitStatus::error;
+}
+
+#undef NEXT
+
+namespace {
+
+// Builds the handler table. Filled in by InstType so the order here doesn't
+// matter.
+constexpr std::array<TailCallEngine::Handler, kInstTypeCount> makeHandlers()
+{
+    std::array<TailCallEngine::Handler, kInstTypeCount> h{};
+    auto set = [&h](InstType t, TailCallEngine::Handler fn)
+    {
+        h[static_cast<std::size_t>(t)] = fn;
+    };
+    set(InstType::pi, &TailCallEngine::pi);
+    set(InstType::sl, &TailCallEngine::sl);
+    set(InstType::ll, &TailCallEngine::ll);
+    set(InstType::sg, &TailCallEngine::sg);
+    set(InstType::lg, &TailCallEngine::lg);
+    set(InstType::puts, &TailCallEngine::puts);
+    set(InstType::copy, &TailCallEngine::copy);
+    set(InstType::exit, &TailCallEngine::exit);
+    set(InstType::ret, &TailCallEngine::ret);
+    set(InstType::add, &TailCallEngine::arithmetic<InstType::add>);
+    set(InstType::sub, &TailCallEngine::arithmetic<InstType::sub>);
+    set(InstType::mul, &TailCallEngine::arithmetic<InstType::mul>);
+    set(InstType::div, &TailCallEngine::arithmetic<InstType::div>);
+    set(InstType::jump, &TailCallEngine::jump);
+    set(InstType::call, &TailCallEngine::call);
+    set(InstType::tailcall, &TailCallEngine::tailcall);
+    set(InstType::jeq, &TailCallEngine::compare<InstType::jeq>);
+    set(InstType::jneq, &TailCallEngine::compare<InstType::jneq>);
+    set(InstType::jlt, &TailCallEngine::compare<InstType::jlt>);
+    set(InstType::jgt, &TailCallEngine::compare<InstType::jgt>);
+    set(InstType::add_imm, &TailCallEngine::arithmeticImm<InstType::add>);
+    set(InstType::sub_imm, &TailCallEngine::arithmeticImm<InstType::sub>);
+    set(InstType::ll_add, &TailCallEngine::llAdd);
+    set(InstType::jlt_imm, &TailCallEngine::compareImm<InstType::jlt, false>);
+    set(InstType::jgt_imm, &TailCallEngine::compareImm<InstType::jgt, false>);
+    set(InstType::copy_jlt_imm, &TailCallEngine::compareImm<InstType::jlt, true>);
+    set(InstType::copy_jgt_imm, &TailCallEngine::compareImm<InstType::jgt, true>);
+    set(InstType::add_num, &TailCallEngine::arithmeticQuick<InstType::add_num>);
+    set(InstType::add_str, &TailCallEngine::arithmeticQuick<InstType::add_str>);
+    set(InstType::sub_num, &TailCallEngine::arithmeticQuick<InstType::sub_num>);
+    set(InstType::jeq_num, &TailCallEngine::compareQuick<InstType::jeq_num>);
+    set(InstType::jeq_str, &TailCallEngine::compareQuick<InstType::jeq_str>);
+    set(InstType::jlt_num, &TailCallEngine::compareQuick<InstType::jlt_num>);
+    set(InstType::jgt_num, &TailCallEngine::compareQuick<InstType::jgt_num>);
+    set(InstType::add_imm_num,
+        &TailCallEngine::arithmeticImmQuick<InstType::add_imm_num>);
+    set(InstType::sub_imm_num,
+        &TailCallEngine::arithmeticImmQuick<InstType::sub_imm_num>);
+    set(InstType::ll_add_num, &TailCallEngine::llAddQuick);
+    set(InstType::jlt_imm_num,
+        &TailCallEngine::compareImmQuick<InstType::jlt_imm_num, false>);
+    set(InstType::jgt_imm_num,
+        &TailCallEngine::compareImmQuick<InstType::jgt_imm_num, false>);
+    set(InstType::copy_jlt_imm_num,
+        &TailCallEngine::compareImmQuick<InstType::copy_jlt_imm_num, true>);
+    set(InstType::copy_jgt_imm_num,
+        &TailCallEngine::compareImmQuick<InstType::copy_jgt_imm_num, true>);
+    set(InstType::label, &TailCallEngine::label);
+    return h;
+}
+
+}
+
+const std::array<TailCallEngine::Handler, kInstTypeCount>
+TailCallEngine::handlers = makeHandlers();
+
+ExitStatus vm::VM::runTailCall()
+{
+    CallFrame* frame = &_callStack.top();
+    Function& fn = _functions[frame->_fnIndex];
+    Word* pc = fn._code.data() + frame->_pc;
+    
+#ifdef SEMISTACK_MUSTTAIL
+    return TailCallEngine::dispatch(*this, pc, _valueStack._sp, frame,
+                                    fn._constants.data());
+#else
+    _resume = {pc, _valueStack._sp, frame, fn._constants.data()};
+    ExitStatus res = ExitStatus::cont;
+    while (res == ExitStatus::cont)
+    {
+        res = TailCallEngine::dispatch(*this, _resume._pc, _resume._sp,
+                                       _resume._frame, _resume._constants);
+    }
+    return res;
+#endif
+}
@@ -6,6 +6,7 @@
 //  Copyright © 2020 Zeke Medley. All rights reserved.
 //
 #include <algorithm>
+#include <optional>
 
 #include "transform.hpp"
 #include "function.hpp"
@@ -15,6 +16,518 @@
 
 using namespace vm;
 
+namespace {
+
+// Finds or adds constants in a function's constant pool. Equal constants share
+// a single slot, and for strings a single heap object, so pushing one is only
+// ever a reference count bump.
+class ConstantPool
+{
+public:
+    ConstantPool(std::vector<Value>& constants): _constants(constants)
+    {
+        for (std::size_t i = 0; i < _constants.size(); ++i)
+        {
+            lookup(_constants[i], i);
+        }
+    }
+    
+    std::size_t intern(const Value& v)
+    {
+        std::size_t index = lookup(v, _constants.size());
+        if (index == _constants.size())
+        {
+            _constants.push_back(v);
+        }
+        return index;
+    }
+    
+private:
+    // Returns where v is in the pool, first recording it at index if it
+    // isn't. Strings are keyed by their contents and everything else by its
+    // bits so that 0 and -0 don't get merged. They're kept apart so that no
+    // string can be mistaken for a number whose bits happen to match its key.
+    std::size_t lookup(const Value& v, std::size_t index)
+    {
+        if (v.isString())
+        {
+            return _strings.emplace(v.asString(), index).first->second;
+        }
+        return _others.emplace(v.bits(), index).first->second;
+    }
+    
+    std::vector<Value>& _constants;
+    std::map<std::string, std::size_t> _strings;
+    std::map<std::uint64_t, std::size_t> _others;
+};
+
+// A sequence of lowered instructions and the superinstruction to replace it
+// with. To add a new one, add an InstType for it, give it a handler in each
+// engine, and add a row to kFusions.
+struct Fusion
+{
+    std::vector<InstType> _pattern;
+    InstType _fused;
+    // Index into the pattern of the instruction whose operand the fused
+    // instruction keeps, or -1.
+    int _operand;
+    // Index into the pattern of a jump whose target the fused instruction
+    // takes over, or -1. If both are set the operand goes in the high half of
+    // the fused instruction's operand and the jump distance in the low half.
+    int _jump;
+};
+
+// Tried in order at each instruction, so longer patterns need to come before
+// any shorter ones they start with.
+const std::vector<Fusion> kFusions = {
+    {{InstType::copy, InstType::pi, InstType::jlt}, InstType::copy_jlt_imm, 1, 2},
+    {{InstType::copy, InstType::pi, InstType::jgt}, InstType::copy_jgt_imm, 1, 2},
+    {{InstType::pi, InstType::jlt}, InstType::jlt_imm, 0, 1},
+    {{InstType::pi, InstType::jgt}, InstType::jgt_imm, 0, 1},
+    {{InstType::pi, InstType::add}, InstType::add_imm, 0, -1},
+    {{InstType::pi, InstType::sub}, InstType::sub_imm, 0, -1},
+    {{InstType::ll, InstType::add}, InstType::ll_add, 0, -1},
+};
+
+bool isJump(InstType t)
+{
+    return t == InstType::jump || t == InstType::jeq || t == InstType::jneq
+        || t == InstType::jlt || t == InstType::jgt;
+}
+
+bool isSplitJump(InstType t)
+{
+    return t == InstType::jlt_imm || t == InstType::jgt_imm
+        || t == InstType::copy_jlt_imm || t == InstType::copy_jgt_imm;
+}
+
+// Where the jump at i in an assembled function goes, as an index into the
+// function, or nothing if i isn't a jump or its target hasn't been resolved.
+std::optional<std::size_t> jumpTarget(const std::vector<Instruction>& code,
+                                      std::size_t i)
+{
+    if ( ! isJump(code[i].first) || ! code[i].second.has_value() )
+    {
+        return std::nullopt;
+    }
+    auto fq = util::get<float>(code[i].second.value());
+    if ( ! fq )
+    {
+        return std::nullopt;
+    }
+    std::int64_t t = static_cast<std::int64_t>(i)
+                   + static_cast<std::int64_t>(fq.value());
+    if (t < 0 || t > static_cast<std::int64_t>(code.size()))
+    {
+        return std::nullopt;
+    }
+    return static_cast<std::size_t>(t);
+}
+
+void setJumpTarget(std::vector<Instruction>& code, std::size_t i,
+                   std::size_t target)
+{
+    code[i].second = Value(static_cast<std::int64_t>(target)
+                           - static_cast<std::int64_t>(i));
+}
+
+std::vector<bool> findJumpTargets(const std::vector<Instruction>& code)
+{
+    std::vector<bool> isTarget(code.size() + 1, false);
+    for (std::size_t i = 0; i < code.size(); ++i)
+    {
+        if (auto t = jumpTarget(code, i))
+        {
+            isTarget[*t] = true;
+        }
+    }
+    return isTarget;
+}
+
+// Removes the instructions marked dead and fixes up the jumps around them. A
+// jump to a removed instruction lands on the next one that is kept, so passes
+// may only remove code that can't be jumped into or that does nothing.
+void removeInstructions(std::vector<Instruction>& code,
+                        const std::vector<bool>& dead)
+{
+    const std::size_t n = code.size();
+    
+    // For removed instructions this is the index of the next kept one.
+    std::vector<std::size_t> newIndex(n + 1);
+    std::size_t kept = 0;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        newIndex[i] = kept;
+        kept += dead[i] ? 0 : 1;
+    }
+    newIndex[n] = kept;
+    
+    std::vector<Instruction> res;
+    res.reserve(kept);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if (dead[i]) continue;
+        
+        if (auto t = jumpTarget(code, i))
+        {
+            code[i].second = Value(static_cast<std::int64_t>(newIndex[*t])
+                                   - static_cast<std::int64_t>(res.size()));
+        }
+        res.push_back(std::move(code[i]));
+    }
+    code = std::move(res);
+}
+
+// The peephole passes. Each one returns how many rewrites it made.
+
+// Jumps whose target is an unconditional jump go straight to where that one
+// goes instead.
+std::size_t threadJumps(std::vector<Instruction>& code)
+{
+    std::size_t changes = 0;
+    // seen[j] is i + 1 if the chain followed from instruction i went through
+    // j, so one array does for every chain without clearing it in between.
+    std::vector<std::size_t> seen(code.size(), 0);
+    for (std::size_t i = 0; i < code.size(); ++i)
+    {
+        auto first = jumpTarget(code, i);
+        if ( ! first ) continue;
+        
+        const std::size_t epoch = i + 1;
+        std::size_t to = first.value();
+        seen[i] = epoch;
+        while (to < code.size() && code[to].first == InstType::jump
+               && seen[to] != epoch)
+        {
+            auto next = jumpTarget(code, to);
+            if ( ! next ) break;
+            seen[to] = epoch;
+            to = next.value();
+        }
+        
+        // A chain that loops back on itself never goes anywhere, leave it be.
+        if (to < code.size() && seen[to] == epoch) continue;
+        
+        if (to != first.value())
+        {
+            setJumpTarget(code, i, to);
+            ++changes;
+        }
+    }
+    return changes;
+}
+
+std::size_t removeJumpsToNext(std::vector<Instruction>& code)
+{
+    std::vector<bool> dead(code.size(), false);
+    std::size_t changes = 0;
+    for (std::size_t i = 0; i < code.size(); ++i)
+    {
+        if (code[i].first == InstType::jump && jumpTarget(code, i) == i + 1)
+        {
+            dead[i] = true;
+            ++changes;
+        }
+    }
+    removeInstructions(code, dead);
+    return changes;
+}
+
+// Does the instruction never fall through to the next one?
+bool endsBlock(InstType t)
+{
+    return t == InstType::jump || t == InstType::exit || t == InstType::ret
+        || t == InstType::tailcall;
+}
+
+// Removes everything that can't be reached from the start of the function.
+// This catches code after exit, ret, tailcall, and jump that nothing jumps to.
+std::size_t removeUnreachable(std::vector<Instruction>& code)
+{
+    std::vector<bool> dead(code.size(), true);
+    std::vector<std::size_t> work;
+    if (code.size()) work.push_back(0);
+    
+    while (work.size())
+    {
+        std::size_t i = work.back();
+        work.pop_back();
+        if (i >= code.size() || ! dead[i]) continue;
+        dead[i] = false;
+        
+        if (auto t = jumpTarget(code, i))
+        {
+            work.push_back(t.value());
+        }
+        if ( ! endsBlock(code[i].first) )
+        {
+            work.push_back(i + 1);
+        }
+    }
+    
+    std::size_t changes = std::count(dead.begin(), dead.end(), true);
+    removeInstructions(code, dead);
+    return changes;
+}
+
+// Turns a call that is immediately returned from into a tailcall:
+//
+//     call f; ret     -> tailcall f; ret
+//
+// The ret is left for anything that jumps to it. If nothing does it is removed
+// as unreachable.
+std::size_t makeTailCalls(std::vector<Instruction>& code)
+{
+    std::size_t changes = 0;
+    for (std::size_t i = 0; i + 1 < code.size(); ++i)
+    {
+        if (code[i].first == InstType::call
+            && code[i + 1].first == InstType::ret)
+        {
+            code[i].first = InstType::tailcall;
+            ++changes;
+        }
+    }
+    return changes;
+}
+
+// Removes stores and loads that only move a value through a local and back:
+//
+//     ll i; sl i      -> (nothing)
+//     lg i; sg i      -> (nothing)
+//     copy; sl i      -> (nothing) if local i is never loaded
+//     pi k; sl i      -> (nothing) if local i is never loaded
+//     sl i; ll i      -> (nothing) if that is the only load of local i
+std::size_t removeRoundTrips(std::vector<Instruction>& code)
+{
+    const std::size_t n = code.size();
+    const std::vector<bool> isTarget = findJumpTargets(code);
+    
+    auto indexOf = [&](std::size_t i)-> std::optional<float>
+    {
+        if ( ! code[i].second.has_value() ) return std::nullopt;
+        return util::get<float>(code[i].second.value());
+    };
+    
+    std::map<float, std::size_t> loads;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if (code[i].first != InstType::ll) continue;
+        if (auto index = indexOf(i))
+        {
+            ++loads[index.value()];
+        }
+    }
+    
+    std::vector<bool> dead(n, false);
+    std::size_t changes = 0;
+    for (std::size_t i = 0; i + 1 < n; ++i)
+    {
+        if (isTarget[i + 1]) continue;
+        
+        InstType first = code[i].first;
+        InstType second = code[i + 1].first;
+        bool remove = false;
+        
+        if ((first == InstType::ll && second == InstType::sl)
+            || (first == InstType::lg && second == InstType::sg)
+            || (first == InstType::sl && second == InstType::ll))
+        {
+            auto a = indexOf(i);
+            auto b = indexOf(i + 1);
+            remove = a && b && a.value() == b.value()
+                && (first != InstType::sl || loads[a.value()] == 1);
+        } else if ((first == InstType::copy || first == InstType::pi)
+                   && second == InstType::sl)
+        {
+            auto index = indexOf(i + 1);
+            remove = index && loads[index.value()] == 0;
+        }
+        
+        if (remove)
+        {
+            dead[i] = dead[i + 1] = true;
+            ++changes;
+            ++i;
+        }
+    }
+    removeInstructions(code, dead);
+    return changes;
+}
+
+// The result of left op right for add, sub, mul and div, or nothing if the
+// VM would report an error for it. This has to agree with VM::arithmetic.
+std::optional<Value> foldArithmetic(InstType op, const Value& left,
+                                    const Value& right)
+{
+    if ( ! left.sameType(right) ) return std::nullopt;
+    
+    if (right.isNumber())
+    {
+        float l = left.asNumber();
+        float r = right.asNumber();
+        switch (op)
+        {
+            case InstType::add: return Value(l + r);
+            case InstType::sub: return Value(l - r);
+            case InstType::mul: return Value(l * r);
+            case InstType::div: return Value(l / r);
+            default: break;
+        }
+    }
+    
+    if (op == InstType::add && right.isString())
+    {
+        return Value(left.asString() + right.asString());
+    }
+    return std::nullopt;
+}
+
+// Whether a conditional jump on left and right is taken, or nothing if the VM
+// would report an error for it. This has to agree with VM::compare.
+std::optional<bool> foldCompare(InstType op, const Value& left,
+                                const Value& right)
+{
+    switch (op)
+    {
+        case InstType::jeq: return left == right;
+        case InstType::jneq: return left != right;
+        default: break;
+    }
+    if ( ! left.sameType(right) || right.isFunction() ) return std::nullopt;
+    return op == InstType::jlt ? left < right : left > right;
+}
+
+bool isArithmetic(InstType t)
+{
+    return t == InstType::add || t == InstType::sub || t == InstType::mul
+        || t == InstType::div;
+}
+
+// Evaluates instructions whose operands are known before the program runs:
+//
+//     pi a; pi b; add     -> pi a+b (and sub, mul, div, string concatenation)
+//     pi a; pi b; jeq l   -> jump l, or nothing if the jump isn't taken
+//     pi a; sl i; ... ll i -> pi a; sl i; ... pi a
+//
+// Constants are only followed through locals within a basic block. Anything
+// that would be a type error is left for the VM to report when it runs.
+std::size_t foldConstants(std::vector<Instruction>& code)
+{
+    const std::size_t n = code.size();
+    const std::vector<bool> isTarget = findJumpTargets(code);
+    
+    auto constantAt = [&](std::size_t i)-> const Value*
+    {
+        if (code[i].first != InstType::pi || ! code[i].second.has_value())
+        {
+            return nullptr;
+        }
+        return &code[i].second.value();
+    };
+    
+    std::vector<bool> dead(n, false);
+    std::size_t changes = 0;
+    
+    // Locals holding a known constant in the current basic block.
+    std::map<float, Value> locals;
+    
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if (isTarget[i])
+        {
+            locals.clear();
+        }
+        
+        const InstType t = code[i].first;
+        
+        // Both operands have to be pushed right before this instruction, in
+        // the same block, by pi instructions that haven't been folded already.
+        const Value* left = nullptr;
+        const Value* right = nullptr;
+        if (i >= 2 && ! isTarget[i - 1] && ! isTarget[i]
+            && ! dead[i - 2] && ! dead[i - 1])
+        {
+            left = constantAt(i - 2);
+            right = constantAt(i - 1);
+        }
+        
+        if (isArithmetic(t) && left && right)
+        {
+            if (auto res = foldArithmetic(t, *left, *right))
+            {
+                code[i] = {InstType::pi, std::move(res)};
+                dead[i - 2] = dead[i - 1] = true;
+                ++changes;
+            }
+        } else if (isJump(t) && t != InstType::jump && left && right)
+        {
+            if (auto taken = foldCompare(t, *left, *right))
+            {
+                if (taken.value())
+                {
+                    code[i].first = InstType::jump;
+                } else
+                {
+                    dead[i] = true;
+                }
+                dead[i - 2] = dead[i - 1] = true;
+                ++changes;
+            }
+        } else if (t == InstType::sl && code[i].second.has_value())
+        {
+            auto index = util::get<float>(code[i].second.value());
+            const Value* stored = i >= 1 && ! isTarget[i] && ! dead[i - 1]
+                                ? constantAt(i - 1) : nullptr;
+            if (index && stored)
+            {
+                locals.insert_or_assign(index.value(), *stored);
+            } else if (index)
+            {
+                locals.erase(index.value());
+            } else
+            {
+                locals.clear();
+            }
+        } else if (t == InstType::ll && code[i].second.has_value())
+        {
+            auto index = util::get<float>(code[i].second.value());
+            auto where = index ? locals.find(index.value()) : locals.end();
+            if (where != locals.end())
+            {
+                code[i] = {InstType::pi, where->second};
+                ++changes;
+            }
+        }
+        
+        if (endsBlock(t))
+        {
+            locals.clear();
+        }
+    }
+    
+    removeInstructions(code, dead);
+    return changes;
+}
+
+using Pass = std::size_t (*)(std::vector<Instruction>&);
+
+// Run in order until none of them change anything.
+const std::vector<std::pair<std::string, Pass>> kPasses = {
+    {"constant folding", foldConstants},
+    {"thread jumps", threadJumps},
+    {"jumps to next", removeJumpsToNext},
+    {"unreachable code", removeUnreachable},
+    {"local round trips", removeRoundTrips},
+    {"tail calls", makeTailCalls},
+};
+
+// Each round of passes can only expose so much more work. This is just a
+// guard against a pair of passes undoing each other forever.
+constexpr std::size_t kMaxPassRounds = 16;
+
+}
+
 bool transform::assembleFunction(Function& m)
 {
     // 1. Collect locations of and remove all labels from function.
@@ -50,12 +563,6 @@ bool transform::assembleFunction(Function& m)
         }
     }
     
-    auto isJump = [](InstType t) -> bool
-    {
-        return t == InstType::jump || t == InstType::jeq || t == InstType::jneq
-        || t == InstType::jlt || t == InstType::jgt;
-    };
-    
     // 2. Make all jump instructions into relative jumps
     size_t loc = 0;
     for (Instruction& i : unlabeled)
@@ -86,6 +593,43 @@ bool transform::assembleFunction(Function& m)
         ++loc;
     }
     
+    // 3. Move immediates into the function's constant pool. Instructions are
+    // pointed at the pooled value so equal immediates share one object.
+    ConstantPool pool(m._constants);
+    for (Instruction& i : unlabeled)
+    {
+        if (i.first == InstType::pi && i.second.has_value())
+        {
+            i.second = m._constants[pool.intern(i.second.value())];
+        }
+    }
+    
+    // 4. Record how many local slots the function uses so that its call frames
+    // only need to be that big. Arguments count. Negative indices would be
+    // truncated towards slot 0 without being counted so they are rejected
+    // here. Indices past the end are left for the verifier and the VM.
+    m._localCount = m._arity.value_or(0);
+    for (const Instruction& i : unlabeled)
+    {
+        if ((i.first != InstType::sl && i.first != InstType::ll)
+            || ! i.second.has_value())
+        {
+            continue;
+        }
+        auto index = util::get<float>(i.second.value());
+        if (index && index.value() < 0)
+        {
+            logger()->error("Negative local index in " + to_string(i.first)
+                            + " instruction.");
+            return false;
+        }
+        if (index && index.value() < kLocalCount)
+        {
+            m._localCount = std::max(m._localCount,
+                                     static_cast<std::size_t>(index.value()) + 1);
+        }
+    }
+    
     m._instructions = std::move(unlabeled);
     return true;
 }
@@ -100,11 +644,13 @@ bool transform::linkFunctions(std::vector<Function>& functions,
     {
         for (auto& instruction : fn._instructions)
         {
-            if (instruction.first == InstType::call)
+            if (instruction.first == InstType::call
+                || instruction.first == InstType::tailcall)
             {
                 if ( ! instruction.second.has_value() )
                 {
-                    logger()->error("No jump location for call instruction.");
+                    logger()->error("No jump location for " + to_string(instruction.first)
+                                    + " instruction.");
                     return false;
                 }
 
@@ -120,3 +666,268 @@ bool transform::linkFunctions(std::vector<Function>& functions,
     
     return true;
 }
+
+bool transform::lowerFunction(Function& fn)
+{
+    fn._code.clear();
+    fn._code.reserve(fn._instructions.size());
+    
+    // Passes that run after assembly may have added or removed constants so
+    // the pool is rebuilt from what the instructions still use.
+    fn._constants.clear();
+    ConstantPool pool(fn._constants);
+    
+    for (const Instruction& i : fn._instructions)
+    {
+        switch (i.first)
+        {
+            case InstType::pi:
+            {
+                if ( ! i.second.has_value() )
+                {
+                    logger()->error("Expected immediate in pi instruction.");
+                    return false;
+                }
+                std::size_t index = pool.intern(i.second.value());
+                if (index > kMaxOperand)
+                {
+                    logger()->error("Too many constants in function.");
+                    return false;
+                }
+                fn._code.push_back(encode(i.first, index));
+                break;
+            }
+            case InstType::sl:
+            case InstType::ll:
+            case InstType::sg:
+            case InstType::lg:
+            case InstType::jump:
+            case InstType::call:
+            case InstType::tailcall:
+            case InstType::jeq:
+            case InstType::jneq:
+            case InstType::jlt:
+            case InstType::jgt:
+            {
+                if ( ! i.second.has_value() )
+                {
+                    logger()->error("Expected immediate in "
+                                    + to_string(i.first) + " instruction.");
+                    return false;
+                }
+                auto fq = util::get<float>(i.second.value());
+                if ( ! fq )
+                {
+                    logger()->error("Unresolved or non-float immediate in "
+                                    + to_string(i.first) + " instruction: "
+                                    + to_string(i.second));
+                    return false;
+                }
+                float f = fq.value();
+                if (f < kMinOperand || f > kMaxOperand)
+                {
+                    logger()->error("Immediate out of range in "
+                                    + to_string(i.first) + " instruction.");
+                    return false;
+                }
+                fn._code.push_back(encode(i.first, static_cast<std::int32_t>(f)));
+                break;
+            }
+            case InstType::label:
+                logger()->error("Label instruction in assembled function.");
+                return false;
+            default:
+                if (i.second.has_value())
+                {
+                    logger()->error("Unexpected immediate in "
+                                    + to_string(i.first) + " instruction.");
+                    return false;
+                }
+                fn._code.push_back(encode(i.first));
+                break;
+        }
+    }
+    return true;
+}
+
+bool transform::fuseSuperinstructions(Function& fn, FusionCounts& counts)
+{
+    const std::vector<Word>& code = fn._code;
+    const std::size_t n = code.size();
+    
+    // Where each jump goes, as an index into the unfused code.
+    auto targetOf = [&](std::size_t i)-> std::int64_t
+    {
+        return static_cast<std::int64_t>(i) + operand(code[i]);
+    };
+    
+    // 1. Find every instruction that is jumped to. A fusion can't swallow one
+    // of those as nothing would be left to land on.
+    std::vector<bool> isTarget(n + 1, false);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        if (isJump(opcode(code[i])))
+        {
+            std::int64_t t = targetOf(i);
+            if (t < 0 || t > static_cast<std::int64_t>(n))
+            {
+                logger()->error("Jump out of function while fusing instructions.");
+                return false;
+            }
+            isTarget[t] = true;
+        }
+    }
+    
+    // 2. Fuse. Jumps remember their target as an unfused index for now.
+    std::vector<Word> fused;
+    std::vector<std::int64_t> targets;
+    std::vector<std::size_t> newIndex(n + 1);
+    
+    std::size_t i = 0;
+    while (i < n)
+    {
+        const Fusion* match = nullptr;
+        std::int32_t op = 0;
+        std::int64_t target = -1;
+        
+        for (const Fusion& f : kFusions)
+        {
+            const std::size_t len = f._pattern.size();
+            if (i + len > n) continue;
+            
+            bool same = true;
+            for (std::size_t k = 0; k < len && same; ++k)
+            {
+                same = opcode(code[i + k]) == f._pattern[k]
+                    && (k == 0 || ! isTarget[i + k]);
+            }
+            if ( ! same ) continue;
+            
+            op = f._operand < 0 ? 0 : operand(code[i + f._operand]);
+            if (f._jump >= 0)
+            {
+                // Distances only shrink as instructions are removed so if the
+                // unfused one fits the fused one will too.
+                target = targetOf(i + f._jump);
+                std::int64_t distance = target - static_cast<std::int64_t>(i);
+                if (op > kMaxHighOperand || distance < kMinLowOperand
+                    || distance > kMaxLowOperand)
+                {
+                    continue;
+                }
+            }
+            match = &f;
+            break;
+        }
+        
+        if (match)
+        {
+            for (std::size_t k = 0; k < match->_pattern.size(); ++k)
+            {
+                newIndex[i + k] = fused.size();
+            }
+            fused.push_back(match->_jump >= 0 ? encode(match->_fused, op, 0)
+                                              : encode(match->_fused, op));
+            targets.push_back(match->_jump >= 0 ? target : -1);
+            ++counts[match->_fused];
+            i += match->_pattern.size();
+        } else
+        {
+            newIndex[i] = fused.size();
+            fused.push_back(code[i]);
+            targets.push_back(isJump(opcode(code[i])) ? targetOf(i) : -1);
+            ++i;
+        }
+    }
+    newIndex[n] = fused.size();
+    
+    // 3. Turn jump targets back into distances.
+    for (std::size_t j = 0; j < fused.size(); ++j)
+    {
+        if (targets[j] < 0) continue;
+        
+        std::int32_t distance = static_cast<std::int32_t>(newIndex[targets[j]])
+                              - static_cast<std::int32_t>(j);
+        InstType t = opcode(fused[j]);
+        fused[j] = isSplitJump(t) ? encode(t, highOperand(fused[j]), distance)
+                                  : encode(t, distance);
+    }
+    
+    fn._code = std::move(fused);
+    return true;
+}
+
+bool transform::isSuperinstruction(InstType t)
+{
+    return std::any_of(kFusions.begin(), kFusions.end(), [t](const Fusion& f)
+    {
+        return f._fused == t;
+    });
+}
+
+std::string transform::fusionReport(const FusionCounts& counts)
+{
+    std::vector<std::pair<InstType, std::size_t>> sorted(counts.begin(),
+                                                         counts.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto& l, auto& r)
+    {
+        return l.second > r.second;
+    });
+    
+    std::string res;
+    for (const auto& [type, count] : sorted)
+    {
+        res += to_string(type) + ": " + std::to_string(count) + "\n";
+    }
+    return res;
+}
+
+bool transform::optimizeFunction(Function& fn, OptimizationStats& stats)
+{
+    std::vector<Instruction>& code = fn._instructions;
+    
+    // Jumps to labels that weren't found are left for lowerFunction to
+    // complain about. Without their targets we can't move anything.
+    for (std::size_t i = 0; i < code.size(); ++i)
+    {
+        if (isJump(code[i].first) && ! jumpTarget(code, i))
+        {
+            return true;
+        }
+    }
+    
+    for (std::size_t round = 0; round < kMaxPassRounds; ++round)
+    {
+        bool changed = false;
+        for (const auto& [name, pass] : kPasses)
+        {
+            const std::size_t before = code.size();
+            const std::size_t changes = pass(code);
+            
+            PassStats& s = stats[name];
+            s._changes += changes;
+            s._saved += before - code.size();
+            changed = changed || changes;
+        }
+        if ( ! changed ) break;
+    }
+    return true;
+}
+
+std::string transform::optimizationReport(const OptimizationStats& stats)
+{
+    std::vector<std::pair<std::string, PassStats>> sorted(stats.begin(),
+                                                          stats.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto& l, auto& r)
+    {
+        return l.second._saved > r.second._saved;
+    });
+    
+    std::string res;
+    for (const auto& [name, s] : sorted)
+    {
+        res += name + ": " + std::to_string(s._saved) + " instructions saved, "
+             + std::to_string(s._changes) + " changes\n";
+    }
+    return res;
+}
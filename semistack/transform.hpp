@@ -10,6 +10,7 @@
 
 #include "function.hpp"
 #include <map>
+#include <string>
 #include <vector>
 
 namespace vm {
@@ -19,6 +20,40 @@ bool assembleFunction(Function& fn);
 bool linkFunctions(std::vector<Function>& functions,
          const std::map<std::string, std::vector<Function>::size_type>& table);
 
+// What an optimization pass did over every function it was run on.
+struct PassStats
+{
+    // How many rewrites the pass made.
+    std::size_t _changes = 0;
+    // How many instructions it removed.
+    std::size_t _saved = 0;
+};
+using OptimizationStats = std::map<std::string, PassStats>;
+
+// Runs the peephole passes over an assembled function until they stop finding
+// things to do. Run after assembleFunction and before linkFunctions.
+bool optimizeFunction(Function& fn, OptimizationStats& stats);
+// One line per pass, most instructions saved first.
+std::string optimizationReport(const OptimizationStats& stats);
+
+// Lowers an assembled and linked function into the packed Word stream that
+// the interpreter runs. The instructions are left untouched.
+bool lowerFunction(Function& fn);
+
+// How many of each superinstruction were made, or how many times each one
+// ran.
+using FusionCounts = std::map<InstType, std::size_t>;
+
+// Replaces common sequences of lowered instructions with superinstructions
+// and fixes up jumps around them. Run after lowerFunction. See the table at
+// the top of transform.cpp for which sequences get fused.
+bool fuseSuperinstructions(Function& fn, FusionCounts& counts);
+// One line per superinstruction, most common first.
+std::string fusionReport(const FusionCounts& counts);
+// Is t one of the instructions that fuseSuperinstructions makes? Quickened
+// versions of them aren't.
+bool isSuperinstruction(InstType t);
+
 }
 
 }
@@ -49,6 +49,14 @@ template <class... Vts>
 inline constexpr bool holds_same(const std::variant<Vts...>&l,
                                  const std::variant<Vts...>& r);
 
+// Versions of the above for VM Values. These are a single tag check. Numbers
+// are returned by value as they are not stored as a float inside of a Value.
+template <class T>
+inline bool holds(const Value& v) noexcept;
+template <class T>
+inline auto get(const Value& v);
+inline bool holds_same(const Value& l, const Value& r) noexcept;
+
 // Convience methods for making instructions.
 template<class T>
 inline typename std::enable_if<std::is_constructible_v<Value, T>, Instruction>::type
@@ -239,5 +247,48 @@ inline constexpr bool holds_same(const std::variant<Vts...>&l,
     }, l, r);
 }
 
+template <class T>
+inline bool holds(const Value& v) noexcept
+{
+    if constexpr (std::is_same_v<T, float>)
+    {
+        return v.isNumber();
+    } else if constexpr (std::is_same_v<T, std::string>)
+    {
+        return v.isString();
+    } else if constexpr (std::is_same_v<T, std::shared_ptr<Function>>)
+    {
+        return v.isFunction();
+    } else
+    {
+        return false;
+    }
+}
+
+template <class T>
+inline auto get(const Value& v)
+{
+    if constexpr (std::is_same_v<T, float>)
+    {
+        return v.isNumber() ? std::optional<float>(v.asNumber()) : std::nullopt;
+    } else if constexpr (std::is_same_v<T, std::string>)
+    {
+        return v.isString() ? optional_ref<const std::string>(v.asString())
+                            : std::nullopt;
+    } else
+    {
+        static_assert(std::is_same_v<T, std::shared_ptr<Function>>,
+                      "Values only hold floats, strings and functions.");
+        return v.isFunction()
+            ? optional_ref<const std::shared_ptr<Function>>(v.asFunction())
+            : std::nullopt;
+    }
+}
+
+inline bool holds_same(const Value& l, const Value& r) noexcept
+{
+    return l.sameType(r);
+}
+
 }
 }
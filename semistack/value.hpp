@@ -18,10 +18,41 @@
 //  things up a little bit and make functions the things that you add code to
 //  rather than Functions.
 
-#include <variant>
+//  Values used to be a nested std::variant. That made every stack slot ~40
+//  bytes and every type check a couple of std::visit calls. A Value is now a
+//  single tagged 64 bit word:
+//
+//      63      48 47                    32 31                      0
+//      +---------+------------------------+-------------------------+
+//      |   tag   |         unused         |      float number       |
+//      +---------+------------------------+-------------------------+
+//      |   tag   |             heap pointer (48 bits)               |
+//      +---------+--------------------------------------------------+
+//
+//  Numbers live inline in the low 32 bits with a tag of zero, which means that
+//  zeroed memory is the number 0. Strings and functions are heap allocated,
+//  reference counted Objects and their pointer lives in the low 48 bits. All
+//  of the type checks are a single shift and compare on the tag.
+//
+//  Numbers in the VM are floats so, unlike Lua and friends, we don't need to
+//  NaN-box doubles here. That also saves us from having to canonicalize NaNs
+//  that come out of arithmetic.
+//
+//  Appending to a string used to copy both halves into a new one, so a loop
+//  that built up a string one piece at a time was quadratic. Value::append
+//  now extends strings that nothing else holds in place and otherwise makes
+//  long results a concatenation node that only points at its two halves. A
+//  node is flattened into an ordinary string the first time it is read, so
+//  building a string n pieces long and then printing it takes O(n) time.
+
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <list>
+#include <optional>
 #include <string>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
 namespace vm {
@@ -29,8 +60,317 @@ namespace vm {
 // Some forward declarations to make the compiler happy. Many of these also
 // appear in instruction.hpp.
 enum class InstType;
-using Object = std::variant<std::string, std::shared_ptr<struct Function>>;
-using Value = std::variant<float, Object>;
+struct Function;
+
+static_assert(sizeof(void*) == 8, "Value assumes 64 bit pointers.");
+
+// Header for everything a Value can point to. Objects are immutable once they
+// have been handed to a Value, other than strings that only one Value holds,
+// and are freed when the last Value pointing at them goes away. The VM is
+// single threaded so the count doesn't need to be atomic.
+struct Object
+{
+    std::uint32_t _refs = 1;
+};
+
+struct String: Object
+{
+    // Empty while this is a concatenation that hasn't been read.
+    mutable std::string _str;
+    // The two halves of a concatenation, each holding a reference, or
+    // nullptr once it has been flattened into _str.
+    mutable String* _left = nullptr;
+    mutable String* _right = nullptr;
+    std::size_t _length;
+    // Set by the StringTable that interned this string (see strings.hpp).
+    // Two strings interned by the same table are equal only if they are the
+    // same object. Zero for strings that were never interned.
+    std::uint32_t _table = 0;
+    std::size_t _hash = 0;
+
+    // Strings with more bytes than this are made lazily by Value::append.
+    // Anything shorter is cheaper to copy than to keep the halves of.
+    static constexpr std::size_t kMaxEagerLength = 40;
+
+    String(std::string s): _str(std::move(s)), _length(_str.size()) {}
+    // Takes over a reference to each of left and right.
+    String(String* left, String* right)
+        : _left(left), _right(right), _length(left->_length + right->_length) {}
+
+    const std::string& str() const
+    {
+        if (_left) flatten();
+        return _str;
+    }
+
+    // Drops a reference to s and frees it if that was the last one.
+    static void release(String* s)
+    {
+        if (--s->_refs == 0) destroy(s);
+    }
+
+    static void destroy(String* s)
+    {
+        // Concatenations can be nested as deep as the number of appends that
+        // made them, far too deep to free recursively.
+        std::vector<String*> todo;
+        for (;;)
+        {
+            String* halves[] = {s->_left, s->_right};
+            delete s;
+            for (String* h : halves)
+            {
+                if (h && --h->_refs == 0)
+                {
+                    todo.push_back(h);
+                }
+            }
+            if (todo.empty()) return;
+            s = todo.back();
+            todo.pop_back();
+        }
+    }
+
+private:
+    // Copies the leaves under this node into _str, left to right, and lets
+    // go of the halves.
+    void flatten() const
+    {
+        std::string flat;
+        flat.reserve(_length);
+        std::vector<const String*> todo{_right, _left};
+        while ( ! todo.empty() )
+        {
+            const String* s = todo.back();
+            todo.pop_back();
+            if (s->_left)
+            {
+                todo.push_back(s->_right);
+                todo.push_back(s->_left);
+            } else
+            {
+                flat += s->_str;
+            }
+        }
+        _str = std::move(flat);
+        release(_left);
+        release(_right);
+        _left = _right = nullptr;
+    }
+};
+
+struct FunctionObject: Object
+{
+    std::shared_ptr<Function> _fn;
+
+    FunctionObject(std::shared_ptr<Function> fn): _fn(std::move(fn)) {}
+};
+
+class Value
+{
+public:
+    enum class Tag: std::uint16_t
+    {
+        number = 0,
+        string = 1,
+        function = 2,
+    };
+
+    Value() noexcept: _bits(0) {}
+
+    template<class T, typename std::enable_if<std::is_arithmetic_v<T>, int>::type = 0>
+    Value(T n) noexcept
+    {
+        float f = static_cast<float>(n);
+        std::uint32_t raw;
+        std::memcpy(&raw, &f, sizeof(raw));
+        _bits = raw;
+    }
+
+    Value(const char* s): Value(std::string(s)) {}
+    Value(std::string s): Value(Tag::string, new String(std::move(s))) {}
+    Value(std::shared_ptr<Function> fn)
+        : Value(Tag::function, new FunctionObject(std::move(fn))) {}
+
+    Value(const Value& o) noexcept: _bits(o._bits) { retain(); }
+    Value(Value&& o) noexcept: _bits(o._bits) { o._bits = 0; }
+
+    Value& operator=(const Value& o) noexcept
+    {
+        o.retain();
+        release();
+        _bits = o._bits;
+        return *this;
+    }
+
+    Value& operator=(Value&& o) noexcept
+    {
+        if (this != &o)
+        {
+            release();
+            _bits = o._bits;
+            o._bits = 0;
+        }
+        return *this;
+    }
+
+    ~Value() { release(); }
+
+    Tag tag() const noexcept { return static_cast<Tag>(_bits >> kTagShift); }
+
+    bool isNumber() const noexcept { return (_bits >> kTagShift) == 0; }
+    bool isObject() const noexcept { return (_bits >> kTagShift) != 0; }
+    bool isString() const noexcept { return tag() == Tag::string; }
+    bool isFunction() const noexcept { return tag() == Tag::function; }
+
+    // Do the two values hold the same type?
+    bool sameType(const Value& o) const noexcept
+    {
+        return (_bits >> kTagShift) == (o._bits >> kTagShift);
+    }
+
+    // Unchecked accessors. Callers are expected to have checked the tag.
+    float asNumber() const noexcept
+    {
+        float f;
+        std::uint32_t raw = static_cast<std::uint32_t>(_bits);
+        std::memcpy(&f, &raw, sizeof(f));
+        return f;
+    }
+    const std::string& asString() const
+    {
+        return static_cast<String*>(object())->str();
+    }
+    const std::shared_ptr<Function>& asFunction() const noexcept
+    {
+        return static_cast<FunctionObject*>(object())->_fn;
+    }
+
+    Object* object() const noexcept
+    {
+        return reinterpret_cast<Object*>(_bits & kPointerMask);
+    }
+
+    std::uint64_t bits() const noexcept { return _bits; }
+
+    // Replaces this string with itself followed by r, which must also be a
+    // string.
+    void append(const Value& r)
+    {
+        auto* ls = static_cast<String*>(object());
+        auto* rs = static_cast<String*>(r.object());
+        if (rs->_length == 0) return;
+        if (ls->_length == 0)
+        {
+            *this = r;
+            return;
+        }
+        if (ls->_refs == 1 && ! ls->_left && ! ls->_table)
+        {
+            // Nothing else can see it change.
+            ls->_str += rs->str();
+            ls->_length = ls->_str.size();
+            return;
+        }
+        if (ls->_length + rs->_length <= String::kMaxEagerLength)
+        {
+            *this = Value(ls->str() + rs->str());
+            return;
+        }
+        ++ls->_refs;
+        ++rs->_refs;
+        *this = Value(Tag::string, new String(ls, rs));
+    }
+
+    // Comparing strings reads them, and reading a concatenation flattens it,
+    // so these can allocate and aren't noexcept.
+    friend bool operator==(const Value& l, const Value& r)
+    {
+        if (l._bits == r._bits) return l.isObject() || l.asNumber() == r.asNumber();
+        if ( ! l.sameType(r) ) return false;
+        switch (l.tag())
+        {
+            case Tag::number:
+                return l.asNumber() == r.asNumber();
+            case Tag::string:
+            {
+                // Different objects from one table hold different strings.
+                const auto* ls = static_cast<const String*>(l.object());
+                const auto* rs = static_cast<const String*>(r.object());
+                if (ls->_table && ls->_table == rs->_table) return false;
+                return ls->_length == rs->_length && ls->str() == rs->str();
+            }
+            case Tag::function:
+                return l.asFunction() == r.asFunction();
+        }
+        return false;
+    }
+
+    friend bool operator!=(const Value& l, const Value& r)
+    {
+        return ! (l == r);
+    }
+
+    // Values of different types are ordered by their tag. Functions are
+    // ordered by address. The VM rejects both of those before it compares.
+    friend bool operator<(const Value& l, const Value& r)
+    {
+        if ( ! l.sameType(r) ) return l.tag() < r.tag();
+        switch (l.tag())
+        {
+            case Tag::number:
+                return l.asNumber() < r.asNumber();
+            case Tag::string:
+                return l.asString() < r.asString();
+            case Tag::function:
+                return l.asFunction() < r.asFunction();
+        }
+        return false;
+    }
+
+    friend bool operator>(const Value& l, const Value& r)
+    {
+        return r < l;
+    }
+
+private:
+    static constexpr unsigned kTagShift = 48;
+    static constexpr std::uint64_t kPointerMask = (std::uint64_t(1) << kTagShift) - 1;
+
+    Value(Tag t, Object* o) noexcept
+        : _bits((static_cast<std::uint64_t>(t) << kTagShift)
+                | reinterpret_cast<std::uint64_t>(o)) {}
+
+    void retain() const noexcept
+    {
+        if (isObject()) ++object()->_refs;
+    }
+
+    void release() noexcept
+    {
+        if (isObject() && --object()->_refs == 0) destroy();
+    }
+
+    void destroy() noexcept
+    {
+        switch (tag())
+        {
+            case Tag::string:
+                String::destroy(static_cast<String*>(object()));
+                break;
+            case Tag::function:
+                delete static_cast<FunctionObject*>(object());
+                break;
+            case Tag::number:
+                break;
+        }
+    }
+
+    std::uint64_t _bits;
+};
+
+static_assert(sizeof(Value) == 8, "Values should fit in a single word.");
+
 using Immediate = std::optional<Value>;
 using Instruction = std::pair<InstType, Immediate>;
 
@@ -0,0 +1,595 @@
+//
+//  verify.cpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/9/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+//  The verifier runs each function abstractly. Rather than values it keeps
+//  track of how deep the stack is and, where it can, the types of the values on
+//  it and in locals. States are kept at the start of each basic block and
+//  merged where paths meet until nothing changes.
+//
+//  Functions share the value stack with their caller so a function can pop
+//  values that it didn't push, which is how arguments are passed. Each
+//  function's effect on the stack (how many of its caller's values it pops and
+//  how far the stack has moved when it returns) is worked out from the effects
+//  of the functions it calls. As functions can be recursive that is repeated
+//  until no function's effect changes. A call to a function that isn't known
+//  to return yet ends the path it is on.
+//
+//  Functions that declare an arity are simpler. They pop exactly their
+//  arguments, which start out in their first locals, and they leave behind
+//  whatever they have pushed when they return.
+//
+//  Operands are checked up front for every instruction, reachable or not.
+//  Running the functions abstractly only proves things about programs whose
+//  stack depths line up, so anything else it finds just leaves the program
+//  unverified. A stack underflow is only certain once everything else has
+//  been verified and the depths are known to be exact.
+
+#include "verify.hpp"
+#include "instruction.hpp"
+#include "logger.hpp"
+
+#include <algorithm>
+#include <optional>
+
+using namespace vm;
+
+namespace {
+
+// A value's type, if we know it.
+using Type = std::optional<Value::Tag>;
+
+struct State
+{
+    // How many values are on the stack relative to when the function was
+    // called. This goes negative as a function pops its arguments.
+    std::int64_t _depth = 0;
+    // The types of the values on top of the stack with the top one last. There
+    // can be fewer of these than values, the ones below are unknown.
+    std::vector<Type> _types;
+    // Locals start out as the number 0.
+    std::vector<Type> _locals = std::vector<Type>(kLocalCount,
+                                                  Value::Tag::number);
+
+    void push(Type t)
+    {
+        ++_depth;
+        _types.push_back(t);
+    }
+
+    Type pop()
+    {
+        --_depth;
+        if (_types.empty()) return std::nullopt;
+        Type t = _types.back();
+        _types.pop_back();
+        return t;
+    }
+
+    Type top() const
+    {
+        return _types.empty() ? std::nullopt : _types.back();
+    }
+
+    // Forgets anything that other doesn't also know and returns if that was
+    // anything. Both states must have the same depth.
+    bool merge(const State& other)
+    {
+        bool changed = false;
+
+        std::size_t common = std::min(_types.size(), other._types.size());
+        if (common < _types.size())
+        {
+            _types.erase(_types.begin(), _types.end() - common);
+            changed = true;
+        }
+        for (std::size_t i = 0; i < common; ++i)
+        {
+            Type& t = _types[_types.size() - 1 - i];
+            if (t && t != other._types[other._types.size() - 1 - i])
+            {
+                t = std::nullopt;
+                changed = true;
+            }
+        }
+
+        for (std::size_t i = 0; i < _locals.size(); ++i)
+        {
+            if (_locals[i] && _locals[i] != other._locals[i])
+            {
+                _locals[i] = std::nullopt;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+};
+
+// The stack effect of a function that returns.
+struct Effect
+{
+    // How many of its caller's values it pops.
+    std::int64_t _in;
+    // How far the stack has moved when it returns.
+    std::int64_t _out;
+
+    bool operator==(const Effect& o) const
+    {
+        return _in == o._in && _out == o._out;
+    }
+};
+
+// Indexed like the functions. Nothing for functions not known to return.
+using Effects = std::vector<std::optional<Effect>>;
+
+// Says which instruction in fn something is wrong with.
+std::string describe(const Function& fn, const std::string& name,
+                     std::size_t pc, const std::string& what)
+{
+    std::string where = pc < fn._code.size() ? to_string(fn._code[pc]) : "";
+    return "Verifying " + name + ", instruction " + std::to_string(pc) + " ("
+           + where + "): " + what;
+}
+
+// Checks the operand of every instruction in fn, whether or not it can run.
+// Returns false if any is out of range.
+bool checkOperands(const Function& fn, const std::string& name,
+                   std::size_t functionCount)
+{
+    auto reject = [&](std::size_t pc, const std::string& what)
+    {
+        logger()->error(describe(fn, name, pc, what));
+        return false;
+    };
+
+    if (fn._arity.value_or(0) > kLocalCount)
+    {
+        return reject(0, "Too many arguments.");
+    }
+
+    const std::vector<Word>& code = fn._code;
+    for (std::size_t pc = 0; pc < code.size(); ++pc)
+    {
+        const std::int32_t op = operand(code[pc]);
+        auto outside = [op](std::size_t size)
+        {
+            return op < 0 || static_cast<std::size_t>(op) >= size;
+        };
+
+        switch (opcode(code[pc]))
+        {
+            case InstType::pi:
+                if (outside(fn._constants.size()))
+                {
+                    return reject(pc, "Constant index out of range.");
+                }
+                break;
+            case InstType::sl:
+            case InstType::ll:
+                // Frames only have room for the locals the function uses.
+                if (outside(fn._localCount))
+                {
+                    return reject(pc, "Local index out of range.");
+                }
+                break;
+            case InstType::sg:
+            case InstType::lg:
+                if (outside(kGlobalCount))
+                {
+                    return reject(pc, "Global index out of range.");
+                }
+                break;
+            case InstType::call:
+            case InstType::tailcall:
+                if (outside(functionCount))
+                {
+                    return reject(pc, "Call to a function that doesn't exist.");
+                }
+                break;
+            case InstType::jump:
+            case InstType::jeq:
+            case InstType::jneq:
+            case InstType::jlt:
+            case InstType::jgt:
+            {
+                std::int64_t target = static_cast<std::int64_t>(pc) + op;
+                if (target < 0 || target >= static_cast<std::int64_t>(code.size()))
+                {
+                    return reject(pc, "Jump out of function.");
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return true;
+}
+
+class FunctionVerifier
+{
+public:
+    FunctionVerifier(const std::vector<Function>& functions,
+                     const Effects& effects, std::size_t index,
+                     std::string name, bool root)
+        : _effects(effects),
+          _fn(functions[index]), _name(std::move(name)),
+          _bounded(root || _fn._arity) {}
+
+    // Logs and returns false if the function can't be verified. Otherwise
+    // sets effect, or clears it if the function doesn't return. Operands must
+    // have been checked with checkOperands.
+    bool run(std::optional<Effect>& effect);
+    
+    // What went wrong if the function popped more than it was allowed to.
+    const std::optional<std::string>& underflow() const { return _underflow; }
+    
+    // The deepest the stack got above where it was when the function was
+    // called.
+    std::int64_t maxDepth() const { return _maxDepth; }
+    // How deep the stack is before each instruction.
+    std::vector<std::optional<std::int32_t>>& depths() { return _depths; }
+
+private:
+    enum class Step { next, stop, error };
+
+    Step step(State& s, std::size_t pc);
+    // Moves s to the block starting at pc.
+    bool flow(std::size_t pc, const State& s);
+    void popped(const State& s, std::size_t pc);
+    // Called when s reaches a ret.
+    bool returned(const State& s, std::size_t pc);
+    bool fail(std::size_t pc, std::string what);
+
+    const Effects& _effects;
+    const Function& _fn;
+    std::string _name;
+    // Can't pop below where the function started.
+    bool _bounded;
+
+    std::vector<bool> _isLeader;
+    std::vector<std::optional<State>> _states;
+    std::vector<std::optional<std::int32_t>> _depths;
+    std::vector<std::size_t> _work;
+
+    std::int64_t _minDepth = 0;
+    std::int64_t _maxDepth = 0;
+    std::optional<std::int64_t> _retDepth;
+    std::optional<std::string> _underflow;
+};
+
+bool FunctionVerifier::run(std::optional<Effect>& effect)
+{
+    const std::vector<Word>& code = _fn._code;
+    const std::size_t n = code.size();
+    if (n == 0)
+    {
+        return fail(0, "Empty function.");
+    }
+
+    // 1. Find the start of each basic block.
+    _isLeader.assign(n, false);
+    _isLeader[0] = true;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        InstType t = opcode(code[i]);
+        if (t != InstType::jump && t != InstType::jeq && t != InstType::jneq
+            && t != InstType::jlt && t != InstType::jgt)
+        {
+            continue;
+        }
+
+        _isLeader[i + operand(code[i])] = true;
+        if (t != InstType::jump && i + 1 < n)
+        {
+            _isLeader[i + 1] = true;
+        }
+    }
+
+    // 2. Run each block until nothing changes. Arguments could be anything.
+    const std::size_t arity = _fn._arity.value_or(0);
+    _states.assign(n, std::nullopt);
+    _depths.assign(n, std::nullopt);
+    _states[0] = State();
+    std::fill_n(_states[0]->_locals.begin(), arity, std::nullopt);
+    _work.push_back(0);
+
+    while (_work.size())
+    {
+        std::size_t pc = _work.back();
+        _work.pop_back();
+        State s = _states[pc].value();
+
+        for (;;)
+        {
+            _depths[pc] = static_cast<std::int32_t>(s._depth);
+            Step res = step(s, pc);
+            _maxDepth = std::max(_maxDepth, s._depth);
+            if (res == Step::error) return false;
+            if (res == Step::stop) break;
+
+            if (pc + 1 == n)
+            {
+                return fail(pc, "Control falls off the end of the function.");
+            }
+            ++pc;
+            if (_isLeader[pc])
+            {
+                if ( ! flow(pc, s) ) return false;
+                break;
+            }
+        }
+    }
+
+    effect.reset();
+    if (_retDepth && _fn._arity)
+    {
+        std::int64_t in = static_cast<std::int64_t>(arity);
+        effect = Effect{in, _retDepth.value() - in};
+    } else if (_retDepth)
+    {
+        effect = Effect{-_minDepth, _retDepth.value()};
+    }
+    return true;
+}
+
+FunctionVerifier::Step FunctionVerifier::step(State& s, std::size_t pc)
+{
+    const Word w = _fn._code[pc];
+    const InstType t = opcode(w);
+    const std::int32_t op = operand(w);
+
+    auto error = [&](std::string what)
+    {
+        fail(pc, std::move(what));
+        return Step::error;
+    };
+
+    switch (t)
+    {
+        case InstType::pi:
+            s.push(_fn._constants[op].tag());
+            return Step::next;
+        case InstType::sl:
+        case InstType::ll:
+        case InstType::sg:
+        case InstType::lg:
+        {
+            if (t == InstType::sl)
+            {
+                s._locals[op] = s.pop();
+            } else if (t == InstType::ll)
+            {
+                s.push(s._locals[op]);
+            } else if (t == InstType::sg)
+            {
+                s.pop();
+            } else
+            {
+                s.push(std::nullopt);
+            }
+            popped(s, pc);
+            return Step::next;
+        }
+        case InstType::puts:
+            s.pop();
+            popped(s, pc);
+            return Step::next;
+        case InstType::copy:
+        {
+            Type top = s.top();
+            s.pop();
+            popped(s, pc);
+            s.push(top);
+            s.push(top);
+            return Step::next;
+        }
+        case InstType::exit:
+            return Step::stop;
+        case InstType::ret:
+            return returned(s, pc) ? Step::stop : Step::error;
+        case InstType::add:
+        case InstType::sub:
+        case InstType::mul:
+        case InstType::div:
+        case InstType::jeq:
+        case InstType::jneq:
+        case InstType::jlt:
+        case InstType::jgt:
+        {
+            Type right = s.pop();
+            Type left = s.pop();
+            popped(s, pc);
+
+            // These only give up on instructions that are sure to fail if
+            // they run.
+            Type known = left ? left : right;
+            bool arithmetic = t == InstType::add || t == InstType::sub
+                           || t == InstType::mul || t == InstType::div;
+            if (arithmetic || t == InstType::jlt || t == InstType::jgt)
+            {
+                if (left && right && left != right)
+                {
+                    return error("Different types in " + to_string(t)
+                                 + " instruction.");
+                }
+                if (known == Value::Tag::function)
+                {
+                    return error("Function operand in " + to_string(t)
+                                 + " instruction.");
+                }
+                if (arithmetic && t != InstType::add
+                    && known == Value::Tag::string)
+                {
+                    return error("String operand in " + to_string(t)
+                                 + " instruction.");
+                }
+            }
+
+            if (arithmetic)
+            {
+                s.push(known || t == InstType::add ? known : Value::Tag::number);
+                return Step::next;
+            }
+            return flow(pc + op, s) ? Step::next : Step::error;
+        }
+        case InstType::jump:
+            return flow(pc + op, s) ? Step::stop : Step::error;
+        case InstType::call:
+        case InstType::tailcall:
+        {
+            const std::optional<Effect>& effect = _effects[op];
+            if ( ! effect )
+            {
+                return Step::stop;
+            }
+
+            // Whatever the callee pops or pushes we know nothing about.
+            for (std::int64_t i = 0; i < effect->_in; ++i)
+            {
+                s.pop();
+            }
+            popped(s, pc);
+            for (std::int64_t i = 0; i < effect->_in + effect->_out; ++i)
+            {
+                s.push(std::nullopt);
+            }
+            if (t == InstType::tailcall)
+            {
+                return returned(s, pc) ? Step::stop : Step::error;
+            }
+            return Step::next;
+        }
+        default:
+            return error("Unexpected " + to_string(t) + " instruction.");
+    }
+}
+
+bool FunctionVerifier::flow(std::size_t pc, const State& s)
+{
+    std::optional<State>& there = _states[pc];
+    if ( ! there )
+    {
+        there = s;
+        _work.push_back(pc);
+        return true;
+    }
+
+    if (there->_depth != s._depth)
+    {
+        return fail(pc, "Paths reach this instruction with different stack depths ("
+                    + std::to_string(there->_depth) + " and "
+                    + std::to_string(s._depth) + ").");
+    }
+    if (there->merge(s))
+    {
+        _work.push_back(pc);
+    }
+    return true;
+}
+
+// Called after popping values. Only the root function and functions with an
+// arity aren't allowed to go below where they started. That is only reported
+// once the rest of the program has been verified.
+void FunctionVerifier::popped(const State& s, std::size_t pc)
+{
+    _minDepth = std::min(_minDepth, s._depth);
+    if (_bounded && s._depth < 0 && ! _underflow)
+    {
+        _underflow = describe(_fn, _name, pc, "Stack underflow.");
+    }
+}
+
+// Every ret has to leave the stack at the same depth.
+bool FunctionVerifier::returned(const State& s, std::size_t pc)
+{
+    if (_retDepth && _retDepth.value() != s._depth)
+    {
+        return fail(pc, "Returns with different stack depths.");
+    }
+    _retDepth = s._depth;
+    return true;
+}
+
+bool FunctionVerifier::fail(std::size_t pc, std::string what)
+{
+    logger()->debug(describe(_fn, _name, pc, what));
+    return false;
+}
+
+}
+
+verify::Result verify::verifyFunctions(std::vector<Function>& functions,
+                                       const std::map<std::string,
+                                       std::vector<Function>::size_type>& table,
+                                       std::vector<Function>::size_type root)
+{
+    std::vector<std::string> names(functions.size());
+    for (std::size_t i = 0; i < functions.size(); ++i)
+    {
+        names[i] = "function " + std::to_string(i);
+    }
+    for (const auto& [name, index] : table)
+    {
+        if (index < names.size()) names[index] = name;
+    }
+
+    for (std::size_t i = 0; i < functions.size(); ++i)
+    {
+        if ( ! checkOperands(functions[i], names[i], functions.size()) )
+        {
+            return Result::rejected;
+        }
+    }
+
+    // Each round can only teach us about callers of functions whose effects
+    // changed, so in a sane program this settles quickly. Effects that keep
+    // changing come from functions that grow the stack every time they
+    // recurse.
+    Effects effects(functions.size());
+    const std::size_t maxRounds = 4 * functions.size() + 4;
+
+    for (std::size_t round = 0; round < maxRounds; ++round)
+    {
+        bool changed = false;
+        std::optional<std::string> underflow;
+        for (std::size_t i = 0; i < functions.size(); ++i)
+        {
+            FunctionVerifier v(functions, effects, i, names[i], i == root);
+            std::optional<Effect> effect;
+            if ( ! v.run(effect) )
+            {
+                return Result::unverified;
+            }
+            if ( ! underflow )
+            {
+                underflow = v.underflow();
+            }
+            functions[i]._maxStack = static_cast<std::size_t>(v.maxDepth());
+            functions[i]._depths = std::move(v.depths());
+            if ( ! (effect == effects[i]) )
+            {
+                effects[i] = effect;
+                changed = true;
+            }
+        }
+        if ( ! changed && underflow )
+        {
+            logger()->error(underflow.value());
+            return Result::rejected;
+        }
+        if ( ! changed )
+        {
+            return Result::verified;
+        }
+    }
+
+    logger()->debug("Verifying: the stack effects of recursive functions never "
+                    "settle. Does a function grow the stack each time it "
+                    "recurses?");
+    return Result::unverified;
+}
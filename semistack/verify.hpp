@@ -0,0 +1,62 @@
+//
+//  verify.hpp
+//  semistack
+//
+//  Created by Zeke Medley on 2/9/20.
+//  Copyright © 2020 Zeke Medley. All rights reserved.
+//
+
+#pragma once
+
+#include "function.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace vm {
+namespace verify {
+
+// What verifyFunctions made of a program.
+enum class Result
+{
+    // Safe to run without checks.
+    verified,
+    // Couldn't be shown to be safe, though it may well be. It has to run with
+    // checks.
+    unverified,
+    // Sure to go wrong.
+    rejected,
+};
+
+// Checks lowered functions before they are run so that the interpreter doesn't
+// have to. A program is rejected if
+//
+//   - a pi, sl, ll, sg, lg, call, or tailcall operand is out of range,
+//   - a jump leaves its function, or
+//   - an instruction pops more values than are on the stack,
+//
+// and is left unverified if, along any path through it,
+//
+//   - control falls off the end of a function,
+//   - two paths reach the same instruction with different stack depths,
+//   - a function's rets leave the stack at different depths, or
+//   - an instruction is certain to fail on the types of its operands.
+//
+// None of those are errors unless that path is taken. Values are still
+// dynamically typed so type checks that can't be settled here are left to the
+// VM. root is the function that the program starts in. It and functions that
+// declare an arity aren't allowed to pop values that they didn't push or take
+// as arguments. Run after transform::lowerFunction and before fusing
+// superinstructions. Rejections are logged as errors and anything that leaves
+// a program unverified at debug level.
+//
+// Also records each function's maximum stack depth in its _maxStack so that
+// the VM only needs to check for stack overflow on calls, and the depth at each
+// instruction in its _depths.
+Result verifyFunctions(std::vector<Function>& functions,
+                       const std::map<std::string,
+                       std::vector<Function>::size_type>& table,
+                       std::vector<Function>::size_type root);
+
+}
+}
@@ -11,6 +11,12 @@
 #include "util.hpp"
 #include "transform.hpp"
 #include "instruction.hpp"
+#include "verify.hpp"
+#include "aot.hpp"
+#include "sampler.hpp"
+
+#include <algorithm>
+#include <tuple>
 
 using namespace vm;
 
@@ -22,399 +28,1059 @@ bool vm::VM::addFunction(vm::Function fn, std::string name)
         logger()->error("Failed to assemble function: " + name);
         return false;
     }
+    if (_options._optimize
+        && ! transform::optimizeFunction(fn, _optimizationStats))
+    {
+        logger()->error("Failed to optimize function: " + name);
+        return false;
+    }
     _functions.emplace_back(std::move(fn));
     return success;
 }
 
-ExitStatus vm::VM::run(std::string fn_name)
+std::optional<FnIndex> vm::VM::prepare(const std::string& fn_name, bool verify)
 {
-    logger()->maintain(_callStack.size() == 0,
-                       "Non-empty call stack for top level run insstruction.");
-    
     if ( ! transform::linkFunctions(_functions, _fnLookup) )
     {
         logger()->error("Failed to link functions");
-        return ExitStatus::error;
+        return std::nullopt;
     }
     
     auto where = _fnLookup.find(fn_name);
     if (where == _fnLookup.end())
     {
         logger()->error("Failed to lookup function: " + fn_name);
+        return std::nullopt;
+    }
+    
+    if (_functions[where->second]._arity.value_or(0))
+    {
+        logger()->error("Can't start running in a function with arguments: "
+                        + fn_name);
+        return std::nullopt;
+    }
+    
+    for (auto& fn : _functions)
+    {
+        if ( ! transform::lowerFunction(fn) )
+        {
+            logger()->error("Failed to lower functions");
+            return std::nullopt;
+        }
+        for (Value& constant : fn._constants)
+        {
+            _strings.intern(constant);
+        }
+    }
+    
+    _verified = false;
+    if (verify)
+    {
+        switch (verify::verifyFunctions(_functions, _fnLookup, where->second))
+        {
+            case verify::Result::verified:
+                _verified = true;
+                break;
+            case verify::Result::unverified:
+                logger()->debug("Couldn't verify functions, running them with "
+                                "checks");
+                break;
+            case verify::Result::rejected:
+                logger()->error("Failed to verify functions");
+                return std::nullopt;
+        }
+    }
+    if ( ! _verified )
+    {
+        // Whatever verification got through might not hold for the whole
+        // program.
+        for (auto& fn : _functions)
+        {
+            fn._maxStack = 0;
+            fn._depths.clear();
+        }
+    }
+    return where->second;
+}
+
+ExitStatus vm::VM::run(std::string fn_name)
+{
+    logger()->maintain(_callStack.size() == 0,
+                       "Non-empty call stack for top level run insstruction.");
+    
+    auto root = prepare(fn_name, _options._verify);
+    if ( ! root )
+    {
         return ExitStatus::error;
     }
     
+    // Translation needs the depths the verifier found, and the instructions
+    // they were found for, so it has to happen before fusion.
+    for (auto& fn : _functions)
+    {
+        if (_verified && _options._engine == Engine::registers)
+        {
+            registers::translateFunction(fn);
+        } else
+        {
+            fn._registerCode.clear();
+        }
+    }
+    
+    _fusionCounts.clear();
+    for (auto& fn : _functions)
+    {
+        if (_options._superinstructions
+            && ! transform::fuseSuperinstructions(fn, _fusionCounts))
+        {
+            logger()->error("Failed to fuse superinstructions");
+            return ExitStatus::error;
+        }
+    }
+    
+    // Machine code from an earlier run was compiled from code that has just
+    // been replaced.
+    _native.clear();
+    _native.resize(_functions.size());
+    _profile.assign(_functions.size(), FunctionProfile());
+    _genericCounts.fill(0);
+    _samples.clear();
+#if SEMISTACK_OPCODE_HISTOGRAM
+    _opcodeCounts.fill(0);
+    for (auto& row : _opcodePairCounts)
+    {
+        row.fill(0);
+    }
+    _lastOpcode = kInstTypeCount;
+#endif
+    _nativeDepth = 0;
+    _recording.reset();
+    _loopCounts.clear();
+    _traces.clear();
+    
+    _countingCalls = _options._profile || _options._engine == Engine::jit;
+    _sampling = false;
+    
     // Push a CallFrame for the function.
-    _callStack.emplace(where->second);
+    if ( ! pushFrame(root.value()) )
+    {
+        return ExitStatus::error;
+    }
     
-    auto res = runFunction(_functions.at(where->second));
+    _sampling = _options._sampleInterval
+             && sampler::start(_options._sampleInterval);
+    if (_options._sampleInterval && ! _sampling)
+    {
+        logger()->debug("Can't sample on this platform.");
+    }
+    _observing = _options._profile || _sampling;
+    
+    auto res = runFunction(_functions.at(root.value()));
+    
+    if (_sampling)
+    {
+        sampler::stop();
+        _sampling = false;
+    }
     
     if (_valueStack.size())
     {
         logger()->debug("Non empty value stack at end of execution.");
     }
+    
+    if (SEMISTACK_OPCODE_HISTOGRAM)
+    {
+        logger()->debug("Instructions run:");
+        for (const auto& [name, count] : opcodeHistogram())
+        {
+            logger()->debug("  " + std::to_string(count) + " " + name);
+        }
+        logger()->debug("Pairs of instructions run:");
+        for (const auto& [name, count] : opcodePairHistogram())
+        {
+            logger()->debug("  " + std::to_string(count) + " " + name);
+        }
+    }
     return res;
 }
 
+namespace {
+
+// Most first, then by name.
+std::vector<std::pair<std::string, std::size_t>>
+sortHistogram(std::vector<std::pair<std::string, std::size_t>> counts)
+{
+    std::sort(counts.begin(), counts.end(), [](const auto& l, const auto& r)
+    {
+        return l.second != r.second ? l.second > r.second : l.first < r.first;
+    });
+    return counts;
+}
+
+}
+
+std::vector<std::pair<std::string, std::size_t>>
+vm::VM::opcodeHistogram() const
+{
+    std::vector<std::pair<std::string, std::size_t>> res;
+#if SEMISTACK_OPCODE_HISTOGRAM
+    for (std::size_t i = 0; i < kInstTypeCount; ++i)
+    {
+        if (_opcodeCounts[i])
+        {
+            res.emplace_back(to_string(static_cast<InstType>(i)),
+                             _opcodeCounts[i]);
+        }
+    }
+#endif
+    return sortHistogram(std::move(res));
+}
+
+std::vector<std::pair<std::string, std::size_t>>
+vm::VM::opcodePairHistogram() const
+{
+    std::vector<std::pair<std::string, std::size_t>> res;
+#if SEMISTACK_OPCODE_HISTOGRAM
+    for (std::size_t i = 0; i < kInstTypeCount; ++i)
+    {
+        for (std::size_t j = 0; j < kInstTypeCount; ++j)
+        {
+            if (_opcodePairCounts[i][j])
+            {
+                res.emplace_back(to_string(static_cast<InstType>(i)) + " "
+                                 + to_string(static_cast<InstType>(j)),
+                                 _opcodePairCounts[i][j]);
+            }
+        }
+    }
+#endif
+    return sortHistogram(std::move(res));
+}
+
+bool vm::VM::compileAhead(const std::string& fn_name, const std::string& entry,
+                          std::ostream& out)
+{
+    auto root = prepare(fn_name, true);
+    if (root && ! _verified)
+    {
+        logger()->error("Only verified programs can be compiled ahead of time");
+        return false;
+    }
+    return root && aot::emitProgram(_functions, _fnLookup, root.value(),
+                                    entry, out);
+}
+
 ExitStatus vm::VM::runFunction(const Function& m)
 {
-    auto nextInstruction = [this]()-> Instruction&
+    // The other engines trust the code they run so programs that haven't
+    // been verified run on the checked simple engine.
+    switch (_verified ? _options._engine : Engine::simple)
     {
-        auto& m =  _functions.at(_callStack.top()._fnIndex);
-        return m._instructions.at(_callStack.top()._pc++);
-    };
-    
+        case Engine::simple:
+            if (_observing)
+            {
+                return _verified ? runSimple<false, true>()
+                                 : runSimple<true, true>();
+            }
+            return _verified ? runSimple<false, false>()
+                             : runSimple<true, false>();
+        case Engine::threaded:
+            return runThreaded();
+        case Engine::tailcall:
+            return runTailCall();
+        case Engine::registers:
+            return runRegisters();
+        case Engine::jit:
+            return runJit();
+    }
+    return ExitStatus::error;
+}
+
+bool vm::VM::reportError(std::string what)
+{
+    logger()->error(std::move(what));
+    return false;
+}
+
+bool vm::VM::checkDepth(std::size_t n)
+{
+    const Value* base = _callStack.empty() ? _valueStack.begin()
+                                           : _callStack.top()._base;
+    return static_cast<std::size_t>(_valueStack._sp - base) >= n
+        || reportError("Stack underflow.");
+}
+
+bool vm::VM::checkRoom(std::size_t n)
+{
+    return _valueStack.room() >= n || reportError("Value stack overflow.");
+}
+
+bool vm::VM::checkIndex(std::int32_t i, std::size_t size, const char* what)
+{
+    return (i >= 0 && static_cast<std::size_t>(i) < size)
+        || reportError(std::string(what) + " index out of range.");
+}
+
+template<bool kChecked, bool kProfile>
+ExitStatus vm::VM::runSimple()
+{
     ExitStatus res = ExitStatus::cont;
     while (res == ExitStatus::cont)
     {
-        auto& instruction = nextInstruction();
-        res = runInstruction(instruction);
+        auto& frame = _callStack.top();
+        auto& code = _functions[frame._fnIndex]._code;
+        if (kChecked && frame._pc >= code.size())
+        {
+            reportError("Ran off the end of a function.");
+            return ExitStatus::error;
+        }
+        if ( ! kProfile )
+        {
+            res = runInstruction<kChecked>(code[frame._pc++]);
+            continue;
+        }
+        
+        // frame is gone after a ret so anything needed from it is copied.
+        // Calls are counted by pushFrame and replaceFrame.
+        const FnIndex fn = frame._fnIndex;
+        const std::size_t pc = frame._pc++;
+        Word& instruction = code[pc];
+        if (_options._profile)
+        {
+            ++_profile[fn]._instructions;
+            ++_genericCounts[static_cast<std::size_t>(
+                genericOf(opcode(instruction)))];
+        }
+        res = runInstruction<kChecked>(instruction);
+        if (res != ExitStatus::cont)
+        {
+            break;
+        }
+        switch (opcode(instruction))
+        {
+            case InstType::call:
+            case InstType::tailcall:
+            case InstType::ret:
+                break;
+            default:
+                // Everything else stays in the frame and only jumps move
+                // its pc anywhere but forward by one.
+                if (frame._pc <= pc)
+                {
+                    backEdge(fn);
+                }
+                break;
+        }
     }
     return res;
 }
 
-// TODO: How can we remove all these damn type checks.
-// One idea is to run some sort of "verifyFunction" function before we attempt
-// to run everything that makes sure things are typed correctly. This still
-// does totally remove things for when there are multiple supported types,
-// but would be a nice touch. Such a function could also hold some state and
-// give better error messages!
-//
-// My thought on that is that we'd be able to reuse all of the code in here
-// anyway, so we might as well write this for now and then move it out.
-ExitStatus VM::runInstruction(const Instruction& instruction)
+void vm::VM::sample()
+{
+    if (_callStack.empty())
+    {
+        return;
+    }
+    std::vector<std::pair<FnIndex, std::size_t>> stack;
+    for (auto frame = _callStack.begin(); frame != _callStack.end(); ++frame)
+    {
+        // Frames under the top one have moved past the call they are in.
+        const bool top = frame + 1 == _callStack.end();
+        stack.emplace_back(frame->_fnIndex, top ? frame->_pc : frame->_pc - 1);
+    }
+    ++_samples[stack];
+}
+
+std::string vm::VM::collapsedStacks() const
 {
-    switch (instruction.first) {
+    std::vector<std::string> names(_functions.size());
+    for (const auto& [name, index] : _fnLookup)
+    {
+        names[index] = name;
+    }
+    
+    std::string res;
+    for (const auto& [stack, count] : _samples)
+    {
+        for (std::size_t i = 0; i < stack.size(); ++i)
+        {
+            res += (i ? ";" : "") + names[stack[i].first] + "@"
+                 + std::to_string(stack[i].second);
+        }
+        res += " " + std::to_string(count) + "\n";
+    }
+    return res;
+}
+
+transform::FusionCounts vm::VM::fusionRuns() const
+{
+    transform::FusionCounts res;
+    for (std::size_t i = 0; i < kInstTypeCount; ++i)
+    {
+        const InstType t = static_cast<InstType>(i);
+        if (_genericCounts[i] && transform::isSuperinstruction(t))
+        {
+            res[t] = _genericCounts[i];
+        }
+    }
+    return res;
+}
+
+std::vector<FunctionProfile> vm::VM::profile() const
+{
+    std::vector<FunctionProfile> res = _profile;
+    for (const auto& [name, index] : _fnLookup)
+    {
+        if (index < res.size())
+        {
+            res[index]._function = name;
+        }
+    }
+    std::stable_sort(res.begin(), res.end(), [](const FunctionProfile& l,
+                                                const FunctionProfile& r)
+    {
+        return std::make_tuple(l._instructions, l._calls, l._backEdges)
+             > std::make_tuple(r._instructions, r._calls, r._backEdges);
+    });
+    return res;
+}
+
+// Immediates have been checked and packed into each instruction's operand by
+// transform::lowerFunction. If the program was verified that is all the
+// checking we need other than the types of values on the stack. Otherwise
+// kChecked is set and we check stack depths and indices as we go.
+template<bool kChecked>
+ExitStatus VM::runInstruction(Word& instruction)
+{
+    const std::int32_t op = operand(instruction);
+    
+#if SEMISTACK_OPCODE_HISTOGRAM
+    const auto t = static_cast<std::size_t>(opcode(instruction));
+    ++_opcodeCounts[t];
+    if (_lastOpcode != kInstTypeCount)
+    {
+        ++_opcodePairCounts[_lastOpcode][t];
+    }
+    _lastOpcode = t;
+#endif
+    
+    switch (opcode(instruction)) {
         case InstType::pi:
         {
-            const auto& imm = instruction.second;
-            if( ! imm.has_value() )
+            // Constants are immutable so pushing one is a reference count
+            // bump at worst.
+            const auto& fn = _functions[_callStack.top()._fnIndex];
+            if (kChecked && ( ! checkRoom(1)
+                             || ! checkIndex(op, fn._constants.size(), "Constant")))
             {
-                logger()->error("Expected immediate in pi instruction.");
                 return ExitStatus::error;
             }
-            // Need to make a copy here.
-            Value v = imm.value();
-            _valueStack.emplace(std::move(v));
+            _valueStack.push(fn._constants[op]);
             return ExitStatus::cont;
         }
         case InstType::sl:
-        {
-            const auto& imm = instruction.second;
-            if( ! imm.has_value() )
-            {
-                logger()->error("Expected immediate in sl instruction.");
-                return ExitStatus::error;
-            }
-            auto fq = util::get<float>(imm.value());
-            if ( ! fq )
+            if (kChecked && ( ! checkDepth(1)
+                             || ! checkIndex(op, localCount(), "Local")))
             {
-                logger()->error("Got non-float type in sl immediate.");
                 return ExitStatus::error;
             }
-            float index = fq.value();
-            _callStack.top()._locals.at(index) = std::move(_valueStack.top());
+            _callStack.top()._locals[op] = std::move(_valueStack.top());
             _valueStack.pop();
             return ExitStatus::cont;
-        }
         case InstType::ll:
-        {
-            const auto& imm = instruction.second;
-            if( ! imm.has_value() )
-            {
-                logger()->error("Expected immediate in ll instruction.");
-                return ExitStatus::error;
-            }
-            auto fq = util::get<float>(imm.value());
-            if ( ! fq )
+            if (kChecked && ( ! checkRoom(1)
+                             || ! checkIndex(op, localCount(), "Local")))
             {
-                logger()->error("Got non-float type in ll immediate.");
                 return ExitStatus::error;
             }
-            float index = fq.value();
-            _valueStack.push(Value(_callStack.top()._locals.at(index)));
+            _valueStack.push(_callStack.top()._locals[op]);
             return ExitStatus::cont;
-        }
         case InstType::sg:
-        {
-            const auto& imm = instruction.second;
-            if( ! imm.has_value() )
-            {
-                logger()->error("Expected immediate in sg instruction.");
-                return ExitStatus::error;
-            }
-            auto fq = util::get<float>(imm.value());
-            if ( ! fq )
+            if (kChecked && ( ! checkDepth(1)
+                             || ! checkIndex(op, kGlobalCount, "Global")))
             {
-                logger()->error("Got non-float type in sg immediate.");
                 return ExitStatus::error;
             }
-            float index = fq.value();
-            _globals.at(index) = std::move(_valueStack.top());
+            _globals[op] = std::move(_valueStack.top());
             _valueStack.pop();
             return ExitStatus::cont;
-        }
         case InstType::lg:
-        {
-            const auto& imm = instruction.second;
-            if( ! imm.has_value() )
-            {
-                logger()->error("Expected immediate in lg instruction.");
-                return ExitStatus::error;
-            }
-            auto fq = util::get<float>(imm.value());
-            if ( ! fq )
+            if (kChecked && ( ! checkRoom(1)
+                             || ! checkIndex(op, kGlobalCount, "Global")))
             {
-                logger()->error("Got non-float type in lg immediate.");
                 return ExitStatus::error;
             }
-            float index = fq.value();
-            _valueStack.push(Value(_globals.at(index)));
+            _valueStack.push(_globals[op]);
             return ExitStatus::cont;
-        }
         case InstType::puts:
+            if (kChecked && ! checkDepth(1)) return ExitStatus::error;
             _outputFn(vm::to_string(_valueStack.top()));
             _valueStack.pop();
             return ExitStatus::cont;
         case InstType::copy:
-            _valueStack.push(Value(_valueStack.top()));
+            if (kChecked && ( ! checkDepth(1) || ! checkRoom(1)))
+            {
+                return ExitStatus::error;
+            }
+            _valueStack.push(_valueStack.top());
             return ExitStatus::cont;
         case InstType::exit:
             return ExitStatus::exit;
         case InstType::ret:
-            _callStack.pop();
-            return ExitStatus::cont;
+            popFrame();
+            // Returning from the top level function stops execution.
+            return _callStack.empty() ? ExitStatus::ret : ExitStatus::cont;
         case InstType::add:
+        case InstType::sub:
+        case InstType::mul:
+        case InstType::div:
+            if (kChecked && ! checkDepth(2)) return ExitStatus::error;
+            return arithmetic(opcode(instruction), &instruction)
+                ? ExitStatus::cont : ExitStatus::error;
+        case InstType::jump:
+            // The program counter has already been moved to the next
+            // instruction, hence the -1. Where it lands is checked before the
+            // next instruction is fetched.
+            _callStack.top()._pc += (op - 1);
+            return ExitStatus::cont;
+        case InstType::jeq:
+        case InstType::jneq:
+        case InstType::jlt:
+        case InstType::jgt:
         {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value& left(_valueStack.top());
-            
-            if (!util::holds_same(right, left))
+            if (kChecked && ! checkDepth(2)) return ExitStatus::error;
+            auto taken = compare(opcode(instruction), &instruction);
+            if ( ! taken )
             {
-                logger()->error("Different types in add instruction");
                 return ExitStatus::error;
             }
-            
-            if (util::holds<float>(right))
+            if (taken.value())
             {
-                auto lq = util::get<float>(left);
-                auto rq = util::get<float>(right);
-                _valueStack.top() = lq.value() + rq.value();
-                return ExitStatus::cont;
+                _callStack.top()._pc += (op - 1);
             }
-            
-            if (util::holds<std::string>(right))
-            {
-                auto lq = util::get<std::string>(left);
-                auto rq = util::get<std::string>(right);
-                _valueStack.top() = lq.value().get() + rq.value().get();
-                return ExitStatus::cont;
-            }
-            
-            logger()->error("Unsupported types in add instruction.");
-            return ExitStatus::error;
+            return ExitStatus::cont;
         }
-        case InstType::sub:
-        {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value& left(_valueStack.top());
-            
-            if (!util::holds_same(right, left))
+        case InstType::call:
+            if (kChecked && ( ! checkIndex(op, _functions.size(), "Function")
+                             || ! checkDepth(_functions[op]._arity.value_or(0))))
             {
-                logger()->error("Different types in sub instruction");
                 return ExitStatus::error;
             }
-            
-            if (util::holds<float>(right))
+            return pushFrame(op) ? ExitStatus::cont : ExitStatus::error;
+        case InstType::tailcall:
+            if (kChecked && ( ! checkIndex(op, _functions.size(), "Function")
+                             || ! checkDepth(_functions[op]._arity.value_or(0))))
             {
-                auto lq = util::get<float>(left);
-                auto rq = util::get<float>(right);
-                _valueStack.top() = lq.value() - rq.value();
-                return ExitStatus::cont;
+                return ExitStatus::error;
             }
-            
-            logger()->error("Unsupported types in sub instruction.");
-            return ExitStatus::error;
-        }
-        case InstType::mul:
+            return replaceFrame(op) ? ExitStatus::cont : ExitStatus::error;
+        case InstType::add_imm:
+        case InstType::sub_imm:
         {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value& left(_valueStack.top());
-            
-            if (!util::holds_same(right, left))
+            // Superinstructions are made by us so their operands are fine.
+            if (kChecked && ! checkDepth(1)) return ExitStatus::error;
+            const auto& fn = _functions[_callStack.top()._fnIndex];
+            InstType arith = opcode(instruction) == InstType::add_imm
+                ? InstType::add : InstType::sub;
+            return arithmetic(arith, _valueStack.top(), fn._constants[op],
+                              &instruction)
+                ? ExitStatus::cont : ExitStatus::error;
+        }
+        case InstType::ll_add:
+            if (kChecked && ( ! checkDepth(1)
+                             || ! checkIndex(op, localCount(), "Local")))
             {
-                logger()->error("Different types in mul instruction");
                 return ExitStatus::error;
             }
-            
-            if (util::holds<float>(right))
+            return arithmetic(InstType::add, _valueStack.top(),
+                              _callStack.top()._locals[op], &instruction)
+                ? ExitStatus::cont : ExitStatus::error;
+        case InstType::jlt_imm:
+        case InstType::jgt_imm:
+        case InstType::copy_jlt_imm:
+        case InstType::copy_jgt_imm:
+        {
+            if (kChecked && ! checkDepth(1)) return ExitStatus::error;
+            const auto& fn = _functions[_callStack.top()._fnIndex];
+            InstType t = opcode(instruction);
+            InstType cmp = (t == InstType::jlt_imm || t == InstType::copy_jlt_imm)
+                ? InstType::jlt : InstType::jgt;
+            auto taken = compare(cmp, _valueStack.top(),
+                                 fn._constants[highOperand(instruction)],
+                                 &instruction);
+            if (t == InstType::jlt_imm || t == InstType::jgt_imm)
             {
-                auto lq = util::get<float>(left);
-                auto rq = util::get<float>(right);
-                _valueStack.top() = lq.value() * rq.value();
-                return ExitStatus::cont;
+                _valueStack.pop();
             }
-            
-            logger()->error("Unsupported types in mul instruction.");
-            return ExitStatus::error;
-        }
-        case InstType::div:
-        {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value& left(_valueStack.top());
-            
-            if (!util::holds_same(right, left))
+            if ( ! taken )
             {
-                logger()->error("Different types in div instruction");
                 return ExitStatus::error;
             }
-            
-            if (util::holds<float>(right))
+            if (taken.value())
             {
-                auto lq = util::get<float>(left);
-                auto rq = util::get<float>(right);
-                _valueStack.top() = lq.value() / rq.value();
-                return ExitStatus::cont;
+                _callStack.top()._pc += (lowOperand(instruction) - 1);
             }
-            
-            logger()->error("Unsupported types in div instruction.");
-            return ExitStatus::error;
+            return ExitStatus::cont;
         }
-        case InstType::jump:
+        // Quickened instructions are checked like the generic ones they came
+        // from. Without the verifier the same instruction can run again at a
+        // different depth.
+        case InstType::add_num:
+        case InstType::add_str:
+        case InstType::sub_num:
+            if (kChecked && ! checkDepth(2)) return ExitStatus::error;
+            return arithmeticQuick(opcode(instruction), instruction)
+                ? ExitStatus::cont : ExitStatus::error;
+        case InstType::add_imm_num:
+        case InstType::sub_imm_num:
         {
-            if ( ! instruction.second.has_value() )
+            if (kChecked && ! checkDepth(1)) return ExitStatus::error;
+            const auto& fn = _functions[_callStack.top()._fnIndex];
+            return arithmeticQuick(opcode(instruction), _valueStack.top(),
+                                   fn._constants[op], instruction)
+                ? ExitStatus::cont : ExitStatus::error;
+        }
+        case InstType::ll_add_num:
+            if (kChecked && ( ! checkDepth(1)
+                             || ! checkIndex(op, localCount(), "Local")))
             {
-                logger()->error("No immediate for jump instruction.");
                 return ExitStatus::error;
             }
-            auto fq = util::get<float>(instruction.second.value());
-            if ( ! fq )
+            return arithmeticQuick(opcode(instruction), _valueStack.top(),
+                                   _callStack.top()._locals[op], instruction)
+                ? ExitStatus::cont : ExitStatus::error;
+        case InstType::jeq_num:
+        case InstType::jeq_str:
+        case InstType::jlt_num:
+        case InstType::jgt_num:
+        {
+            if (kChecked && ! checkDepth(2)) return ExitStatus::error;
+            auto taken = compareQuick(opcode(instruction), instruction);
+            if ( ! taken )
             {
-                logger()->error("Unexpected non-float type in jump instruction.");
                 return ExitStatus::error;
             }
-            float distance = fq.value();
-            // The program counter has already been moved to the next
-            // instruction, hence the -1.
-            _callStack.top()._pc += (distance - 1);
-            return ExitStatus::cont;
-        }
-        case InstType::jeq:
-        {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value left(std::move(_valueStack.top()));
-            _valueStack.pop();
-            
-            if (left == right)
+            if (taken.value())
             {
-                return runInstruction({vm::InstType::jump, instruction.second});
+                _callStack.top()._pc += (op - 1);
             }
             return ExitStatus::cont;
         }
-        case InstType::jneq:
+        case InstType::jlt_imm_num:
+        case InstType::jgt_imm_num:
+        case InstType::copy_jlt_imm_num:
+        case InstType::copy_jgt_imm_num:
         {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value left(std::move(_valueStack.top()));
-            _valueStack.pop();
-            
-            if (left != right)
+            if (kChecked && ! checkDepth(1)) return ExitStatus::error;
+            const auto& fn = _functions[_callStack.top()._fnIndex];
+            InstType t = opcode(instruction);
+            auto taken = compareQuick(t, _valueStack.top(),
+                                      fn._constants[highOperand(instruction)],
+                                      instruction);
+            if (t == InstType::jlt_imm_num || t == InstType::jgt_imm_num)
             {
-                return runInstruction({vm::InstType::jump, instruction.second});
-            }
-            return ExitStatus::cont;
-        }
-        case InstType::jgt:
-        {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value left(std::move(_valueStack.top()));
-            _valueStack.pop();
-            
-            // Relative comparasons aren't quite as clean here as function's
-            // aren't comparable leading to UB if we're not careful. See:
-            // https://en.cppreference.com/w/cpp/utility/variant/operator_cmp
-            
-            if (! util::holds_same(right, left))
-            {
-                logger()->error("Type missmatch in jgt instruction.");
-                return ExitStatus::error;
+                _valueStack.pop();
             }
-            
-            if (util::holds<std::shared_ptr<Function>>(right))
+            if ( ! taken )
             {
-                logger()->error("Function type in jgt instruction.");
                 return ExitStatus::error;
             }
-            
-            // See above link for why this works.
-            if (left > right)
+            if (taken.value())
             {
-                return runInstruction({vm::InstType::jump, instruction.second});
+                _callStack.top()._pc += (lowOperand(instruction) - 1);
             }
-            
             return ExitStatus::cont;
         }
-        case InstType::jlt:
+        case InstType::label:
+            logger()->maintain(false,
+                               "Label instructions should not be executed.");
+            return ExitStatus::error;
+    }
+    // We should never reach this if all of our instructions are properly
+    // implemented.
+    return ExitStatus::error;
+}
+
+// Computed gotos are a GCC extension that clang also supports. They let every
+// instruction jump straight to the next one's handler which gives the branch
+// predictor one indirect jump per instruction to learn rather than a single
+// shared one at the top of a switch.
+#if defined(__GNUC__)
+#define SEMISTACK_COMPUTED_GOTO 1
+#else
+#define SEMISTACK_COMPUTED_GOTO 0
+#endif
+
+// The threaded interpreter core. Unlike runInstruction this keeps the current
+// function's code, constants, and program counter in locals and only touches
+// the call stack when a call or ret happens. Without computed gotos it falls
+// back to a switch.
+ExitStatus vm::VM::runThreaded()
+{
+    CallFrame* frame;
+    Word* code;
+    const Value* constants;
+    Word* pc;
+    Word instruction;
+    
+    // Caches the frame on top of the call stack in the locals above.
+    auto enter = [&]()
+    {
+        frame = &_callStack.top();
+        Function& fn = _functions[frame->_fnIndex];
+        code = fn._code.data();
+        constants = fn._constants.data();
+        pc = code + frame->_pc;
+    };
+    
+    // The inverse of enter. Stores the program counter back into the frame.
+    auto leave = [&]()
+    {
+        frame->_pc = pc - code;
+    };
+    
+    enter();
+    
+#if SEMISTACK_COMPUTED_GOTO
+    // Filled in each time we start running rather than as a static array so
+    // that the order here doesn't need to match the order of InstType.
+    void* targets[kInstTypeCount];
+    targets[static_cast<std::size_t>(InstType::pi)] = &&target_pi;
+    targets[static_cast<std::size_t>(InstType::sl)] = &&target_sl;
+    targets[static_cast<std::size_t>(InstType::ll)] = &&target_ll;
+    targets[static_cast<std::size_t>(InstType::sg)] = &&target_sg;
+    targets[static_cast<std::size_t>(InstType::lg)] = &&target_lg;
+    targets[static_cast<std::size_t>(InstType::puts)] = &&target_puts;
+    targets[static_cast<std::size_t>(InstType::copy)] = &&target_copy;
+    targets[static_cast<std::size_t>(InstType::exit)] = &&target_exit;
+    targets[static_cast<std::size_t>(InstType::ret)] = &&target_ret;
+    targets[static_cast<std::size_t>(InstType::add)] = &&target_add;
+    targets[static_cast<std::size_t>(InstType::sub)] = &&target_sub;
+    targets[static_cast<std::size_t>(InstType::mul)] = &&target_mul;
+    targets[static_cast<std::size_t>(InstType::div)] = &&target_div;
+    targets[static_cast<std::size_t>(InstType::jump)] = &&target_jump;
+    targets[static_cast<std::size_t>(InstType::call)] = &&target_call;
+    targets[static_cast<std::size_t>(InstType::tailcall)] = &&target_tailcall;
+    targets[static_cast<std::size_t>(InstType::jeq)] = &&target_jeq;
+    targets[static_cast<std::size_t>(InstType::jneq)] = &&target_jneq;
+    targets[static_cast<std::size_t>(InstType::jlt)] = &&target_jlt;
+    targets[static_cast<std::size_t>(InstType::jgt)] = &&target_jgt;
+    targets[static_cast<std::size_t>(InstType::add_imm)] = &&target_add_imm;
+    targets[static_cast<std::size_t>(InstType::sub_imm)] = &&target_sub_imm;
+    targets[static_cast<std::size_t>(InstType::ll_add)] = &&target_ll_add;
+    targets[static_cast<std::size_t>(InstType::jlt_imm)] = &&target_jlt_imm;
+    targets[static_cast<std::size_t>(InstType::jgt_imm)] = &&target_jgt_imm;
+    targets[static_cast<std::size_t>(InstType::copy_jlt_imm)] = &&target_copy_jlt_imm;
+    targets[static_cast<std::size_t>(InstType::copy_jgt_imm)] = &&target_copy_jgt_imm;
+    targets[static_cast<std::size_t>(InstType::add_num)] = &&target_add_num;
+    targets[static_cast<std::size_t>(InstType::add_str)] = &&target_add_str;
+    targets[static_cast<std::size_t>(InstType::sub_num)] = &&target_sub_num;
+    targets[static_cast<std::size_t>(InstType::jeq_num)] = &&target_jeq_num;
+    targets[static_cast<std::size_t>(InstType::jeq_str)] = &&target_jeq_str;
+    targets[static_cast<std::size_t>(InstType::jlt_num)] = &&target_jlt_num;
+    targets[static_cast<std::size_t>(InstType::jgt_num)] = &&target_jgt_num;
+    targets[static_cast<std::size_t>(InstType::add_imm_num)] = &&target_add_imm_num;
+    targets[static_cast<std::size_t>(InstType::sub_imm_num)] = &&target_sub_imm_num;
+    targets[static_cast<std::size_t>(InstType::ll_add_num)] = &&target_ll_add_num;
+    targets[static_cast<std::size_t>(InstType::jlt_imm_num)] = &&target_jlt_imm_num;
+    targets[static_cast<std::size_t>(InstType::jgt_imm_num)] = &&target_jgt_imm_num;
+    targets[static_cast<std::size_t>(InstType::copy_jlt_imm_num)] = &&target_copy_jlt_imm_num;
+    targets[static_cast<std::size_t>(InstType::copy_jgt_imm_num)] = &&target_copy_jgt_imm_num;
+    targets[static_cast<std::size_t>(InstType::label)] = &&target_label;
+    
+#define TARGET(op) case InstType::op: target_##op
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        instruction = *pc++;                                                   \
+        goto *targets[static_cast<std::size_t>(opcode(instruction))];          \
+    } while (0)
+#else
+#define TARGET(op) case InstType::op
+#define DISPATCH() continue
+#endif
+// Jumps distance from the instruction being run, telling backEdge if it went
+// back.
+#define JUMP(distance)                                                         \
+    do {                                                                       \
+        const std::int32_t d = (distance);                                     \
+        pc += d - 1;                                                           \
+        if (d <= 0 && _observing)                                              \
+        {                                                                      \
+            leave();                                                           \
+            backEdge(frame->_fnIndex);                                         \
+        }                                                                      \
+    } while (0)
+    
+    for (;;)
+    {
+        instruction = *pc++;
+        switch (opcode(instruction))
         {
-            Value right(std::move(_valueStack.top()));
-            _valueStack.pop();
-            Value left(std::move(_valueStack.top()));
-            _valueStack.pop();
-            
-            // Relative comparasons aren't quite as clean here as function's
-            // aren't comparable leading to UB if we're not careful. See:
-            // https://en.cppreference.com/w/cpp/utility/variant/operator_cmp
-            
-            if (! util::holds_same(right, left))
-            {
-                logger()->error("Type missmatch in jlt instruction.");
-                return ExitStatus::error;
+            TARGET(pi):
+                _valueStack.push(constants[operand(instruction)]);
+                DISPATCH();
+            TARGET(sl):
+                frame->_locals[operand(instruction)] = std::move(_valueStack.top());
+                _valueStack.pop();
+                DISPATCH();
+            TARGET(ll):
+                _valueStack.push(frame->_locals[operand(instruction)]);
+                DISPATCH();
+            TARGET(sg):
+                _globals[operand(instruction)] = std::move(_valueStack.top());
+                _valueStack.pop();
+                DISPATCH();
+            TARGET(lg):
+                _valueStack.push(_globals[operand(instruction)]);
+                DISPATCH();
+            TARGET(puts):
+                _outputFn(vm::to_string(_valueStack.top()));
+                _valueStack.pop();
+                DISPATCH();
+            TARGET(copy):
+                _valueStack.push(_valueStack.top());
+                DISPATCH();
+            TARGET(exit):
+                leave();
+                return ExitStatus::exit;
+            TARGET(ret):
+                popFrame();
+                if (_callStack.empty())
+                {
+                    return ExitStatus::ret;
+                }
+                enter();
+                DISPATCH();
+            TARGET(add):
+                if ( ! arithmetic(InstType::add, pc - 1) ) goto error;
+                DISPATCH();
+            TARGET(sub):
+                if ( ! arithmetic(InstType::sub, pc - 1) ) goto error;
+                DISPATCH();
+            TARGET(mul):
+                if ( ! arithmetic(InstType::mul) ) goto error;
+                DISPATCH();
+            TARGET(div):
+                if ( ! arithmetic(InstType::div) ) goto error;
+                DISPATCH();
+            TARGET(jump):
+                JUMP(operand(instruction));
+                DISPATCH();
+            TARGET(call):
+                leave();
+                if ( ! pushFrame(operand(instruction)) ) goto error;
+                enter();
+                DISPATCH();
+            TARGET(tailcall):
+                if ( ! replaceFrame(operand(instruction)) ) goto error;
+                enter();
+                DISPATCH();
+            TARGET(jeq):
+            {
+                auto taken = compare(InstType::jeq, pc - 1);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
             }
-            
-            if (util::holds<std::shared_ptr<Function>>(right))
+            TARGET(jneq):
             {
-                logger()->error("Function type in jlt instruction.");
-                return ExitStatus::error;
+                auto taken = compare(InstType::jneq);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
             }
-            
-            // See above link for why this works.
-            if (left < right)
+            TARGET(jlt):
             {
-                return runInstruction({vm::InstType::jump, instruction.second});
+                auto taken = compare(InstType::jlt, pc - 1);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
             }
-            
-            return ExitStatus::cont;
-        }
-        case InstType::call:
-        {
-            const auto& imm = instruction.second;
-            if( ! imm.has_value() )
+            TARGET(jgt):
             {
-                logger()->error("Expected immediate in sg instruction.");
-                return ExitStatus::error;
+                auto taken = compare(InstType::jgt, pc - 1);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
             }
-            
-            if ( ! util::holds<float>(imm.value()) )
+            TARGET(add_imm):
+                if ( ! arithmetic(InstType::add, _valueStack.top(),
+                                  constants[operand(instruction)], pc - 1) )
+                {
+                    goto error;
+                }
+                DISPATCH();
+            TARGET(sub_imm):
+                if ( ! arithmetic(InstType::sub, _valueStack.top(),
+                                  constants[operand(instruction)], pc - 1) )
+                {
+                    goto error;
+                }
+                DISPATCH();
+            TARGET(ll_add):
+                if ( ! arithmetic(InstType::add, _valueStack.top(),
+                                  frame->_locals[operand(instruction)],
+                                  pc - 1) )
+                {
+                    goto error;
+                }
+                DISPATCH();
+            TARGET(jlt_imm):
             {
-                logger()->error("Wrong type in call instruction.");
-                return ExitStatus::error;
+                auto taken = compare(InstType::jlt, _valueStack.top(),
+                                     constants[highOperand(instruction)],
+                                     pc - 1);
+                _valueStack.pop();
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
             }
-            float index = util::get<float>(imm.value()).value();
-            _callStack.emplace(index);
-            return ExitStatus::cont;
+            TARGET(jgt_imm):
+            {
+                auto taken = compare(InstType::jgt, _valueStack.top(),
+                                     constants[highOperand(instruction)],
+                                     pc - 1);
+                _valueStack.pop();
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
+            }
+            TARGET(copy_jlt_imm):
+            {
+                auto taken = compare(InstType::jlt, _valueStack.top(),
+                                     constants[highOperand(instruction)],
+                                     pc - 1);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
+            }
+            TARGET(copy_jgt_imm):
+            {
+                auto taken = compare(InstType::jgt, _valueStack.top(),
+                                     constants[highOperand(instruction)],
+                                     pc - 1);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
+            }
+            TARGET(add_num):
+                if ( ! arithmeticQuick(InstType::add_num, pc[-1]) ) goto error;
+                DISPATCH();
+            TARGET(add_str):
+                if ( ! arithmeticQuick(InstType::add_str, pc[-1]) ) goto error;
+                DISPATCH();
+            TARGET(sub_num):
+                if ( ! arithmeticQuick(InstType::sub_num, pc[-1]) ) goto error;
+                DISPATCH();
+            TARGET(jeq_num):
+            {
+                auto taken = compareQuick(InstType::jeq_num, pc[-1]);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
+            }
+            TARGET(jeq_str):
+            {
+                auto taken = compareQuick(InstType::jeq_str, pc[-1]);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
+            }
+            TARGET(jlt_num):
+            {
+                auto taken = compareQuick(InstType::jlt_num, pc[-1]);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
+            }
+            TARGET(jgt_num):
+            {
+                auto taken = compareQuick(InstType::jgt_num, pc[-1]);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(operand(instruction));
+                DISPATCH();
+            }
+            TARGET(add_imm_num):
+                if ( ! arithmeticQuick(InstType::add_imm_num, _valueStack.top(),
+                                       constants[operand(instruction)], pc[-1]) )
+                {
+                    goto error;
+                }
+                DISPATCH();
+            TARGET(sub_imm_num):
+                if ( ! arithmeticQuick(InstType::sub_imm_num, _valueStack.top(),
+                                       constants[operand(instruction)], pc[-1]) )
+                {
+                    goto error;
+                }
+                DISPATCH();
+            TARGET(ll_add_num):
+                if ( ! arithmeticQuick(InstType::ll_add_num, _valueStack.top(),
+                                       frame->_locals[operand(instruction)],
+                                       pc[-1]) )
+                {
+                    goto error;
+                }
+                DISPATCH();
+            TARGET(jlt_imm_num):
+            {
+                auto taken = compareQuick(InstType::jlt_imm_num, _valueStack.top(),
+                                          constants[highOperand(instruction)],
+                                          pc[-1]);
+                _valueStack.pop();
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
+            }
+            TARGET(jgt_imm_num):
+            {
+                auto taken = compareQuick(InstType::jgt_imm_num, _valueStack.top(),
+                                          constants[highOperand(instruction)],
+                                          pc[-1]);
+                _valueStack.pop();
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
+            }
+            TARGET(copy_jlt_imm_num):
+            {
+                auto taken = compareQuick(InstType::copy_jlt_imm_num,
+                                          _valueStack.top(),
+                                          constants[highOperand(instruction)],
+                                          pc[-1]);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
+            }
+            TARGET(copy_jgt_imm_num):
+            {
+                auto taken = compareQuick(InstType::copy_jgt_imm_num,
+                                          _valueStack.top(),
+                                          constants[highOperand(instruction)],
+                                          pc[-1]);
+                if ( ! taken ) goto error;
+                if (taken.value()) JUMP(lowOperand(instruction));
+                DISPATCH();
+            }
+            TARGET(label):
+                logger()->maintain(false,
+                                   "Label instructions should not be executed.");
+                goto error;
         }
-        case InstType::label:
-            logger()->maintain(false,
-                               "Label instructions should not be executed.");
-            return ExitStatus::error;
+        // We should never reach this if all of our instructions are properly
+        // implemented.
+        goto error;
     }
-    // We should never reach this if all of our instructions are properly
-    // implemented.
+    
+#undef TARGET
+#undef DISPATCH
+#undef JUMP
+    
+error:
+    leave();
     return ExitStatus::error;
 }
+
+// The register tier runs functions it couldn't translate one instruction at a
+// time.
+template ExitStatus vm::VM::runInstruction<false>(Word& instruction);
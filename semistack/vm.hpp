@@ -6,6 +6,8 @@
 //  Copyright © 2020 Zeke Medley. All rights reserved.
 //
 
+#pragma once
+
 //  Add fns to the VM. VM processes them (takes away labels, replaces with
 //  absolute jumps). When we'd like to run the VM, add a new Frame to the stack
 //  and then continue execution as normal. We should be able to largely ignore
@@ -20,13 +22,30 @@
 
 #include "function.hpp"
 #include "instruction.hpp"
+#include "jit.hpp"
+#include "operations.hpp"
+#include "sampler.hpp"
+#include "strings.hpp"
+#include "transform.hpp"
 
 #include <vector>
 #include <array>
+#include <memory>
 #include <stack>
 #include <map>
 #include <functional>
 #include <iostream>
+#include <optional>
+#include <string>
+
+// Build with SEMISTACK_OPCODE_HISTOGRAM set to 1 to have runInstruction count
+// how many times each instruction and each pair of instructions in a row run.
+// Only instructions dispatched through it are counted, which is all of them on
+// the simple engine and the interpreted ones on the jit engine. Without it
+// nothing is counted and nothing is kept.
+#ifndef SEMISTACK_OPCODE_HISTOGRAM
+#define SEMISTACK_OPCODE_HISTOGRAM 0
+#endif
 
 namespace vm {
 
@@ -40,19 +59,136 @@ enum class ExitStatus: std::uint8_t
     cont,
 };
 
+// The interpreter loops that a VM can be built with. They all run the same
+// bytecode and should agree on everything but speed.
+enum class Engine: std::uint8_t
+{
+    simple,   // runInstruction in a loop. The easiest one to follow.
+    threaded, // Computed goto threaded core.
+    tailcall, // Every instruction is a function that tail calls the next.
+    registers, // Translates functions into register code. See registers.hpp.
+    jit,      // Compiles hot functions to machine code. See jit.hpp.
+};
+
+// Knobs that are fixed when a VM is built.
+struct Options
+{
+    Engine _engine = Engine::threaded;
+    // Run the peephole passes over functions as they are added.
+    bool _optimize = true;
+    // Check programs with verify::verifyFunctions before running them. Only
+    // verified programs can run on the threaded and tail call engines, the
+    // rest run on the simple engine with checks turned on. Programs the
+    // verifier rejects aren't run at all.
+    bool _verify = true;
+    // Fuse common instruction sequences into superinstructions.
+    bool _superinstructions = true;
+    // Rewrite generic instructions into versions specialized to the types
+    // they see as they run.
+    bool _quicken = true;
+    // How many values fit on the value stack. Running out is an error.
+    std::size_t _stackSize = 1 << 16;
+    // How many locals all of the frames on the call stack can have between
+    // them. Running out is an error.
+    std::size_t _localStackSize = 1 << 16;
+    // How many times a function is called before the jit engine compiles it.
+    std::size_t _jitThreshold = 100;
+    // How many times the jit engine's interpreter jumps back to the start of
+    // a loop before it traces it. 0 turns tracing off.
+    std::size_t _traceThreshold = 50;
+    // Count what each function does for VM::profile. Every engine counts
+    // calls and back edges but only the simple engine counts instructions.
+    bool _profile = false;
+    // Sample the call stack for VM::collapsedStacks every this many
+    // microseconds of CPU time. 0 turns sampling off. Every engine takes
+    // samples at calls, returns, and back edges. See sampler.hpp.
+    std::size_t _sampleInterval = 0;
+};
+
+// What a function did during a run.
+struct FunctionProfile
+{
+    std::string _function;
+    // Including the call that started the run if it started here.
+    std::size_t _calls = 0;
+    // How many instructions were dispatched. A superinstruction is one. Only
+    // the simple engine counts these.
+    std::size_t _instructions = 0;
+    // How many jumps went backward, which is once per trip around a loop.
+    std::size_t _backEdges = 0;
+};
+
+// The value stack. All of it is allocated up front so that pushes and pops
+// are a pointer bump and binary instructions can work on the top two slots in
+// place. Slots above the top always hold the number 0 so nothing there needs
+// releasing.
+class ValueStack
+{
+public:
+    ValueStack(std::size_t capacity)
+        : _slots(new Value[capacity]), _end(_slots.get() + capacity)
+    {
+        _sp = _slots.get();
+    }
+    
+    Value* begin() const { return _slots.get(); }
+    std::size_t size() const { return _sp - _slots.get(); }
+    // How many more values fit.
+    std::size_t room() const { return _end - _sp; }
+    
+    Value& top() { return _sp[-1]; }
+    
+    void push(const Value& v) { *_sp++ = v; }
+    void push(Value&& v) { *_sp++ = std::move(v); }
+    void pop() { *--_sp = Value(); }
+    
+    // Pushes n zeros and returns where they start.
+    Value* grow(std::size_t n)
+    {
+        Value* start = _sp;
+        _sp += n;
+        return start;
+    }
+    // Pops n values.
+    void shrink(std::size_t n)
+    {
+        while (n--) pop();
+    }
+    
+    // Points one past the top value.
+    Value* _sp;
+    
+private:
+    std::unique_ptr<Value[]> _slots;
+    Value* _end;
+};
+
 struct CallFrame
 {
     // The instruction that this frame is on.
     std::size_t _pc;
     // The Function that this frame is executing.
     FnIndex _fnIndex;
-    // Local variables inside of this call frame.
-    // NOTE: This means that we're restricting a program to only 256 local
-    // variables at a time. In exchange, we get some performance, and our sl, ll
-    // instructions are made simpler because they can just specify an index.
-    std::array<Value, 256> _locals;
+    // Local variables inside of this call frame, a window exactly as big as
+    // the function's _localCount. sl and ll just index into it. Functions with
+    // an _arity have their window on the value stack, starting at their
+    // arguments. The rest have theirs on the VM's local stack.
+    Value* _locals;
+    // The lowest the value stack can go while this frame runs.
+    Value* _base;
     
-    CallFrame(FnIndex mi): _fnIndex(mi), _pc(0) {}
+    // VM::enterFrame sets up the rest.
+    CallFrame(FnIndex mi): _pc(0), _fnIndex(mi), _locals(nullptr),
+                           _base(nullptr) {}
+};
+
+// A std::stack that can also be walked from the bottom frame up, for the
+// sampling profiler.
+class CallStack: public std::stack<CallFrame>
+{
+public:
+    auto begin() const { return c.begin(); }
+    auto end() const { return c.end(); }
 };
 
 class VM
@@ -60,26 +196,520 @@ class VM
 public:
     VM(): _outputFn([](std::string s){ std::cout << s << "\n"; }) {}
     VM(std::function<void(std::string)> fn): _outputFn(std::move(fn)) {}
+    VM(std::function<void(std::string)> fn, Options options)
+        : _outputFn(std::move(fn)), _options(options) {}
     
     // Adds a function to the VM and associate it with name.
     bool addFunction(vm::Function m, std::string name);
     // Runs the selected function.
     ExitStatus run(std::string fn_name);
+    // Writes the program that starts in the selected function out as C++
+    // with an entry point called entry, instead of running it. The program
+    // has to verify whatever the options say. See aot.hpp.
+    bool compileAhead(const std::string& fn_name, const std::string& entry,
+                      std::ostream& out);
+    
+    // What the peephole passes did to the functions added so far.
+    const transform::OptimizationStats& optimizationStats() const
+    {
+        return _optimizationStats;
+    }
+    // The function added as name, or nullptr. After a run this shows what
+    // the VM made of it.
+    const Function* function(const std::string& name) const
+    {
+        auto where = _fnLookup.find(name);
+        return where == _fnLookup.end() ? nullptr : &_functions[where->second];
+    }
+    // How many of each superinstruction the last run made, which is how many
+    // there are in the code rather than how often they ran.
+    const transform::FusionCounts& fusionCounts() const { return _fusionCounts; }
+    // How many times each superinstruction ran during the last run, counting
+    // its quickened versions. Only the simple engine counts these and only if
+    // the VM was built with Options::_profile.
+    transform::FusionCounts fusionRuns() const;
+    // Did the last run compile the function added as name to machine code?
+    bool compiled(const std::string& name) const
+    {
+        auto where = _fnLookup.find(name);
+        return where != _fnLookup.end() && where->second < _native.size()
+            && _native[where->second];
+    }
+    // The loops that the last run traced and how each of their traces did.
+    std::vector<jit::TraceStats> traceStats() const;
+    // What each function did during the last run, hottest first. Only
+    // complete if the VM was built with Options::_profile, and then only the
+    // simple engine counts instructions. The jit engine always counts calls
+    // and the back edges that it interprets as that is how it decides what to
+    // compile.
+    std::vector<FunctionProfile> profile() const;
+    // How many times each instruction ran during the last run, most first.
+    // Pairs are named "first second". Empty unless the VM was built with
+    // SEMISTACK_OPCODE_HISTOGRAM.
+    std::vector<std::pair<std::string, std::size_t>> opcodeHistogram() const;
+    std::vector<std::pair<std::string, std::size_t>> opcodePairHistogram() const;
+    // The short strings this VM has interned. See strings.hpp.
+    const StringTable& strings() const { return _strings; }
+    // The call stacks that the last run was sampled in, one line each with
+    // how many times it was seen, in the collapsed format that flame graph
+    // tools read:
+    //
+    //     main@3;fib@7;fib@2 12
+    //
+    // Each frame is the function's name and the instruction in its _code that
+    // it was on, or in its _registerCode if the registers engine ran it. Empty unless the VM was built with Options::_sampleInterval.
+    std::string collapsedStacks() const;
     
 private:
+    // Links, looks up, and lowers the program that starts in fn_name and
+    // verifies it if verify is set. Returns the index of fn_name or nothing
+    // after logging.
+    std::optional<FnIndex> prepare(const std::string& fn_name, bool verify);
     ExitStatus runFunction(const vm::Function& m);
-    ExitStatus runInstruction(const Instruction& instruction);
+    // kProfile is for runs that are _observing. It looks for back edges and
+    // counts instructions if profiling.
+    template<bool kChecked, bool kProfile> ExitStatus runSimple();
+    // Records where every frame on the call stack is for collapsedStacks.
+    void sample();
+    // Takes a sample if one is due.
+    void poll();
+    // Called by the engines when a call reaches the function at index.
+    void called(FnIndex index);
+    // Called by the engines after a jump back in the function at index, once
+    // the top frame's _pc is where it went. Only needed if _observing.
+    void backEdge(FnIndex index);
+    template<bool kChecked> ExitStatus runInstruction(Word& instruction);
+    ExitStatus runThreaded();
+    ExitStatus runTailCall();
+    // Runs register code where functions have it and stack code where they
+    // don't. Lives in registers.cpp.
+    ExitStatus runRegisters();
+    ExitStatus runRegisterCode();
+    // Runs machine code where functions have it and interprets them where
+    // they don't. Lives in jit.cpp.
+    ExitStatus runJit();
+    // Counts a call to the function at index and compiles it once it is hot.
+    // Returns its machine code if it has any.
+    const jit::NativeCode* jitCall(FnIndex index);
+    // Called by runJit after the interpreter jumps back to frame's _pc. Counts
+    // trips around the loop that starts there, traces it once it is hot, and
+    // runs the trace once there is one.
+    ExitStatus loopBack(CallFrame& frame);
+    // Adds the instruction at pc that frame is about to run to the trace
+    // being recorded, or stops recording if it can't be traced.
+    void record(const CallFrame& frame, std::size_t pc, Word instruction);
+    
+    // site is the instruction being run. If it is given the instruction is
+    // quickened for the types it runs on.
+    bool arithmetic(InstType op, Word* site = nullptr);
+    bool arithmetic(InstType op, Value& left, const Value& right,
+                    Word* site = nullptr);
+    std::optional<bool> compare(InstType op, Word* site = nullptr);
+    std::optional<bool> compare(InstType op, const Value& left,
+                                const Value& right, Word* site = nullptr);
+    void quicken(Word* site, const Value& left, const Value& right);
+    // The quickened instructions. If the guard fails these turn site back
+    // into the generic instruction and do what it would have.
+    bool arithmeticQuick(InstType quick, Word& site);
+    bool arithmeticQuick(InstType quick, Value& left, const Value& right,
+                         Word& site);
+    std::optional<bool> compareQuick(InstType quick, Word& site);
+    std::optional<bool> compareQuick(InstType quick, const Value& left,
+                                     const Value& right, Word& site);
+    // Logs what and returns false.
+    bool reportError(std::string what);
+    // Checks for programs that haven't been verified. Log and return false.
+    bool checkDepth(std::size_t n);
+    bool checkIndex(std::int32_t i, std::size_t size, const char* what);
+    // How many locals the current frame has.
+    std::size_t localCount() const
+    {
+        return _functions[_callStack.top()._fnIndex]._localCount;
+    }
+    // Checks that n more values fit on the stack. Verified programs only need
+    // to do this when they call a function.
+    bool checkRoom(std::size_t n);
+    
+    // Pushes a frame for a call to the function at index, or logs and returns
+    // false if there isn't room for it.
+    bool pushFrame(FnIndex index);
+    // Pops the top frame and clears its locals. A windowed frame's return
+    // values are moved down to where its arguments were.
+    void popFrame();
+    // Does a popFrame and then a pushFrame but reuses the top frame, so tail
+    // calls don't grow the call stack.
+    bool replaceFrame(FnIndex index);
+    // Gives frame a window for the locals of the function at index.
+    bool enterFrame(CallFrame& frame, FnIndex index);
+    // Clears frame's window.
+    void leaveFrame(const CallFrame& frame);
+    
+    // The tail call engine's handlers live in tailcall.cpp.
+    friend struct TailCallEngine;
+    // So are the helpers that machine code calls. See jit.cpp.
+    friend struct JitRuntime;
     
     std::function<void(std::string)> _outputFn;
+    Options _options;
+    // Set once the program being run has passed the verifier.
+    bool _verified = false;
+    // Set for runs that are profiled or sampled, which is when the engines
+    // have to tell backEdge about jumps back.
+    bool _observing = false;
+    // Set for runs that count calls, which the jit engine always does.
+    bool _countingCalls = false;
+    // Set while the sampler's timer is running.
+    bool _sampling = false;
     
-    std::array<Value, 256> _globals;
+    std::array<Value, kGlobalCount> _globals;
+    
+    transform::OptimizationStats _optimizationStats;
+    transform::FusionCounts _fusionCounts;
     
     std::vector<Function> _functions;
     // Maps function name to function index.
     std::map<std::string, FnIndex> _fnLookup;
+    // Short strings that constants and concatenation have made.
+    StringTable _strings;
+    
+    ValueStack _valueStack{_options._stackSize};
+    // Every frame's locals, one window per frame.
+    ValueStack _localStack{_options._localStackSize};
+    CallStack _callStack;
+    
+    // Where the tail call engine picks back up after each instruction when
+    // the compiler can't promise tail calls. See tailcall.cpp.
+    struct Resume
+    {
+        Word* _pc;
+        Value* _sp;
+        CallFrame* _frame;
+        const Value* _constants;
+    } _resume;
     
-    std::stack<Value> _valueStack;
-    std::stack<CallFrame> _callStack;
+    // Each function's machine code, or nullptr if it hasn't been compiled.
+    std::vector<std::unique_ptr<jit::NativeCode>> _native;
+    // What each function has done this run, without names. See profile().
+    std::vector<FunctionProfile> _profile;
+    // How many times each generic instruction ran this run, indexed by
+    // opcode. See fusionRuns().
+    std::array<std::size_t, kInstTypeCount> _genericCounts{};
+    // How many times each call stack was sampled, from the bottom frame up,
+    // as function indices and pcs.
+    std::map<std::vector<std::pair<FnIndex, std::size_t>>, std::size_t> _samples;
+    
+#if SEMISTACK_OPCODE_HISTOGRAM
+    // Indexed by opcode. _lastOpcode is kInstTypeCount before the first
+    // instruction of a run.
+    std::array<std::size_t, kInstTypeCount> _opcodeCounts{};
+    std::array<std::array<std::size_t, kInstTypeCount>,
+               kInstTypeCount> _opcodePairCounts{};
+    std::size_t _lastOpcode = kInstTypeCount;
+#endif
+    // How many native calls deep the jit engine is.
+    std::size_t _nativeDepth = 0;
+    // Where a native tail call finds its callee's locals.
+    Value* _nativeLocals = nullptr;
+    
+    // A trace being recorded, of the loop starting at _start.
+    struct Recording
+    {
+        FnIndex _fnIndex;
+        std::size_t _start;
+        std::vector<jit::TraceStep> _steps;
+    };
+    std::optional<Recording> _recording;
+    // Loops by function and where they start. How many times the interpreter
+    // has jumped back to each, and their traces once they have them. A loop's
+    // trace is nullptr if it couldn't be compiled.
+    std::map<std::pair<FnIndex, std::size_t>, std::size_t> _loopCounts;
+    std::map<std::pair<FnIndex, std::size_t>,
+             std::unique_ptr<jit::Trace>> _traces;
 };
 
+
+
+// --- implementation --- //
+
+
+
+// The instruction helpers below are shared by every dispatch loop so that they
+// all agree on what an instruction does. They return false after logging if
+// the values on the stack have the wrong types. They live here so that the
+// engines in other files can inline them.
+
+// add, sub, mul, and div. Replaces the left operand with the result in place
+// and pops the right one.
+inline bool VM::arithmetic(InstType op, Word* site)
+{
+    Value* sp = _valueStack._sp;
+    if ( ! arithmetic(op, sp[-2], sp[-1], site) )
+    {
+        return false;
+    }
+    _valueStack.pop();
+    return true;
+}
+
+// Replaces left with left op right. Superinstructions use this directly with a
+// right operand that isn't on the stack.
+inline bool VM::arithmetic(InstType op, Value& left, const Value& right,
+                           Word* site)
+{
+    quicken(site, left, right);
+    ops::Error e = ops::arithmetic(op, left, right);
+    if (e != ops::Error::none)
+    {
+        return reportError(ops::message(e, op));
+    }
+    _strings.intern(left);
+    return true;
+}
+
+// jeq, jneq, jlt, and jgt. Pops both operands and returns if the jump should
+// be taken, or std::nullopt on an error.
+inline std::optional<bool> VM::compare(InstType op, Word* site)
+{
+    Value* sp = _valueStack._sp;
+    auto taken = compare(op, sp[-2], sp[-1], site);
+    _valueStack.pop();
+    _valueStack.pop();
+    return taken;
+}
+
+// The same as above but the operands don't come off the stack.
+inline std::optional<bool> VM::compare(InstType op, const Value& left,
+                                       const Value& right, Word* site)
+{
+    quicken(site, left, right);
+    bool taken = false;
+    ops::Error e = ops::compare(op, left, right, taken);
+    if (e != ops::Error::none)
+    {
+        reportError(ops::message(e, op));
+        return std::nullopt;
+    }
+    return taken;
+}
+
+inline void VM::poll()
+{
+    if (_sampling && sampler::pending)
+    {
+        sampler::pending = 0;
+        sample();
+    }
+}
+
+inline void VM::called(FnIndex index)
+{
+    if (_countingCalls)
+    {
+        ++_profile[index]._calls;
+    }
+    poll();
+}
+
+inline void VM::backEdge(FnIndex index)
+{
+    if (_options._profile)
+    {
+        ++_profile[index]._backEdges;
+    }
+    poll();
+}
+
+inline bool VM::pushFrame(FnIndex index)
+{
+    _callStack.emplace(index);
+    const bool ok = enterFrame(_callStack.top(), index);
+    called(index);
+    return ok;
+}
+
+inline void VM::popFrame()
+{
+    leaveFrame(_callStack.top());
+    _callStack.pop();
+    poll();
+}
+
+inline bool VM::replaceFrame(FnIndex index)
+{
+    CallFrame& frame = _callStack.top();
+    leaveFrame(frame);
+    const bool ok = enterFrame(frame, index);
+    called(index);
+    return ok;
+}
+
+inline bool VM::enterFrame(CallFrame& frame, FnIndex index)
+{
+    const Function& fn = _functions[index];
+    frame._fnIndex = index;
+    frame._pc = 0;
+    if (fn._arity)
+    {
+        // The arguments are already where the first locals go.
+        std::size_t arity = fn._arity.value();
+        if ( ! checkRoom(fn._localCount - arity + fn._maxStack) )
+        {
+            return false;
+        }
+        frame._locals = _valueStack._sp - arity;
+        _valueStack.grow(fn._localCount - arity);
+        frame._base = _valueStack._sp;
+        return true;
+    }
+    
+    if ( ! checkRoom(fn._maxStack) )
+    {
+        return false;
+    }
+    if (_localStack.room() < fn._localCount)
+    {
+        return reportError("Local stack overflow.");
+    }
+    frame._locals = _localStack.grow(fn._localCount);
+    frame._base = _valueStack.begin();
+    return true;
+}
+
+inline void VM::leaveFrame(const CallFrame& frame)
+{
+    const Function& fn = _functions[frame._fnIndex];
+    if (fn._arity)
+    {
+        Value* results = std::move(frame._base, _valueStack._sp, frame._locals);
+        while (_valueStack._sp != results)
+        {
+            _valueStack.pop();
+        }
+    } else
+    {
+        _localStack.shrink(fn._localCount);
+    }
+}
+
+// Rewrites the instruction at site into the quickened version for left and
+// right, if there is one. The rewrite is in place so jump distances around it
+// don't change.
+inline void VM::quicken(Word* site, const Value& left, const Value& right)
+{
+    if (site && _options._quicken)
+    {
+        InstType t = quickenedOf(opcode(*site),
+                                 left.isNumber() && right.isNumber(),
+                                 left.isString() && right.isString());
+        *site = withOpcode(*site, t);
+    }
+}
+
+// add_num, add_str, sub_num, and the quickened arithmetic superinstructions.
+inline bool VM::arithmeticQuick(InstType quick, Word& site)
+{
+    Value* sp = _valueStack._sp;
+    if ( ! arithmeticQuick(quick, sp[-2], sp[-1], site) )
+    {
+        return false;
+    }
+    _valueStack.pop();
+    return true;
+}
+
+inline bool VM::arithmeticQuick(InstType quick, Value& left,
+                                const Value& right, Word& site)
+{
+    const bool numbers = left.isNumber() && right.isNumber();
+    switch (quick)
+    {
+        case InstType::add_num:
+        case InstType::add_imm_num:
+        case InstType::ll_add_num:
+            if (numbers)
+            {
+                left = left.asNumber() + right.asNumber();
+                return true;
+            }
+            break;
+        case InstType::sub_num:
+        case InstType::sub_imm_num:
+            if (numbers)
+            {
+                left = left.asNumber() - right.asNumber();
+                return true;
+            }
+            break;
+        case InstType::add_str:
+            if (left.isString() && right.isString())
+            {
+                left.append(right);
+                _strings.intern(left);
+                return true;
+            }
+            break;
+        default:
+            break;
+    }
+    
+    InstType generic = genericOf(quick);
+    site = withOpcode(site, generic);
+    bool sub = generic == InstType::sub || generic == InstType::sub_imm;
+    return arithmetic(sub ? InstType::sub : InstType::add, left, right);
+}
+
+// jeq_num, jeq_str, jlt_num, jgt_num, and the quickened comparison
+// superinstructions.
+inline std::optional<bool> VM::compareQuick(InstType quick, Word& site)
+{
+    Value* sp = _valueStack._sp;
+    auto taken = compareQuick(quick, sp[-2], sp[-1], site);
+    _valueStack.pop();
+    _valueStack.pop();
+    return taken;
+}
+
+inline std::optional<bool> VM::compareQuick(InstType quick, const Value& left,
+                                            const Value& right, Word& site)
+{
+    if (left.isNumber() && right.isNumber())
+    {
+        switch (quick)
+        {
+            case InstType::jeq_num:
+                return left.asNumber() == right.asNumber();
+            case InstType::jlt_num:
+            case InstType::jlt_imm_num:
+            case InstType::copy_jlt_imm_num:
+                return left.asNumber() < right.asNumber();
+            case InstType::jgt_num:
+            case InstType::jgt_imm_num:
+            case InstType::copy_jgt_imm_num:
+                return left.asNumber() > right.asNumber();
+            default:
+                break;
+        }
+    }
+    if (quick == InstType::jeq_str && left.isString() && right.isString())
+    {
+        return left == right;
+    }
+    
+    InstType generic = genericOf(quick);
+    site = withOpcode(site, generic);
+    switch (generic)
+    {
+        case InstType::jlt:
+        case InstType::jlt_imm:
+        case InstType::copy_jlt_imm:
+            return compare(InstType::jlt, left, right);
+        case InstType::jgt:
+        case InstType::jgt_imm:
+        case InstType::copy_jgt_imm:
+            return compare(InstType::jgt, left, right);
+        default:
+            return compare(generic, left, right);
+    }
+}
+
 }